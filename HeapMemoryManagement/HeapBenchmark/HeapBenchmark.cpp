@@ -0,0 +1,1447 @@
+#include "../HeapMemoryManagement/Heap.h"
+#include "../HeapMemoryManagement/Trace.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#endif
+
+
+// Allocator benchmark suite. Every workload runs against every selected allocator and thread
+// count and reports throughput, per-operation latency percentiles, peak RSS, heap footprint
+// and fragmentation as CSV or JSON, one row per run, for regression tracking.
+//
+// Workloads are seeded per thread, so two runs of the same build issue the same requests.
+// The "malloc" rows measure whichever malloc the process links; preloading jemalloc or
+// mimalloc (LD_PRELOAD, or linking it on Windows) turns them into that allocator's baseline.
+//
+// --experiments runs the feature comparisons instead, which print a short report each.
+
+// Object graph of the collector experiments, marked through its pointer map like any typed object
+struct GraphNode {
+    Ref<GraphNode> next;
+    Ref<GraphNode> left;
+    Ref<GraphNode> right;
+};
+HEAP_TYPE(GraphNode, HEAP_REFERENCE(GraphNode, next), HEAP_REFERENCE(GraphNode, left), HEAP_REFERENCE(GraphNode, right));
+
+namespace {
+
+    typedef std::chrono::steady_clock Clock;
+
+    // A live allocation as the workloads hold it. Heap frees by Block ID, malloc by address.
+    struct Allocation {
+        void* memory = nullptr;
+        int blockId = -1;
+    };
+
+    class BenchmarkAllocator {
+    public:
+        virtual ~BenchmarkAllocator() = default;
+        virtual bool Allocate(size_t size, Allocation& allocation) = 0;
+        virtual void Free(const Allocation& allocation) = 0;
+        // Batch entry points, one call per object unless the allocator has its own. Returns the count allocated;
+        // failed entries keep a null memory pointer.
+        virtual size_t AllocateBatch(const size_t* sizes, size_t count, Allocation* allocations) {
+            size_t allocated = 0;
+            for (size_t i = 0; i < count; ++i) {
+                if (Allocate(sizes[i], allocations[i])) ++allocated;
+            }
+            return allocated;
+        }
+        virtual void FreeBatch(const Allocation* allocations, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                Free(allocations[i]);
+            }
+        }
+        // References between allocations and collections, for the object graph workload
+        virtual void Link(const Allocation& /*source*/, size_t /*slot*/, const Allocation& /*target*/) {}
+        virtual void Collect() {}
+        // Bytes held from the OS, 0 if the allocator does not say
+        virtual size_t FootprintBytes() { return 0; }
+        // Share of free bytes outside the largest free block, negative if unknown
+        virtual double Fragmentation() { return -1.0; }
+    };
+
+    template <typename FitPolicy>
+    class HeapAllocator : public BenchmarkAllocator {
+    public:
+        explicit HeapAllocator(size_t threads) : heap(1 << 20, threads, 4, 0) {}
+
+        bool Allocate(size_t size, Allocation& allocation) override {
+            allocation.memory = heap.Allocate<FitPolicy>(size, &allocation.blockId);
+            return allocation.memory != nullptr;
+        }
+        void Free(const Allocation& allocation) override { heap.Deallocate(allocation.blockId); }
+        size_t AllocateBatch(const size_t* sizes, size_t count, Allocation* allocations) override {
+            memory.resize(count);
+            blockIds.resize(count);
+            size_t allocated = heap.AllocateBatch<FitPolicy>(sizes, count, memory.data(), blockIds.data());
+            for (size_t i = 0; i < count; ++i) {
+                allocations[i].memory = memory[i];
+                allocations[i].blockId = blockIds[i];
+            }
+            return allocated;
+        }
+        void FreeBatch(const Allocation* allocations, size_t count) override {
+            blockIds.resize(count);
+            for (size_t i = 0; i < count; ++i) {
+                blockIds[i] = allocations[i].blockId;
+            }
+            heap.DeallocateBatch(blockIds.data(), count);
+        }
+        void Link(const Allocation& source, size_t slot, const Allocation& target) override {
+            heap.SetPointer(source.blockId, slot, target.blockId);
+        }
+        void Collect() override { heap.RunGenerationalGC(); }
+        size_t FootprintBytes() override { return heap.GetReservedBytes(); }
+        double Fragmentation() override { return heap.GetFragmentation(); }
+
+    private:
+        Heap heap;
+        // Scratch arrays for the batch calls, one per thread
+        static thread_local std::vector<void*> memory;
+        static thread_local std::vector<int> blockIds;
+    };
+
+    template <typename FitPolicy>
+    thread_local std::vector<void*> HeapAllocator<FitPolicy>::memory;
+    template <typename FitPolicy>
+    thread_local std::vector<int> HeapAllocator<FitPolicy>::blockIds;
+
+    class MallocAllocator : public BenchmarkAllocator {
+    public:
+        bool Allocate(size_t size, Allocation& allocation) override {
+            allocation.memory = std::malloc(size);
+            return allocation.memory != nullptr;
+        }
+        void Free(const Allocation& allocation) override { std::free(allocation.memory); }
+    };
+
+    struct AllocatorEntry {
+        const char* name;
+        std::unique_ptr<BenchmarkAllocator>(*create)(size_t threads);
+        // Implements Link and Collect
+        bool graphs;
+    };
+
+    template <typename FitPolicy>
+    std::unique_ptr<BenchmarkAllocator> createHeapAllocator(size_t threads) {
+        return std::unique_ptr<BenchmarkAllocator>(new HeapAllocator<FitPolicy>(threads));
+    }
+
+    std::unique_ptr<BenchmarkAllocator> createMallocAllocator(size_t) {
+        return std::unique_ptr<BenchmarkAllocator>(new MallocAllocator());
+    }
+
+    const AllocatorEntry allocators[] = {
+        { "First-Fit", createHeapAllocator<FirstFit>, true },
+        { "Next-Fit", createHeapAllocator<NextFit>, true },
+        { "Best-Fit", createHeapAllocator<BestFit>, true },
+        { "Worst-Fit", createHeapAllocator<WorstFit>, true },
+        { "Buddy", createHeapAllocator<BuddySystem>, true },
+        { "malloc", createMallocAllocator, false },
+    };
+
+    // Process-wide peak resident set. Linux resets it before each run; Windows cannot,
+    // so there the value only grows across the runs of one invocation.
+    void resetPeakResidentBytes() {
+#if !defined(_WIN32)
+        if (std::FILE* file = std::fopen("/proc/self/clear_refs", "w")) {
+            std::fputs("5", file);
+            std::fclose(file);
+        }
+#endif
+    }
+
+    size_t peakResidentBytes() {
+#if defined(_WIN32)
+        PROCESS_MEMORY_COUNTERS counters;
+        if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+            return counters.PeakWorkingSetSize;
+        }
+        return 0;
+#else
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.compare(0, 6, "VmHWM:") == 0) {
+                return std::strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+            }
+        }
+        return 0;
+#endif
+    }
+
+    class Barrier {
+    public:
+        explicit Barrier(size_t count) : count(count) {}
+
+        void Wait() {
+            std::unique_lock<std::mutex> lock(mutex);
+            size_t arrivalGeneration = generation;
+            if (++arrived == count) {
+                arrived = 0;
+                ++generation;
+                released.notify_all();
+                return;
+            }
+            released.wait(lock, [&] { return generation != arrivalGeneration; });
+        }
+
+    private:
+        std::mutex mutex;
+        std::condition_variable released;
+        size_t count;
+        size_t arrived = 0;
+        size_t generation = 0;
+    };
+
+    // Hands allocations from a producer thread to the consumer that frees them
+    class AllocationQueue {
+    public:
+        void Push(const Allocation& allocation) {
+            std::unique_lock<std::mutex> lock(mutex);
+            notFull.wait(lock, [&] { return items.size() < capacity; });
+            items.push_back(allocation);
+            notEmpty.notify_one();
+        }
+
+        // False once the producer has closed the queue and it is empty
+        bool Pop(Allocation& allocation) {
+            std::unique_lock<std::mutex> lock(mutex);
+            notEmpty.wait(lock, [&] { return !items.empty() || closed; });
+            if (items.empty()) return false;
+            allocation = items.front();
+            items.pop_front();
+            notFull.notify_one();
+            return true;
+        }
+
+        void Close() {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            notEmpty.notify_all();
+        }
+
+    private:
+        static const size_t capacity = 1024;
+        std::mutex mutex;
+        std::condition_variable notEmpty;
+        std::condition_variable notFull;
+        std::deque<Allocation> items;
+        bool closed = false;
+    };
+
+    // One step of a replayed trace: allocate `size` bytes into `slot`, or free the slot
+    struct ReplayStep {
+        size_t size;
+        size_t slot;
+        bool free;
+    };
+
+    struct RunContext {
+        RunContext(BenchmarkAllocator& allocator, size_t threads, size_t operations, const std::vector<ReplayStep>& replay)
+            : allocator(allocator), threads(threads), operations(operations), replay(replay),
+            measured(threads + 1), queues((threads + 1) / 2), larsonSets(threads), larsonRound(threads) {}
+
+        BenchmarkAllocator& allocator;
+        size_t threads;
+        // Timed operations per thread
+        size_t operations;
+        const std::vector<ReplayStep>& replay;
+        // Workers stop here after the timed phase so the main thread can sample the heap
+        // with everything still live, and again before they free it
+        Barrier measured;
+        std::vector<AllocationQueue> queues;
+        std::vector<std::vector<Allocation>> larsonSets;
+        Barrier larsonRound;
+    };
+
+    struct ThreadResult {
+        Clock::time_point startTime;
+        size_t operations = 0;
+        size_t failures = 0;
+        std::vector<uint32_t> latencies;
+    };
+
+    // Times one allocator call; the clock reads are the same for every allocator
+    class Recorder {
+    public:
+        explicit Recorder(ThreadResult& result, size_t expected) : result(result) {
+            result.latencies.reserve(expected);
+        }
+
+        bool Allocate(BenchmarkAllocator& allocator, size_t size, Allocation& allocation) {
+            Clock::time_point start = Clock::now();
+            bool allocated = allocator.Allocate(size, allocation);
+            record(start);
+            if (!allocated) ++result.failures;
+            return allocated;
+        }
+
+        void Free(BenchmarkAllocator& allocator, const Allocation& allocation) {
+            Clock::time_point start = Clock::now();
+            allocator.Free(allocation);
+            record(start);
+        }
+
+        // A batch call is one latency sample but counts one operation per object, so throughput
+        // compares with single calls while the percentiles show the cost of a whole batch
+        size_t AllocateBatch(BenchmarkAllocator& allocator, const size_t* sizes, size_t count, Allocation* allocations) {
+            Clock::time_point start = Clock::now();
+            size_t allocated = allocator.AllocateBatch(sizes, count, allocations);
+            record(start, count);
+            result.failures += count - allocated;
+            return allocated;
+        }
+
+        void FreeBatch(BenchmarkAllocator& allocator, const Allocation* allocations, size_t count) {
+            Clock::time_point start = Clock::now();
+            allocator.FreeBatch(allocations, count);
+            record(start, count);
+        }
+
+        void Link(BenchmarkAllocator& allocator, const Allocation& source, size_t slot, const Allocation& target) {
+            Clock::time_point start = Clock::now();
+            allocator.Link(source, slot, target);
+            record(start);
+        }
+
+        void Collect(BenchmarkAllocator& allocator) {
+            Clock::time_point start = Clock::now();
+            allocator.Collect();
+            record(start);
+        }
+
+        size_t Operations() const { return result.operations; }
+
+    private:
+        ThreadResult& result;
+
+        void record(Clock::time_point start, size_t operations = 1) {
+            auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+            result.latencies.push_back(static_cast<uint32_t>(std::min<long long>(nanoseconds, UINT32_MAX)));
+            result.operations += operations;
+        }
+    };
+
+    void freeAll(BenchmarkAllocator& allocator, std::vector<Allocation>& live) {
+        for (const Allocation& allocation : live) {
+            allocator.Free(allocation);
+        }
+        live.clear();
+    }
+
+    // Random allocations and frees around a live set of liveTarget blocks per thread
+    template <typename SizeDistribution>
+    void runChurn(RunContext& context, size_t thread, ThreadResult& result, SizeDistribution sizes) {
+        const size_t liveTarget = 1000;
+        std::mt19937 gen(static_cast<unsigned>(1000 + thread));
+        Recorder recorder(result, context.operations);
+        std::vector<Allocation> live;
+        live.reserve(liveTarget * 2);
+
+        while (recorder.Operations() < context.operations) {
+            if (live.empty() || gen() % (2 * liveTarget) >= live.size()) {
+                Allocation allocation;
+                if (recorder.Allocate(context.allocator, sizes(gen), allocation)) {
+                    live.push_back(allocation);
+                }
+            }
+            else {
+                size_t index = gen() % live.size();
+                recorder.Free(context.allocator, live[index]);
+                live[index] = live.back();
+                live.pop_back();
+            }
+        }
+
+        context.measured.Wait();
+        context.measured.Wait();
+        freeAll(context.allocator, live);
+    }
+
+    void runUniform(RunContext& context, size_t thread, ThreadResult& result) {
+        std::uniform_int_distribution<size_t> sizes(16, 512);
+        runChurn(context, thread, result, [&](std::mt19937& gen) { return sizes(gen); });
+    }
+
+    void runLogNormal(RunContext& context, size_t thread, ThreadResult& result) {
+        // Median 64 bytes, with a long tail of larger objects as in most real programs
+        std::lognormal_distribution<double> sizes(std::log(64.0), 1.0);
+        runChurn(context, thread, result, [&](std::mt19937& gen) {
+            return static_cast<size_t>(std::min(std::max(sizes(gen), 8.0), 65536.0));
+            });
+    }
+
+    // Replays the recorded steps from the start whenever they run out, after freeing what is left
+    void runReplay(RunContext& context, size_t /*thread*/, ThreadResult& result) {
+        Recorder recorder(result, context.operations);
+        size_t slotCount = 0;
+        for (const ReplayStep& step : context.replay) {
+            slotCount = std::max(slotCount, step.slot + 1);
+        }
+        std::vector<Allocation> slots(slotCount);
+        std::vector<bool> used(slotCount, false);
+
+        size_t next = 0;
+        while (recorder.Operations() < context.operations) {
+            if (next == context.replay.size()) {
+                for (size_t i = 0; i < slotCount; ++i) {
+                    if (used[i]) recorder.Free(context.allocator, slots[i]);
+                }
+                used.assign(slotCount, false);
+                next = 0;
+            }
+            const ReplayStep& step = context.replay[next++];
+            if (step.free) {
+                if (used[step.slot]) recorder.Free(context.allocator, slots[step.slot]);
+                used[step.slot] = false;
+            }
+            else if (!used[step.slot]) {
+                used[step.slot] = recorder.Allocate(context.allocator, step.size, slots[step.slot]);
+            }
+        }
+
+        context.measured.Wait();
+        context.measured.Wait();
+        for (size_t i = 0; i < slotCount; ++i) {
+            if (used[i]) context.allocator.Free(slots[i]);
+        }
+    }
+
+    // Even threads allocate, the next odd thread frees; an unpaired last thread frees its own
+    void runProducerConsumer(RunContext& context, size_t thread, ThreadResult& result) {
+        std::mt19937 gen(static_cast<unsigned>(2000 + thread));
+        std::uniform_int_distribution<size_t> sizes(16, 512);
+        Recorder recorder(result, context.operations);
+        AllocationQueue& queue = context.queues[thread / 2];
+        bool producer = thread % 2 == 0;
+        bool paired = thread + 1 < context.threads;
+
+        if (producer && paired) {
+            while (recorder.Operations() < context.operations) {
+                Allocation allocation;
+                if (recorder.Allocate(context.allocator, sizes(gen), allocation)) {
+                    queue.Push(allocation);
+                }
+            }
+            queue.Close();
+        }
+        else if (producer) {
+            while (recorder.Operations() < context.operations) {
+                Allocation allocation;
+                if (recorder.Allocate(context.allocator, sizes(gen), allocation)) {
+                    recorder.Free(context.allocator, allocation);
+                }
+            }
+        }
+        else {
+            Allocation allocation;
+            while (queue.Pop(allocation)) {
+                recorder.Free(context.allocator, allocation);
+            }
+        }
+
+        context.measured.Wait();
+        context.measured.Wait();
+    }
+
+    // Larson: each thread replaces random blocks of its set, then the sets rotate so every
+    // thread frees blocks allocated by another
+    void runLarson(RunContext& context, size_t thread, ThreadResult& result) {
+        const size_t setSize = 1000;
+        const size_t rounds = 4;
+        std::mt19937 gen(static_cast<unsigned>(3000 + thread));
+        std::uniform_int_distribution<size_t> sizes(16, 256);
+        Recorder recorder(result, context.operations + setSize);
+
+        std::vector<Allocation>& initialSet = context.larsonSets[thread];
+        while (initialSet.size() < setSize) {
+            Allocation allocation;
+            if (!recorder.Allocate(context.allocator, sizes(gen), allocation)) break;
+            initialSet.push_back(allocation);
+        }
+
+        size_t stepsPerRound = context.operations / (2 * rounds);
+        for (size_t round = 0; round < rounds; ++round) {
+            context.larsonRound.Wait();
+            std::vector<Allocation>& set = context.larsonSets[(thread + round) % context.threads];
+            for (size_t step = 0; step < stepsPerRound && !set.empty(); ++step) {
+                size_t index = gen() % set.size();
+                recorder.Free(context.allocator, set[index]);
+                if (!recorder.Allocate(context.allocator, sizes(gen), set[index])) {
+                    set[index] = set.back();
+                    set.pop_back();
+                }
+            }
+        }
+
+        context.measured.Wait();
+        context.measured.Wait();
+        freeAll(context.allocator, context.larsonSets[(thread + rounds - 1) % context.threads]);
+    }
+
+    // threadtest: allocate a batch, free all of it, repeat
+    void runThreadTest(RunContext& context, size_t /*thread*/, ThreadResult& result) {
+        const size_t batchSize = 1000;
+        Recorder recorder(result, context.operations + 2 * batchSize);
+        std::vector<Allocation> batch;
+        batch.reserve(batchSize);
+
+        while (recorder.Operations() < context.operations) {
+            for (size_t i = 0; i < batchSize; ++i) {
+                Allocation allocation;
+                if (recorder.Allocate(context.allocator, 64, allocation)) {
+                    batch.push_back(allocation);
+                }
+            }
+            for (const Allocation& allocation : batch) {
+                recorder.Free(context.allocator, allocation);
+            }
+            batch.clear();
+        }
+
+        context.measured.Wait();
+        context.measured.Wait();
+    }
+
+    // Batches of small objects allocated and then freed together, through the batch entry points or,
+    // for comparison, one call per object. Both issue the same requests.
+    void runBatches(RunContext& context, size_t thread, ThreadResult& result, bool batched) {
+        const size_t batchSize = 32;
+        std::mt19937 gen(static_cast<unsigned>(5000 + thread));
+        std::uniform_int_distribution<size_t> sizes(16, 128);
+        Recorder recorder(result, context.operations / (batched ? batchSize : 1) + 2 * batchSize);
+        std::vector<size_t> batchSizes(batchSize);
+        std::vector<Allocation> batch(batchSize);
+
+        while (recorder.Operations() < context.operations) {
+            for (size_t& size : batchSizes) {
+                size = sizes(gen);
+            }
+            if (batched) {
+                recorder.AllocateBatch(context.allocator, batchSizes.data(), batchSize, batch.data());
+                batch.erase(std::remove_if(batch.begin(), batch.end(),
+                    [](const Allocation& allocation) { return allocation.memory == nullptr; }), batch.end());
+                recorder.FreeBatch(context.allocator, batch.data(), batch.size());
+            }
+            else {
+                batch.clear();
+                for (size_t size : batchSizes) {
+                    Allocation allocation;
+                    if (recorder.Allocate(context.allocator, size, allocation)) {
+                        batch.push_back(allocation);
+                    }
+                }
+                for (const Allocation& allocation : batch) {
+                    recorder.Free(context.allocator, allocation);
+                }
+            }
+            batch.resize(batchSize);
+        }
+
+        context.measured.Wait();
+        context.measured.Wait();
+    }
+
+    void runBatch(RunContext& context, size_t thread, ThreadResult& result) {
+        runBatches(context, thread, result, true);
+    }
+
+    void runBatchPerCall(RunContext& context, size_t thread, ThreadResult& result) {
+        runBatches(context, thread, result, false);
+    }
+
+    // Graphs of graphSize objects, each referencing two older ones, freed newest first so no
+    // live object ever references a freed one. Thread 0 also collects every tenth of its run.
+    void runGraphs(RunContext& context, size_t thread, ThreadResult& result) {
+        const size_t graphSize = 200;
+        std::mt19937 gen(static_cast<unsigned>(4000 + thread));
+        std::uniform_int_distribution<size_t> sizes(16, 256);
+        Recorder recorder(result, context.operations + 4 * graphSize);
+        std::vector<Allocation> graph;
+        graph.reserve(graphSize);
+        size_t collectionInterval = std::max<size_t>(context.operations / 10, 1);
+        size_t nextCollection = collectionInterval;
+
+        while (recorder.Operations() < context.operations) {
+            for (size_t i = 0; i < graphSize; ++i) {
+                Allocation allocation;
+                if (!recorder.Allocate(context.allocator, sizes(gen), allocation)) continue;
+                if (!graph.empty()) {
+                    recorder.Link(context.allocator, allocation, 0, graph[gen() % graph.size()]);
+                    recorder.Link(context.allocator, allocation, 1, graph[gen() % graph.size()]);
+                }
+                graph.push_back(allocation);
+            }
+            if (thread == 0 && recorder.Operations() >= nextCollection) {
+                recorder.Collect(context.allocator);
+                nextCollection += collectionInterval;
+            }
+            while (!graph.empty()) {
+                recorder.Free(context.allocator, graph.back());
+                graph.pop_back();
+            }
+        }
+
+        context.measured.Wait();
+        context.measured.Wait();
+    }
+
+    struct Workload {
+        const char* name;
+        void (*run)(RunContext& context, size_t thread, ThreadResult& result);
+        // Needs Link and Collect, so only the heap strategies run it
+        bool needsGraphs;
+        // Cross-thread frees need at least two threads
+        size_t minimumThreads;
+        bool needsReplay;
+    };
+
+    const Workload workloads[] = {
+        { "uniform", runUniform, false, 1, false },
+        { "lognormal", runLogNormal, false, 1, false },
+        { "replay", runReplay, false, 1, true },
+        { "producer-consumer", runProducerConsumer, false, 2, false },
+        { "larson", runLarson, false, 1, false },
+        { "threadtest", runThreadTest, false, 1, false },
+        { "batch", runBatch, false, 1, false },
+        { "batch-per-call", runBatchPerCall, false, 1, false },
+        { "gc-graph", runGraphs, true, 1, false },
+    };
+
+    struct RunResult {
+        std::string workload;
+        std::string allocator;
+        size_t threads;
+        size_t operations;
+        size_t failures;
+        double seconds;
+        double operationsPerSecond;
+        uint32_t p50;
+        uint32_t p99;
+        uint32_t p999;
+        size_t peakResidentBytes;
+        size_t footprintBytes;
+        double fragmentation;
+    };
+
+    uint32_t percentile(const std::vector<uint32_t>& sorted, double fraction) {
+        if (sorted.empty()) return 0;
+        size_t index = std::min(sorted.size() - 1, static_cast<size_t>(fraction * sorted.size()));
+        return sorted[index];
+    }
+
+    RunResult runOnce(const Workload& workload, const AllocatorEntry& entry, size_t threads, size_t operations,
+        const std::vector<ReplayStep>& replay) {
+        resetPeakResidentBytes();
+        std::unique_ptr<BenchmarkAllocator> allocator = entry.create(threads);
+        RunContext context(*allocator, threads, operations, replay);
+        std::vector<ThreadResult> results(threads);
+
+        // The heap reports collections and misuse on the console, which would skew the timing
+        std::streambuf* output = std::cout.rdbuf(nullptr);
+        std::streambuf* errors = std::cerr.rdbuf(nullptr);
+
+        Barrier start(threads + 1);
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([&, i] {
+                start.Wait();
+                results[i].startTime = Clock::now();
+                workload.run(context, i, results[i]);
+                });
+        }
+        start.Wait();
+        context.measured.Wait();
+        Clock::time_point endTime = Clock::now();
+        size_t footprintBytes = allocator->FootprintBytes();
+        double fragmentation = allocator->Fragmentation();
+        context.measured.Wait();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        size_t peakBytes = peakResidentBytes();
+        allocator.reset();
+
+        std::cout.rdbuf(output);
+        std::cerr.rdbuf(errors);
+
+        RunResult run;
+        run.workload = workload.name;
+        run.allocator = entry.name;
+        run.threads = threads;
+        run.operations = 0;
+        run.failures = 0;
+        std::vector<uint32_t> latencies;
+        Clock::time_point startTime = endTime;
+        for (ThreadResult& result : results) {
+            startTime = std::min(startTime, result.startTime);
+            run.operations += result.operations;
+            run.failures += result.failures;
+            latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+        }
+        std::sort(latencies.begin(), latencies.end());
+        run.seconds = std::chrono::duration<double>(endTime - startTime).count();
+        run.operationsPerSecond = run.seconds > 0 ? run.operations / run.seconds : 0;
+        run.p50 = percentile(latencies, 0.5);
+        run.p99 = percentile(latencies, 0.99);
+        run.p999 = percentile(latencies, 0.999);
+        run.peakResidentBytes = peakBytes;
+        run.footprintBytes = footprintBytes;
+        run.fragmentation = fragmentation;
+        return run;
+    }
+
+    // Allocate and Deallocate events of a heap trace (HEAP_TRACE_LEVEL >= 2), in time order.
+    // Block IDs become dense slots, so the steps replay against any allocator.
+    bool loadReplay(const std::string& path, std::vector<ReplayStep>& steps) {
+        std::FILE* file = std::fopen(path.c_str(), "rb");
+        if (!file) {
+            std::cerr << "Cannot open " << path << ".\n";
+            return false;
+        }
+        TraceFileHeader header;
+        bool valid = std::fread(&header, sizeof(header), 1, file) == 1 && std::memcmp(header.magic, traceMagic, 4) == 0
+            && header.version == traceVersion && header.recordSize == sizeof(TraceRecord);
+        std::vector<TraceRecord> records;
+        TraceRecord record;
+        while (valid && std::fread(&record, sizeof(record), 1, file) == 1) {
+            if (record.event == static_cast<uint16_t>(TraceEvent::Allocate) || record.event == static_cast<uint16_t>(TraceEvent::Deallocate)) {
+                records.push_back(record);
+            }
+        }
+        std::fclose(file);
+        if (!valid) {
+            std::cerr << path << " is not a heap trace of this version.\n";
+            return false;
+        }
+
+        // Each thread's records are flushed in order but threads interleave in the file
+        std::stable_sort(records.begin(), records.end(), [](const TraceRecord& a, const TraceRecord& b) {
+            return a.timestamp < b.timestamp;
+            });
+        std::unordered_map<uint64_t, size_t> slotsByBlockId;
+        std::vector<size_t> freeSlots;
+        size_t slotCount = 0;
+        for (const TraceRecord& traced : records) {
+            if (traced.event == static_cast<uint16_t>(TraceEvent::Allocate)) {
+                size_t slot;
+                if (!freeSlots.empty()) {
+                    slot = freeSlots.back();
+                    freeSlots.pop_back();
+                }
+                else {
+                    slot = slotCount++;
+                }
+                slotsByBlockId[traced.arguments[1]] = slot;
+                steps.push_back({ static_cast<size_t>(traced.arguments[0]), slot, false });
+            }
+            else {
+                auto it = slotsByBlockId.find(traced.arguments[0]);
+                if (it == slotsByBlockId.end()) continue;
+                steps.push_back({ 0, it->second, true });
+                freeSlots.push_back(it->second);
+                slotsByBlockId.erase(it);
+            }
+        }
+        if (steps.empty()) {
+            std::cerr << path << " has no allocation events, record it with HEAP_TRACE_LEVEL=2 or higher.\n";
+            return false;
+        }
+        return true;
+    }
+
+    std::vector<std::string> splitList(const std::string& list) {
+        std::vector<std::string> items;
+        std::stringstream stream(list);
+        std::string item;
+        while (std::getline(stream, item, ',')) {
+            if (!item.empty()) items.push_back(item);
+        }
+        return items;
+    }
+
+    void writeCsv(std::ostream& out, const std::vector<RunResult>& runs) {
+        out << "workload,allocator,threads,operations,failures,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,"
+            << "peak_rss_bytes,footprint_bytes,fragmentation\n";
+        for (const RunResult& run : runs) {
+            out << run.workload << ',' << run.allocator << ',' << run.threads << ',' << run.operations << ','
+                << run.failures << ',' << run.seconds << ',' << static_cast<uint64_t>(run.operationsPerSecond) << ','
+                << run.p50 << ',' << run.p99 << ',' << run.p999 << ',' << run.peakResidentBytes << ',';
+            if (run.footprintBytes > 0) out << run.footprintBytes;
+            out << ',';
+            if (run.fragmentation >= 0) out << run.fragmentation;
+            out << '\n';
+        }
+    }
+
+    void writeJson(std::ostream& out, const std::vector<RunResult>& runs) {
+        out << "[\n";
+        for (size_t i = 0; i < runs.size(); ++i) {
+            const RunResult& run = runs[i];
+            out << "  { \"workload\": \"" << run.workload << "\", \"allocator\": \"" << run.allocator
+                << "\", \"threads\": " << run.threads << ", \"operations\": " << run.operations
+                << ", \"failures\": " << run.failures << ", \"seconds\": " << run.seconds
+                << ", \"ops_per_sec\": " << static_cast<uint64_t>(run.operationsPerSecond)
+                << ", \"p50_ns\": " << run.p50 << ", \"p99_ns\": " << run.p99 << ", \"p999_ns\": " << run.p999
+                << ", \"peak_rss_bytes\": " << run.peakResidentBytes << ", \"footprint_bytes\": ";
+            if (run.footprintBytes > 0) out << run.footprintBytes;
+            else out << "null";
+            out << ", \"fragmentation\": ";
+            if (run.fragmentation >= 0) out << run.fragmentation;
+            else out << "null";
+            out << " }" << (i + 1 < runs.size() ? "," : "") << "\n";
+        }
+        out << "]\n";
+    }
+
+    // Experiments: comparisons of one heap feature against its alternative, each printing a short
+    // report rather than a row per run. They use the heap's public API like the workloads do.
+
+    typedef std::chrono::high_resolution_clock::time_point TimePoint;
+
+    double millisecondsBetween(TimePoint start, TimePoint end) {
+        return std::chrono::duration<double, std::milli>(end - start).count();
+    }
+
+    // Builds `count` nodes, each pointing at the one before it and at two random earlier ones, so
+    // the newest reaches them all; every rootInterval-th node is also kept rooted in `roots`
+    Root<GraphNode> buildGraph(Heap& heap, size_t count, size_t rootInterval, std::vector<Root<GraphNode>>& roots) {
+        std::vector<Ref<GraphNode>> nodes;
+        nodes.reserve(count);
+        std::mt19937 gen(42);
+        Root<GraphNode> head;
+        for (size_t i = 0; i < count; ++i) {
+            GraphNode node = {};
+            if (i > 0) {
+                std::uniform_int_distribution<size_t> target(0, i - 1);
+                node.next = nodes.back();
+                node.left = nodes[target(gen)];
+                node.right = nodes[target(gen)];
+            }
+            head = heap.New<GraphNode>(node);
+            if (head.IsNull()) break;
+            nodes.push_back(head.Get());
+            if (i % rootInterval == 0) {
+                roots.push_back(head);
+            }
+        }
+        return head;
+    }
+
+    // Allocate latency of each fit policy at 10k, 100k and 1M blocks with about half of them free.
+    // A linear scan would grow with the block count; the free block index should not.
+    void measureFitSearchScaling() {
+        const size_t blockCounts[] = { 10000, 100000, 1000000 };
+        const size_t queries = 200;
+        // Small requests search the exact bins, large ones the tree of large blocks
+        const size_t sizeRanges[][2] = { { 1, 200 }, { FreeBlockIndex::smallSizeLimit, 2048 } };
+
+        std::mt19937 gen(42);
+        for (size_t blockCount : blockCounts) {
+            Heap heap(1 << 20, 1, 4, 0);
+            heap.SetThreadCacheLimits(0, 1);
+
+            // Freeing a random half leaves free runs of many sizes between allocated blocks
+            std::uniform_int_distribution<size_t> fillSizes(16, 256);
+            std::vector<int> blockIds;
+            blockIds.reserve(blockCount);
+            for (size_t i = 0; i < blockCount; ++i) {
+                int blockId;
+                if (heap.Allocate<FirstFit>(fillSizes(gen), &blockId)) {
+                    blockIds.push_back(blockId);
+                }
+            }
+            for (int blockId : blockIds) {
+                if (gen() % 2 == 0) {
+                    heap.Deallocate(blockId);
+                }
+            }
+
+            for (const size_t* range : sizeRanges) {
+                std::uniform_int_distribution<size_t> sizeDistribution(range[0], range[1]);
+                std::vector<size_t> sizes(queries);
+                for (size_t& size : sizes) {
+                    size = sizeDistribution(gen);
+                }
+
+                auto measure = [&](const char* name, void* (Heap::*allocate)(size_t, int*)) {
+                    std::vector<int> allocated;
+                    allocated.reserve(queries);
+                    auto start = std::chrono::high_resolution_clock::now();
+                    for (size_t size : sizes) {
+                        int blockId;
+                        if ((heap.*allocate)(size, &blockId)) {
+                            allocated.push_back(blockId);
+                        }
+                    }
+                    auto end = std::chrono::high_resolution_clock::now();
+                    // Freed again so every policy searches the same free blocks
+                    for (int blockId : allocated) {
+                        heap.Deallocate(blockId);
+                    }
+                    auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / queries;
+                    std::cout << name << " for " << range[0] << "-" << range[1] << " bytes with " << blockCount
+                        << " blocks: " << nanoseconds << " ns/allocation\n";
+                };
+                measure("First-Fit", &Heap::Allocate<FirstFit>);
+                measure("Best-Fit", &Heap::Allocate<BestFit>);
+                measure("Worst-Fit", &Heap::Allocate<WorstFit>);
+            }
+        }
+    }
+
+    // Mark pause against mark thread count on large object graphs. The heap marks on as many
+    // threads as it was created for, so each thread count builds its own copy of the graph.
+    void measureParallelMarkScaling() {
+        const size_t nodeCounts[] = { 100000, 1000000 };
+        const size_t threadCounts[] = { 1, 2, 4, 8 };
+        const int runs = 3;
+
+        for (size_t nodeCount : nodeCounts) {
+            for (size_t threads : threadCounts) {
+                Heap heap(1 << 20, threads, 4, 0);
+                std::vector<Root<GraphNode>> roots;
+                Root<GraphNode> head = buildGraph(heap, nodeCount, 1000, roots);
+
+                // Collections report to the console
+                std::streambuf* output = std::cout.rdbuf(nullptr);
+                Heap::MarkStats best;
+                best.milliseconds = std::numeric_limits<double>::max();
+                for (int run = 0; run < runs; ++run) {
+                    heap.CollectGarbage();
+                    Heap::MarkStats mark = heap.GetLastMarkStats();
+                    if (mark.milliseconds < best.milliseconds) {
+                        best = mark;
+                    }
+                }
+                std::cout.rdbuf(output);
+
+                std::cout << "Mark of " << best.markedBlocks << " blocks on " << threads << " threads: "
+                    << best.milliseconds << " ms pause (best of " << runs << "), "
+                    << best.stolenTasks << " stolen tasks\n";
+            }
+        }
+    }
+
+    // Mutator allocation latency during a stop-the-world and a concurrent collection
+    void measureConcurrentGCPauses() {
+        const size_t nodeCount = 200000;
+
+        for (int concurrent = 0; concurrent < 2; ++concurrent) {
+            Heap heap(1 << 20, 2, 4, 0);
+            std::vector<Root<GraphNode>> roots;
+            Root<GraphNode> head = buildGraph(heap, nodeCount, 1000, roots);
+            std::streambuf* output = std::cout.rdbuf(nullptr);
+
+            // The mutator allocates once a millisecond and times each call while the collector runs
+            std::atomic<bool> collecting(true);
+            std::vector<double> latencies;
+            std::thread mutator([&heap, &collecting, &latencies]() {
+                while (collecting) {
+                    auto start = std::chrono::high_resolution_clock::now();
+                    heap.Allocate<FirstFit>(64);
+                    auto end = std::chrono::high_resolution_clock::now();
+                    latencies.push_back(millisecondsBetween(start, end));
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                });
+
+            auto startTime = std::chrono::high_resolution_clock::now();
+            if (concurrent) {
+                heap.RunConcurrentMarkAndSweep();
+                heap.WaitForConcurrentGC();
+            }
+            else {
+                heap.CollectGarbage();
+            }
+            auto endTime = std::chrono::high_resolution_clock::now();
+            collecting = false;
+            mutator.join();
+            std::cout.rdbuf(output);
+
+            std::sort(latencies.begin(), latencies.end());
+            double p99 = latencies.empty() ? 0 : latencies[latencies.size() * 99 / 100];
+            double maxLatency = latencies.empty() ? 0 : latencies.back();
+            std::cout << (concurrent ? "Concurrent" : "Stop-the-world") << " collection of " << nodeCount
+                << " nodes: " << millisecondsBetween(startTime, endTime) << " ms, " << latencies.size()
+                << " mutator allocations, allocation latency p99 " << p99 << " ms, max " << maxLatency << " ms\n";
+        }
+    }
+
+    // New throughput with and without the nursery on a mostly short-lived workload
+    void measureNurseryThroughput() {
+        const size_t allocations = 200000;
+        const size_t nurseryCapacity = 256 * 1024;
+        // One object in ten stays rooted, the rest are garbage as soon as their root goes
+        const double survivalRate = 0.1;
+
+        for (int useNursery = 0; useNursery < 2; ++useNursery) {
+            Heap heap(1 << 20, 1, 4, 0);
+            // Each minor collection reports to the console, which would skew the timing
+            std::streambuf* output = std::cout.rdbuf(nullptr);
+            std::streambuf* errors = std::cerr.rdbuf(nullptr);
+            heap.SetThreadCacheLimits(0, 1);
+            if (useNursery) {
+                heap.SetNursery(nurseryCapacity);
+            }
+
+            std::mt19937 gen(42);
+            std::uniform_real_distribution<double> survival(0.0, 1.0);
+            std::vector<Root<GraphNode>> survivors;
+            // Without the nursery, a generational collection runs whenever as many bytes as the nursery holds have been allocated
+            size_t bytesSinceCollection = 0;
+            auto startTime = std::chrono::high_resolution_clock::now();
+            for (size_t i = 0; i < allocations; ++i) {
+                Root<GraphNode> node = heap.New<GraphNode>();
+                if (node.IsNull()) break;
+                if (survival(gen) < survivalRate) {
+                    survivors.push_back(std::move(node));
+                }
+                bytesSinceCollection += sizeof(GraphNode);
+                if (!useNursery && bytesSinceCollection >= nurseryCapacity) {
+                    heap.RunGenerationalGC();
+                    bytesSinceCollection = 0;
+                }
+            }
+            auto endTime = std::chrono::high_resolution_clock::now();
+            std::cout.rdbuf(output);
+            std::cerr.rdbuf(errors);
+
+            double milliseconds = millisecondsBetween(startTime, endTime);
+            std::cout << (useNursery ? "Nursery" : "Free index") << ": " << allocations << " allocations in "
+                << milliseconds << " ms (" << allocations / milliseconds * 1000.0 << " per second), "
+                << survivors.size() << " survivors, " << heap.GetStats().minorCollections << " minor collections\n";
+        }
+    }
+
+    // The buddy system against Best-Fit on power-of-two-heavy sizes: throughput, internal and external fragmentation
+    void measureBuddyAgainstBestFit() {
+        const size_t operations = 200000;
+        const size_t liveTarget = 4000;
+
+        for (int buddy = 0; buddy < 2; ++buddy) {
+            Heap heap(1 << 20, 1, 4, 0);
+            // Keeps First-Fit fallback notices out of the timing
+            std::streambuf* output = std::cout.rdbuf(nullptr);
+            std::streambuf* errors = std::cerr.rdbuf(nullptr);
+            heap.SetThreadCacheLimits(0, 1);
+
+            // Sizes cluster around the powers of two from 16 bytes to 4 KiB
+            std::mt19937 gen(7);
+            std::uniform_int_distribution<int> orderDistribution(4, 12);
+            std::normal_distribution<double> jitter(0.0, 0.1);
+            // Block ID and requested size of every live block
+            std::vector<std::pair<int, size_t>> live;
+            auto startTime = std::chrono::high_resolution_clock::now();
+            for (size_t i = 0; i < operations; ++i) {
+                // Allocations outnumber frees until about liveTarget blocks are live
+                if (live.empty() || gen() % (2 * liveTarget) >= live.size()) {
+                    double scale = std::max(1.0 + jitter(gen), 0.5);
+                    size_t size = static_cast<size_t>((size_t(1) << orderDistribution(gen)) * scale);
+                    int blockId;
+                    void* memory = buddy ? heap.Allocate<BuddySystem>(size, &blockId) : heap.Allocate<BestFit>(size, &blockId);
+                    if (!memory) continue;
+                    live.emplace_back(blockId, size);
+                }
+                else {
+                    size_t index = gen() % live.size();
+                    heap.Deallocate(live[index].first);
+                    live[index] = live.back();
+                    live.pop_back();
+                }
+            }
+            auto endTime = std::chrono::high_resolution_clock::now();
+            std::cout.rdbuf(output);
+            std::cerr.rdbuf(errors);
+
+            // Internal: bytes allocated beyond the request. External: free bytes outside the largest free block.
+            size_t requestedBytes = 0;
+            for (const auto& entry : live) {
+                requestedBytes += entry.second;
+            }
+            HeapStats::Snapshot snapshot = heap.GetStats();
+            double milliseconds = millisecondsBetween(startTime, endTime);
+            double internalFragmentation = snapshot.liveBytes > 0 ? 100.0 * (snapshot.liveBytes - requestedBytes) / snapshot.liveBytes : 0.0;
+            std::cout << (buddy ? "Buddy" : "Best-Fit") << ": " << operations << " operations in " << milliseconds
+                << " ms (" << operations / milliseconds * 1000.0 << " per second), " << live.size() << " live blocks, "
+                << "internal fragmentation " << internalFragmentation << "%, external fragmentation "
+                << 100.0 * heap.GetFragmentation() << "%, " << snapshot.reservedSegments << " segments\n";
+        }
+    }
+
+    // Pauses and allocation latency of incremental and stop-the-world collection on one allocation-heavy workload
+    void measureIncrementalGCPauses() {
+        const size_t liveNodes = 20000;
+        const size_t sharedNodes = 2000;
+        const size_t allocations = 400000;
+        // The incremental pacer's defaults: a cycle starts once the heap has grown by its live bytes, and by 1 MiB at least
+        const double heapGrowth = 1.0;
+        const size_t minimumHeadroom = 1 << 20;
+
+        for (int incremental = 0; incremental < 2; ++incremental) {
+            Heap heap(1 << 20, 1, 4, 0);
+            // Collections report to the console, which would skew the timing
+            std::streambuf* output = std::cout.rdbuf(nullptr);
+            std::streambuf* errors = std::cerr.rdbuf(nullptr);
+            heap.SetIncrementalGC(incremental != 0);
+
+            // Each allocation replaces one node of a rooted window, and new nodes only point into a
+            // fixed shared set, so every replaced node is garbage
+            std::vector<Root<GraphNode>> shared;
+            for (size_t i = 0; i < sharedNodes; ++i) {
+                shared.push_back(heap.New<GraphNode>());
+            }
+            std::vector<Root<GraphNode>> live(liveNodes);
+            std::mt19937 gen(42);
+            std::uniform_int_distribution<size_t> target(0, sharedNodes - 1);
+
+            // Without incremental collection the heap is collected all at once when it has grown by
+            // the headroom the pacer plans incremental cycles with
+            size_t collectionTrigger = minimumHeadroom;
+            size_t allocatedBytes = 0;
+            size_t collections = 0;
+            std::vector<double> latencies;
+            latencies.reserve(allocations);
+            auto startTime = std::chrono::high_resolution_clock::now();
+            for (size_t i = 0; i < allocations; ++i) {
+                GraphNode node = {};
+                node.left = shared[target(gen)].Get();
+                node.right = shared[target(gen)].Get();
+                auto start = std::chrono::high_resolution_clock::now();
+                live[i % liveNodes] = heap.New<GraphNode>(node);
+                if (!incremental) {
+                    allocatedBytes += sizeof(GraphNode);
+                    if (allocatedBytes >= collectionTrigger) {
+                        heap.CollectGarbage();
+                        ++collections;
+                        allocatedBytes = 0;
+                        collectionTrigger = std::max(static_cast<size_t>(heap.GetStats().liveBytes * heapGrowth), minimumHeadroom);
+                    }
+                }
+                auto end = std::chrono::high_resolution_clock::now();
+                latencies.push_back(millisecondsBetween(start, end));
+            }
+            auto endTime = std::chrono::high_resolution_clock::now();
+            std::cout.rdbuf(output);
+            std::cerr.rdbuf(errors);
+
+            HeapStats::Snapshot snapshot = heap.GetStats();
+            size_t kind = static_cast<size_t>(incremental ? PauseKind::IncrementalSlice : PauseKind::Full);
+            std::sort(latencies.begin(), latencies.end());
+            std::cout << (incremental ? "Incremental" : "Stop-the-world") << ": " << allocations << " allocations in "
+                << millisecondsBetween(startTime, endTime) << " ms, "
+                << (incremental ? snapshot.incrementalCycles : collections) << " collections in "
+                << snapshot.pauseCount[kind] << " pauses, max pause " << snapshot.maxPauseMicroseconds[kind] / 1000.0
+                << " ms, allocation latency p99 " << latencies[latencies.size() * 99 / 100] << " ms, max "
+                << latencies.back() << " ms, " << heap.GetReservedBytes() / 1024 << " KiB reserved\n";
+        }
+    }
+
+    // A batch of short-lived scratch objects freed one by one against the same objects in a region
+    void measureRegionAllocation() {
+        const size_t requests = 2000;
+        const size_t objectsPerRequest = 200;
+
+        for (int useRegions = 0; useRegions < 2; ++useRegions) {
+            Heap heap(1 << 20, 1, 4, 0);
+            std::mt19937 gen(42);
+            std::uniform_int_distribution<size_t> sizeDistribution(16, 256);
+            std::vector<int> blockIds;
+            blockIds.reserve(objectsPerRequest);
+
+            // Each request builds its scratch objects and drops all of them when it is done
+            auto startTime = std::chrono::high_resolution_clock::now();
+            for (size_t request = 0; request < requests; ++request) {
+                if (useRegions) {
+                    Heap::Region region(heap);
+                    for (size_t i = 0; i < objectsPerRequest; ++i) {
+                        char* memory = static_cast<char*>(region.Allocate(sizeDistribution(gen)));
+                        if (!memory) break;
+                        memory[0] = 1;
+                    }
+                }
+                else {
+                    for (size_t i = 0; i < objectsPerRequest; ++i) {
+                        int blockId;
+                        char* memory = static_cast<char*>(heap.Allocate<FirstFit>(sizeDistribution(gen), &blockId));
+                        if (!memory) break;
+                        memory[0] = 1;
+                        blockIds.push_back(blockId);
+                    }
+                    for (int blockId : blockIds) {
+                        heap.Deallocate(blockId);
+                    }
+                    blockIds.clear();
+                }
+            }
+            auto endTime = std::chrono::high_resolution_clock::now();
+
+            double milliseconds = millisecondsBetween(startTime, endTime);
+            std::cout << (useRegions ? "Region" : "Allocate and Deallocate") << ": " << requests * objectsPerRequest
+                << " scratch objects in " << milliseconds << " ms (" << requests * objectsPerRequest / milliseconds * 1000.0
+                << " per second), " << heap.GetStats().totalAllocations << " heap blocks allocated, "
+                << heap.GetReservedBytes() / 1024 << " KiB reserved\n";
+        }
+    }
+
+    // The fragmentation big buffers leave among small blocks with and without the large-object space
+    void measureLargeObjectSpace() {
+        const size_t rounds = 400;
+        const size_t smallPerRound = 200;
+        const size_t liveBuffers = 4;
+        // The heap's default threshold
+        const size_t largeObjectThreshold = 256 * 1024;
+
+        for (int useLargeObjects = 0; useLargeObjects < 2; ++useLargeObjects) {
+            Heap heap(1 << 20, 1, 4, 0);
+            std::streambuf* output = std::cout.rdbuf(nullptr);
+            heap.SetLargeObjectSpace(useLargeObjects ? largeObjectThreshold : 0, false);
+            std::cout.rdbuf(output);
+
+            // Small blocks of which one in four stays live, between buffers of 512 KiB to 4 MiB that are
+            // replaced oldest first
+            std::mt19937 gen(42);
+            std::uniform_int_distribution<size_t> smallSizes(16, 256);
+            std::uniform_int_distribution<size_t> bufferSizes(512 * 1024, 4 * 1024 * 1024);
+            std::vector<int> buffers;
+            auto startTime = std::chrono::high_resolution_clock::now();
+            for (size_t round = 0; round < rounds; ++round) {
+                for (size_t i = 0; i < smallPerRound; ++i) {
+                    int blockId;
+                    if (heap.Allocate<FirstFit>(smallSizes(gen), &blockId) && i % 4 != 0) {
+                        heap.Deallocate(blockId);
+                    }
+                }
+                int blockId;
+                if (heap.Allocate<FirstFit>(bufferSizes(gen), &blockId)) {
+                    buffers.push_back(blockId);
+                }
+                if (buffers.size() > liveBuffers) {
+                    heap.Deallocate(buffers.front());
+                    buffers.erase(buffers.begin());
+                }
+            }
+            auto endTime = std::chrono::high_resolution_clock::now();
+
+            std::cout << (useLargeObjects ? "Large-object space" : "Regular segments") << ": " << rounds << " buffers among "
+                << rounds * smallPerRound << " small blocks in " << millisecondsBetween(startTime, endTime)
+                << " ms, fragmentation " << heap.GetFragmentation() << ", " << heap.GetReservedBytes() / 1024 << " KiB reserved\n";
+        }
+    }
+
+    // Rebuilding an object graph against loading it from a snapshot
+    void measureSnapshotRestore() {
+        const size_t nodeCount = 200000;
+        const std::string path = "heap_measure.snapshot";
+        // Save and load report to the console, which would skew the timing
+        std::streambuf* output = std::cout.rdbuf(nullptr);
+
+        auto buildStart = std::chrono::high_resolution_clock::now();
+        Heap heap(1 << 20, 1, 4, 0);
+        std::vector<Root<GraphNode>> roots;
+        // The newest node is the only root
+        Root<GraphNode> head = buildGraph(heap, nodeCount, nodeCount, roots);
+        roots.clear();
+        auto buildEnd = std::chrono::high_resolution_clock::now();
+
+        bool saved = heap.SaveSnapshot(path);
+        auto saveEnd = std::chrono::high_resolution_clock::now();
+
+        Heap restored(1 << 20, 1, 4, 0);
+        bool loaded = saved && restored.LoadSnapshot(path);
+        auto loadEnd = std::chrono::high_resolution_clock::now();
+
+        // The first walk over the loaded heap pays for paging its segments in
+        size_t visited = 0;
+        if (loaded) {
+            Root<GraphNode> restoredHead = restored.AdoptRestoredRoot<GraphNode>(head.Get().BlockId());
+            for (Ref<GraphNode> node = restoredHead.Get(); !node.IsNull(); ++visited) {
+                Pinned<GraphNode> object = restored.Get(node);
+                if (object.IsNull()) break;
+                node = object->next;
+            }
+        }
+        auto walkEnd = std::chrono::high_resolution_clock::now();
+        std::cout.rdbuf(output);
+
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        long long fileBytes = file ? static_cast<long long>(file.tellg()) : 0;
+        file.close();
+        std::remove(path.c_str());
+        if (!loaded) {
+            std::cerr << "Snapshot measurement failed: the snapshot could not be saved or loaded.\n";
+            return;
+        }
+
+        std::cout << "Build of " << visited << " nodes: " << millisecondsBetween(buildStart, buildEnd) << " ms\n"
+            << "Save: " << millisecondsBetween(buildEnd, saveEnd) << " ms, " << fileBytes / 1024 << " KiB file\n"
+            << "Load: " << millisecondsBetween(saveEnd, loadEnd) << " ms\n"
+            << "First walk of " << visited << " loaded nodes: " << millisecondsBetween(loadEnd, walkEnd) << " ms\n"
+            << "Warm start (load and walk): " << millisecondsBetween(saveEnd, walkEnd) << " ms against a rebuild of "
+            << millisecondsBetween(buildStart, buildEnd) << " ms\n";
+    }
+
+    struct Experiment {
+        const char* name;
+        void (*run)();
+    };
+
+    const Experiment experiments[] = {
+        { "fit-search", measureFitSearchScaling },
+        { "parallel-mark", measureParallelMarkScaling },
+        { "concurrent-gc", measureConcurrentGCPauses },
+        { "nursery", measureNurseryThroughput },
+        { "buddy", measureBuddyAgainstBestFit },
+        { "incremental-gc", measureIncrementalGCPauses },
+        { "regions", measureRegionAllocation },
+        { "large-objects", measureLargeObjectSpace },
+        { "snapshot", measureSnapshotRestore },
+    };
+
+    void printUsage() {
+        std::cerr << "Usage: HeapBenchmark [options]\n"
+            << "  --workloads LIST    uniform,lognormal,replay,producer-consumer,larson,threadtest,batch,batch-per-call,gc-graph (default: all)\n"
+            << "  --allocators LIST   First-Fit,Next-Fit,Best-Fit,Worst-Fit,Buddy,malloc (default: all)\n"
+            << "  --threads LIST      thread counts (default: 1,2,4,8, doubling on up to the core count)\n"
+            << "  --operations N      timed operations per thread (default: 100000)\n"
+            << "  --replay FILE       heap trace whose allocations the replay workload repeats\n"
+            << "  --format csv|json   (default: csv)\n"
+            << "  --output FILE       (default: standard output)\n"
+            << "  --experiments LIST  run these comparisons instead of the workloads: fit-search,parallel-mark,\n"
+            << "                      concurrent-gc,nursery,buddy,incremental-gc,regions,large-objects,snapshot or all\n";
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> workloadNames;
+    std::vector<std::string> allocatorNames;
+    // Doubling thread counts show how throughput scales as the arenas fill up with threads
+    std::vector<size_t> threadCounts;
+    for (size_t threads = 1; threads <= std::max<size_t>(std::thread::hardware_concurrency(), 8); threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    size_t operations = 100000;
+    std::string replayPath;
+    std::string format = "csv";
+    std::string outputPath;
+    std::vector<std::string> experimentNames;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string option = argv[i];
+        if (i + 1 >= argc) {
+            printUsage();
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (option == "--workloads") workloadNames = splitList(value);
+        else if (option == "--allocators") allocatorNames = splitList(value);
+        else if (option == "--threads") {
+            threadCounts.clear();
+            for (const std::string& count : splitList(value)) {
+                threadCounts.push_back(std::max<size_t>(std::strtoull(count.c_str(), nullptr, 10), 1));
+            }
+        }
+        else if (option == "--operations") operations = std::max<size_t>(std::strtoull(value.c_str(), nullptr, 10), 1);
+        else if (option == "--replay") replayPath = value;
+        else if (option == "--format") format = value;
+        else if (option == "--output") outputPath = value;
+        else if (option == "--experiments") experimentNames = splitList(value);
+        else {
+            printUsage();
+            return 1;
+        }
+    }
+    if (format != "csv" && format != "json") {
+        printUsage();
+        return 1;
+    }
+
+    if (!experimentNames.empty()) {
+        bool all = std::find(experimentNames.begin(), experimentNames.end(), "all") != experimentNames.end();
+        for (const std::string& name : experimentNames) {
+            if (name == "all") continue;
+            auto known = [&name](const Experiment& experiment) { return name == experiment.name; };
+            if (std::find_if(std::begin(experiments), std::end(experiments), known) == std::end(experiments)) {
+                std::cerr << "Unknown experiment " << name << ".\n";
+                printUsage();
+                return 1;
+            }
+        }
+        for (const Experiment& experiment : experiments) {
+            if (!all && std::find(experimentNames.begin(), experimentNames.end(), experiment.name) == experimentNames.end()) continue;
+            std::cout << experiment.name << ":\n";
+            experiment.run();
+        }
+        return 0;
+    }
+
+    std::vector<ReplayStep> replay;
+    if (!replayPath.empty() && !loadReplay(replayPath, replay)) {
+        return 1;
+    }
+
+    auto selected = [](const std::vector<std::string>& names, const char* name) {
+        return names.empty() || std::find(names.begin(), names.end(), name) != names.end();
+    };
+
+    std::vector<RunResult> runs;
+    for (const Workload& workload : workloads) {
+        if (!selected(workloadNames, workload.name)) continue;
+        if (workload.needsReplay && replay.empty()) {
+            std::cerr << "Skipping " << workload.name << ": no --replay trace given.\n";
+            continue;
+        }
+        for (const AllocatorEntry& entry : allocators) {
+            if (!selected(allocatorNames, entry.name)) continue;
+            if (workload.needsGraphs && !entry.graphs) continue;
+            for (size_t threads : threadCounts) {
+                if (threads < workload.minimumThreads) continue;
+                std::cerr << workload.name << ", " << entry.name << ", " << threads << " threads...\n";
+                runs.push_back(runOnce(workload, entry, threads, operations, replay));
+            }
+        }
+    }
+
+    std::ofstream file;
+    if (!outputPath.empty()) {
+        file.open(outputPath);
+        if (!file) {
+            std::cerr << "Cannot write " << outputPath << ".\n";
+            return 1;
+        }
+    }
+    std::ostream& out = outputPath.empty() ? std::cout : file;
+    if (format == "json") {
+        writeJson(out, runs);
+    }
+    else {
+        writeCsv(out, runs);
+    }
+    return 0;
+}
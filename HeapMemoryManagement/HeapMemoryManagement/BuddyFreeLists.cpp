@@ -0,0 +1,34 @@
+#include "BuddyFreeLists.h"
+#include "BitOps.h"
+
+const size_t BuddyFreeLists::orderCount;
+
+
+void BuddyFreeLists::Insert(size_t order, Position position) {
+    lists[order].insert(position);
+    nonEmptyOrders |= uint64_t(1) << order;
+}
+
+void BuddyFreeLists::Erase(size_t order, Position position) {
+    lists[order].erase(position);
+    if (lists[order].empty()) {
+        nonEmptyOrders &= ~(uint64_t(1) << order);
+    }
+}
+
+void BuddyFreeLists::Clear() {
+    for (std::set<Position>& list : lists) {
+        list.clear();
+    }
+    nonEmptyOrders = 0;
+}
+
+size_t BuddyFreeLists::FindOrder(size_t order) const {
+    if (order >= orderCount) return orderCount;
+    uint64_t candidates = nonEmptyOrders & (~uint64_t(0) << order);
+    return candidates ? countTrailingZeros(candidates) : orderCount;
+}
+
+size_t BuddyFreeLists::OrderOf(size_t size) {
+    return highestSetBit(size);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <set>
+
+#include "FreeBlockIndex.h"
+
+
+// Free blocks of the buddy segments, one list per power-of-two order. A bitmap of the
+// non-empty orders finds the smallest order that can serve a request with one
+// count-trailing-zeros, and each list hands out its lowest position first.
+class BuddyFreeLists {
+public:
+    typedef FreeBlockIndex::Position Position;
+    static const size_t orderCount = 64;
+
+    void Insert(size_t order, Position position);
+    void Erase(size_t order, Position position);
+    void Clear();
+
+    // Smallest non-empty order at or above `order`, or orderCount if there is none
+    size_t FindOrder(size_t order) const;
+    Position First(size_t order) const { return *lists[order].begin(); }
+    size_t Count(size_t order) const { return lists[order].size(); }
+
+    // Order of a power-of-two size
+    static size_t OrderOf(size_t size);
+
+private:
+    std::set<Position> lists[orderCount];
+    uint64_t nonEmptyOrders = 0;
+};
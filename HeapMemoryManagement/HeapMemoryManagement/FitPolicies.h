@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+
+#include "FreeBlockIndex.h"
+
+
+// Fit policies choose the free block an allocation is carved from. Heap::Allocate is
+// instantiated once per policy, so the choice is made at compile time and the index
+// search is inlined. Find returns FreeBlockIndex::npos when no free block is large enough.
+// `rover` is the heap's Next-Fit position; the other policies ignore it.
+struct FirstFit {
+    static const char* Name() { return "First-Fit"; }
+    static FreeBlockIndex::Position Find(const FreeBlockIndex& index, size_t size, FreeBlockIndex::Position&) {
+        return index.FindFirstFit(size);
+    }
+};
+
+// First-Fit that resumes where the previous allocation was placed instead of at the start
+struct NextFit {
+    static const char* Name() { return "Next-Fit"; }
+    static FreeBlockIndex::Position Find(const FreeBlockIndex& index, size_t size, FreeBlockIndex::Position& rover) {
+        FreeBlockIndex::Position position = index.FindNextFit(size, rover);
+        if (position != FreeBlockIndex::npos) {
+            rover = position;
+        }
+        return position;
+    }
+};
+
+struct BestFit {
+    static const char* Name() { return "Best-Fit"; }
+    static FreeBlockIndex::Position Find(const FreeBlockIndex& index, size_t size, FreeBlockIndex::Position&) {
+        return index.FindBestFit(size);
+    }
+};
+
+struct WorstFit {
+    static const char* Name() { return "Worst-Fit"; }
+    static FreeBlockIndex::Position Find(const FreeBlockIndex& index, size_t size, FreeBlockIndex::Position&) {
+        return index.FindWorstFit(size);
+    }
+};
+
+// Not a fit policy: Allocate<BuddySystem> is specialized to split power-of-two blocks in
+// the buddy segments, which never enter the free index
+struct BuddySystem {
+    static const char* Name() { return "Buddy"; }
+};
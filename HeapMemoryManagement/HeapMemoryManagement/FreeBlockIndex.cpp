@@ -0,0 +1,248 @@
+#include "FreeBlockIndex.h"
+#include "BitOps.h"
+#include <algorithm>
+
+const FreeBlockIndex::Position FreeBlockIndex::npos;
+const size_t FreeBlockIndex::smallSizeLimit;
+const uint32_t FreeBlockIndex::nil;
+
+
+FreeBlockIndex::FreeBlockIndex() {
+    std::fill(std::begin(smallBinMinTree), std::end(smallBinMinTree), npos);
+}
+
+void FreeBlockIndex::Insert(size_t size, Position position) {
+    if (size < smallSizeLimit) {
+        smallBins[size].insert(position);
+        smallBinBitmap[size / 64] |= (uint64_t(1) << (size % 64));
+        updateSmallBinMin(size);
+    }
+    else {
+        largeBins[size].insert(position);
+        insertLarge(size, position);
+    }
+    ++count;
+}
+
+void FreeBlockIndex::Erase(size_t size, Position position) {
+    if (size < smallSizeLimit) {
+        std::set<Position>& bin = smallBins[size];
+        if (bin.erase(position) == 0) return;
+        if (bin.empty()) {
+            smallBinBitmap[size / 64] &= ~(uint64_t(1) << (size % 64));
+        }
+        updateSmallBinMin(size);
+    }
+    else {
+        auto it = largeBins.find(size);
+        if (it == largeBins.end() || it->second.erase(position) == 0) return;
+        if (it->second.empty()) {
+            largeBins.erase(it);
+        }
+        eraseLarge(position);
+    }
+    --count;
+}
+
+void FreeBlockIndex::Clear() {
+    for (std::set<Position>& bin : smallBins) {
+        bin.clear();
+    }
+    std::fill(std::begin(smallBinBitmap), std::end(smallBinBitmap), uint64_t(0));
+    std::fill(std::begin(smallBinMinTree), std::end(smallBinMinTree), npos);
+    largeBins.clear();
+    largeNodes.clear();
+    freeLargeNodes.clear();
+    largeRoot = nil;
+    count = 0;
+}
+
+void FreeBlockIndex::updateSmallBinMin(size_t bin) {
+    size_t node = bin + smallSizeLimit;
+    Position value = smallBins[bin].empty() ? npos : *smallBins[bin].begin();
+    if (smallBinMinTree[node] == value) return;
+
+    smallBinMinTree[node] = value;
+    for (node /= 2; node >= 1; node /= 2) {
+        smallBinMinTree[node] = std::min(smallBinMinTree[2 * node], smallBinMinTree[2 * node + 1]);
+    }
+}
+
+FreeBlockIndex::Position FreeBlockIndex::smallBinRangeMin(size_t firstBin) const {
+    Position result = npos;
+    size_t left = firstBin + smallSizeLimit;
+    size_t right = 2 * smallSizeLimit;
+    while (left < right) {
+        if (left & 1) result = std::min(result, smallBinMinTree[left++]);
+        if (right & 1) result = std::min(result, smallBinMinTree[--right]);
+        left /= 2;
+        right /= 2;
+    }
+    return result;
+}
+
+void FreeBlockIndex::updateLargeMax(uint32_t node) {
+    LargeNode& current = largeNodes[node];
+    current.maxSize = current.size;
+    if (current.left != nil) current.maxSize = std::max(current.maxSize, largeNodes[current.left].maxSize);
+    if (current.right != nil) current.maxSize = std::max(current.maxSize, largeNodes[current.right].maxSize);
+}
+
+void FreeBlockIndex::splitLarge(uint32_t node, Position position, uint32_t& below, uint32_t& rest) {
+    if (node == nil) {
+        below = rest = nil;
+        return;
+    }
+    if (largeNodes[node].position < position) {
+        splitLarge(largeNodes[node].right, position, largeNodes[node].right, rest);
+        below = node;
+    }
+    else {
+        splitLarge(largeNodes[node].left, position, below, largeNodes[node].left);
+        rest = node;
+    }
+    updateLargeMax(node);
+}
+
+uint32_t FreeBlockIndex::mergeLarge(uint32_t below, uint32_t rest) {
+    if (below == nil) return rest;
+    if (rest == nil) return below;
+    if (largeNodes[below].priority > largeNodes[rest].priority) {
+        largeNodes[below].right = mergeLarge(largeNodes[below].right, rest);
+        updateLargeMax(below);
+        return below;
+    }
+    largeNodes[rest].left = mergeLarge(below, largeNodes[rest].left);
+    updateLargeMax(rest);
+    return rest;
+}
+
+void FreeBlockIndex::insertLarge(size_t size, Position position) {
+    uint32_t node;
+    if (!freeLargeNodes.empty()) {
+        node = freeLargeNodes.back();
+        freeLargeNodes.pop_back();
+    }
+    else {
+        node = static_cast<uint32_t>(largeNodes.size());
+        largeNodes.emplace_back();
+    }
+    // Priorities come from mixing the position, so the tree shape is the same on every run
+    uint64_t priority = position + 0x9E3779B97F4A7C15ull;
+    priority = (priority ^ (priority >> 30)) * 0xBF58476D1CE4E5B9ull;
+    priority = (priority ^ (priority >> 27)) * 0x94D049BB133111EBull;
+    largeNodes[node] = LargeNode{ position, size, size, priority ^ (priority >> 31), nil, nil };
+
+    uint32_t below, rest;
+    splitLarge(largeRoot, position, below, rest);
+    largeRoot = mergeLarge(mergeLarge(below, node), rest);
+}
+
+void FreeBlockIndex::eraseLarge(Position position) {
+    uint32_t below, rest, match;
+    splitLarge(largeRoot, position, below, rest);
+    splitLarge(rest, position + 1, match, rest);
+    if (match != nil) {
+        freeLargeNodes.push_back(match);
+    }
+    largeRoot = mergeLarge(below, rest);
+}
+
+FreeBlockIndex::Position FreeBlockIndex::firstLargeFit(uint32_t node, size_t size, Position from) const {
+    // Only the path towards `from` can come back empty, every other subtree entered holds a fit
+    while (node != nil && largeNodes[node].maxSize >= size) {
+        const LargeNode& current = largeNodes[node];
+        if (current.position < from) {
+            node = current.right;
+            continue;
+        }
+        Position earlier = firstLargeFit(current.left, size, from);
+        if (earlier != npos) return earlier;
+        if (current.size >= size) return current.position;
+        node = current.right;
+    }
+    return npos;
+}
+
+size_t FreeBlockIndex::nextSmallBin(size_t bin) const {
+    while (bin < smallSizeLimit) {
+        size_t word = bin / 64;
+        uint64_t bits = smallBinBitmap[word] & (~uint64_t(0) << (bin % 64));
+        if (bits) {
+            return word * 64 + countTrailingZeros(bits);
+        }
+        bin = (word + 1) * 64;
+    }
+    return smallSizeLimit;
+}
+
+size_t FreeBlockIndex::highestSmallBin() const {
+    for (size_t word = bitmapWords; word-- > 0;) {
+        if (smallBinBitmap[word]) {
+            return word * 64 + highestSetBit(smallBinBitmap[word]);
+        }
+    }
+    return smallSizeLimit;
+}
+
+FreeBlockIndex::Position FreeBlockIndex::FindFirstFit(size_t size) const {
+    Position first = npos;
+
+    if (size < smallSizeLimit) {
+        // Every non-empty bin at or above the request is a candidate, the earliest position wins
+        first = smallBinRangeMin(size);
+        return std::min(first, firstLargeFit(largeRoot, 0, 0));
+    }
+
+    return firstLargeFit(largeRoot, size, 0);
+}
+
+FreeBlockIndex::Position FreeBlockIndex::FindBestFit(size_t size) const {
+    // Smallest sufficient size, ties go to the earliest position
+    if (size < smallSizeLimit) {
+        size_t bin = nextSmallBin(size);
+        if (bin < smallSizeLimit) {
+            return *smallBins[bin].begin();
+        }
+    }
+
+    auto it = largeBins.lower_bound(size);
+    if (it != largeBins.end()) {
+        return *it->second.begin();
+    }
+    return npos;
+}
+
+FreeBlockIndex::Position FreeBlockIndex::FindWorstFit(size_t size) const {
+    // Largest free block overall, ties go to the earliest position
+    if (!largeBins.empty()) {
+        auto it = std::prev(largeBins.end());
+        return it->first >= size ? *it->second.begin() : npos;
+    }
+
+    size_t bin = highestSmallBin();
+    if (bin < smallSizeLimit && bin >= size) {
+        return *smallBins[bin].begin();
+    }
+    return npos;
+}
+
+FreeBlockIndex::Position FreeBlockIndex::FindNextFit(size_t size, Position from) const {
+    Position next = npos;
+    if (size < smallSizeLimit) {
+        // The earliest position at or after `from` over every sufficient bin; any large block fits
+        for (size_t bin = nextSmallBin(size); bin < smallSizeLimit; bin = nextSmallBin(bin + 1)) {
+            auto it = smallBins[bin].lower_bound(from);
+            if (it != smallBins[bin].end()) {
+                next = std::min(next, *it);
+            }
+        }
+        next = std::min(next, firstLargeFit(largeRoot, 0, from));
+    }
+    else {
+        next = firstLargeFit(largeRoot, size, from);
+    }
+
+    // Nothing fits past the rover, so the search wraps around to the start
+    return next != npos ? next : FindFirstFit(size);
+}
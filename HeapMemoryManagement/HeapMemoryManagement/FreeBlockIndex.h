@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <vector>
+
+
+// Index of free blocks used by the fit strategies instead of scanning every segment.
+// Blocks are identified by a position key that sorts in the same order the heap
+// walks its segments, so every strategy picks exactly the block a linear scan would.
+//
+// Sizes below smallSizeLimit get one exact bin each, with a bitmap of non-empty bins.
+// Larger sizes live in an ordered tree keyed by size, and again in a treap keyed by
+// position whose nodes carry the largest size below them, so First-Fit and Next-Fit
+// descend straight to the earliest sufficient block instead of visiting every size.
+class FreeBlockIndex {
+public:
+    typedef uint64_t Position;
+    FreeBlockIndex();
+
+    static const Position npos = UINT64_MAX;
+    static const size_t smallSizeLimit = 256;
+
+    void Insert(size_t size, Position position);
+    void Erase(size_t size, Position position);
+    void Clear();
+    size_t Count() const { return count; }
+
+    // Each search returns npos when no free block of at least `size` bytes exists
+    Position FindFirstFit(size_t size) const;
+    Position FindBestFit(size_t size) const;
+    Position FindWorstFit(size_t size) const;
+    // First fit at or after `from`, wrapping around to the lowest position
+    Position FindNextFit(size_t size, Position from) const;
+
+private:
+    static const size_t bitmapWords = smallSizeLimit / 64;
+
+    std::set<Position> smallBins[smallSizeLimit];
+    uint64_t smallBinBitmap[bitmapWords] = {};
+    // Min-tree over the first position of every small bin, answers First-Fit in O(log bins)
+    Position smallBinMinTree[2 * smallSizeLimit];
+
+    std::map<size_t, std::set<Position>> largeBins;
+
+    // Treap of the large blocks in heap order. Nodes live in one vector and link by
+    // index, so erasing and reinserting reuses slots instead of allocating.
+    struct LargeNode {
+        Position position;
+        size_t size;
+        // Largest size in this node's subtree, lets a search skip subtrees that cannot fit
+        size_t maxSize;
+        uint64_t priority;
+        uint32_t left;
+        uint32_t right;
+    };
+    static const uint32_t nil = UINT32_MAX;
+    std::vector<LargeNode> largeNodes;
+    std::vector<uint32_t> freeLargeNodes;
+    uint32_t largeRoot = nil;
+
+    size_t count = 0;
+
+    void updateSmallBinMin(size_t bin);
+    Position smallBinRangeMin(size_t firstBin) const;
+
+    void updateLargeMax(uint32_t node);
+    // Splits `node` into positions below `position` and the rest
+    void splitLarge(uint32_t node, Position position, uint32_t& below, uint32_t& rest);
+    uint32_t mergeLarge(uint32_t below, uint32_t rest);
+    void insertLarge(size_t size, Position position);
+    void eraseLarge(Position position);
+    // Earliest large position at or after `from` with at least `size` bytes, or npos
+    Position firstLargeFit(uint32_t node, size_t size, Position from) const;
+
+    // Next non-empty small bin at or above `bin`, or smallSizeLimit if there is none
+    size_t nextSmallBin(size_t bin) const;
+    // Highest non-empty small bin, or smallSizeLimit if all are empty
+    size_t highestSmallBin() const;
+};
@@ -0,0 +1,196 @@
+#pragma once
+
+#include "BitOps.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+
+// Generational handle table. A handle packs a slot index and the slot's version, so a
+// handle to a released slot is recognised as stale even after the slot has been reused.
+// Handles are non-negative ints; a slot's first handle equals its index. Versions never
+// wrap: a slot whose last version has been handed out is retired for good, so no stale
+// handle can ever match it again.
+//
+// Slots live in chunks that never move, so Find may run alongside Insert and Remove on
+// other slots (Insert/Remove themselves must be serialized by the caller). Reissue only
+// touches its own slot's version, so it needs no serialization either. Chunks double in
+// size, from 256 slots up, so a small table reserves little; a slot's value and its
+// version word sit in separate arrays to avoid padding.
+template <typename T>
+class HandleTable {
+public:
+    typedef int Handle;
+    static const int indexBits = 24;
+    static const Handle invalidHandle = -1;
+
+    // Returns invalidHandle once all 2^indexBits slots are in use
+    Handle Insert(const T& value) {
+        uint32_t index;
+        if (!freeSlots.empty()) {
+            index = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        else {
+            index = static_cast<uint32_t>(slotCount.load(std::memory_order_relaxed));
+            if (index > indexMask) return invalidHandle;
+            reserveChunk(index);
+        }
+
+        valueAt(index) = value;
+        std::atomic<uint32_t>& state = stateAt(index);
+        uint32_t version = state.load(std::memory_order_relaxed);
+        state.store(version | inUseBit, std::memory_order_relaxed);
+        // Publishes a new chunk to concurrent Find calls
+        if (index == slotCount.load(std::memory_order_relaxed)) {
+            slotCount.store(index + 1, std::memory_order_release);
+        }
+        ++count;
+        return static_cast<Handle>((version << indexBits) | index);
+    }
+
+    // Retires a live handle and returns the slot's next one for the same entry, so the old
+    // handle reads as stale from now on. invalidHandle stays invalid. Returns invalidHandle,
+    // leaving the handle live, once the slot has no version left; Replace then moves the entry.
+    Handle Reissue(Handle handle) {
+        if (handle < 0) return invalidHandle;
+        uint32_t index = static_cast<uint32_t>(handle) & indexMask;
+        uint32_t version = (static_cast<uint32_t>(handle) >> indexBits) + 1;
+        if (version >= retiredVersion) return invalidHandle;
+        stateAt(index).store(version | inUseBit, std::memory_order_relaxed);
+        return static_cast<Handle>((version << indexBits) | index);
+    }
+
+    // Moves a live handle's entry to another slot and retires its own, for a slot Reissue found
+    // used up. Serialized like Insert; returns invalidHandle, with the handle retired, if the table is full.
+    Handle Replace(Handle handle) {
+        if (!isLive(handle)) return invalidHandle;
+
+        uint32_t index = static_cast<uint32_t>(handle) & indexMask;
+        stateAt(index).store(retiredVersion, std::memory_order_relaxed);
+        --count;
+        return Insert(valueAt(index));
+    }
+
+    // Re-creates the entry of a handle an earlier table issued, such as one saved in a heap snapshot.
+    // Handles must come in ascending index order after Clear; the slots skipped become free.
+    bool Restore(Handle handle, const T& value) {
+        if (handle < 0) return false;
+        uint32_t index = static_cast<uint32_t>(handle) & indexMask;
+        uint32_t next = slotCount.load(std::memory_order_relaxed);
+        if (index < next) return false;
+        for (uint32_t i = next; i <= index; ++i) {
+            reserveChunk(i);
+            if (i < index) freeSlots.push_back(i);
+        }
+
+        valueAt(index) = value;
+        stateAt(index).store((static_cast<uint32_t>(handle) >> indexBits) | inUseBit, std::memory_order_relaxed);
+        slotCount.store(index + 1, std::memory_order_release);
+        ++count;
+        return true;
+    }
+
+    // Entry for a live handle, or nullptr for unknown and stale handles
+    T* Find(Handle handle) {
+        return isLive(handle) ? &valueAt(static_cast<uint32_t>(handle) & indexMask) : nullptr;
+    }
+
+    bool Remove(Handle handle) {
+        if (!isLive(handle)) return false;
+
+        std::atomic<uint32_t>& state = stateAt(static_cast<uint32_t>(handle) & indexMask);
+        uint32_t version = (state.load(std::memory_order_relaxed) & ~inUseBit) + 1;
+        state.store(version, std::memory_order_relaxed);
+        if (version < retiredVersion) {
+            freeSlots.push_back(static_cast<uint32_t>(handle) & indexMask);
+        }
+        --count;
+        return true;
+    }
+
+    // True if the handle was issued by this table but its block has since been released
+    bool IsStale(Handle handle) const {
+        if (handle < 0) return false;
+        uint32_t index = static_cast<uint32_t>(handle) & indexMask;
+        if (index >= slotCount.load(std::memory_order_acquire)) return false;
+        return !isLive(handle);
+    }
+
+    size_t Count() const { return count; }
+
+    // Memory held by the slot chunks and the chunk directory, read without the caller's lock
+    size_t ReservedBytes() const {
+        uint32_t slots = slotCount.load(std::memory_order_relaxed);
+        size_t reservedSlots = slots == 0 ? 0 : chunkStart(chunkOf(slots - 1) + 1);
+        return sizeof(chunks) + reservedSlots * (sizeof(T) + sizeof(std::atomic<uint32_t>));
+    }
+
+    void Clear() {
+        for (Chunk& chunk : chunks) {
+            chunk.values.reset();
+            chunk.states.reset();
+        }
+        slotCount = 0;
+        freeSlots.clear();
+        count = 0;
+    }
+
+private:
+    static const uint32_t indexMask = (1u << indexBits) - 1;
+    // Versions stay below the sign bit so handles are non-negative. A slot that reaches the
+    // highest one is never handed out again.
+    static const uint32_t retiredVersion = (1u << (31 - indexBits)) - 1;
+    // Set in a slot's state word, above its version, while the slot holds an entry
+    static const uint32_t inUseBit = 1u << 31;
+    // Chunk k holds 256 << k slots, so 17 of them cover all 2^indexBits
+    static const int firstChunkBits = 8;
+    static const size_t chunkCount = indexBits - firstChunkBits + 1;
+
+    struct Chunk {
+        std::unique_ptr<T[]> values;
+        // Version and inUseBit. Read by Find while its entry's owner reissues the handle.
+        std::unique_ptr<std::atomic<uint32_t>[]> states;
+    };
+
+    Chunk chunks[chunkCount];
+    std::atomic<uint32_t> slotCount{ 0 };
+    std::vector<uint32_t> freeSlots;
+    size_t count = 0;
+
+    static size_t chunkOf(uint32_t index) {
+        return highestSetBit((index >> firstChunkBits) + 1);
+    }
+
+    static uint32_t chunkStart(size_t chunk) {
+        return ((1u << chunk) - 1) << firstChunkBits;
+    }
+
+    void reserveChunk(uint32_t index) {
+        size_t chunk = chunkOf(index);
+        if (index != chunkStart(chunk)) return;
+        size_t size = size_t(1) << (chunk + firstChunkBits);
+        chunks[chunk].values.reset(new T[size]());
+        chunks[chunk].states.reset(new std::atomic<uint32_t>[size]());
+    }
+
+    T& valueAt(uint32_t index) {
+        size_t chunk = chunkOf(index);
+        return chunks[chunk].values[index - chunkStart(chunk)];
+    }
+
+    std::atomic<uint32_t>& stateAt(uint32_t index) const {
+        size_t chunk = chunkOf(index);
+        return chunks[chunk].states[index - chunkStart(chunk)];
+    }
+
+    bool isLive(Handle handle) const {
+        if (handle < 0) return false;
+        uint32_t index = static_cast<uint32_t>(handle) & indexMask;
+        if (index >= slotCount.load(std::memory_order_acquire)) return false;
+        return stateAt(index).load(std::memory_order_relaxed) == ((static_cast<uint32_t>(handle) >> indexBits) | inUseBit);
+    }
+};
@@ -1,527 +1,3751 @@
 #include "Heap.h"
+#include "SystemMemory.h"
+#include "Trace.h"
+#include "BitOps.h"
+#include "SnapshotFormat.h"
 #include <iostream>
 #include <chrono>
 #include <thread>
 #include <limits>
 #include <atomic>
 #include <random>
-
-int Heap::blockCounter = 0;
-
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+
+std::atomic<uint64_t> Heap::instanceCounter(0);
+const size_t Heap::blockAlignment;
+const size_t Heap::minimumSegmentCapacity;
+const size_t Heap::maxSegmentCapacity;
+const uint32_t Heap::notListed;
+const size_t Heap::parallelMarkThreshold;
+const size_t Heap::concurrentSliceBlocks;
+const size_t Heap::nurseryObjectLimit;
+const size_t Heap::buddySegmentOrder;
+const size_t Heap::buddyMinimumOrder;
+const size_t Heap::maxSegments;
+const size_t Heap::noArena;
+const int Heap::maxPromotionAge;
+const int Heap::oldCollectionInterval;
+const size_t Heap::incrementalSweepWords;
+const size_t Heap::pacingQuantum;
+const size_t Heap::minimumIncrementalHeadroom;
+const size_t Heap::regionSegmentCapacity;
+const size_t Heap::defaultLargeObjectThreshold;
+const size_t Heap::largeObjectPageSize;
+const size_t Heap::hugePageSize;
+const size_t Heap::hugePageObjectSize;
+const size_t Heap::maxRetainedLargeBytes;
+const double Heap::incrementalHeapGrowth = 1.0;
+
+// Records the time until it goes out of scope as a pause, so it is declared after the locks that stop the mutators
+struct ScopedPause {
+    HeapStats& stats;
+    PauseKind kind;
+    std::chrono::steady_clock::time_point start;
+
+    ScopedPause(HeapStats& stats, PauseKind kind) : stats(stats), kind(kind), start(std::chrono::steady_clock::now()) {}
+    ~ScopedPause() {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        stats.RecordPause(kind, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()));
+    }
+};
 
 Heap::Heap(size_t initialHeapSize, size_t totalThreads, size_t segmentsCount, size_t blocksPerSegment)
-    : totalThreads(totalThreads) {
+    : topology(CurrentNumaTopology()),
+    arenaCount(std::max<size_t>(totalThreads > 0 ? totalThreads : std::thread::hardware_concurrency(), topology.nodeCount)),
+    arenas(new Arena[arenaCount]), nextArena(new std::atomic<size_t>[topology.nodeCount]), totalThreads(totalThreads),
+    instanceId(instanceCounter++), stats(arenaCount, topology.nodeCount, sizeof(Block)) {
+
+    for (size_t i = 0; i < arenaCount; ++i) {
+        arenas[i].node = i % topology.nodeCount;
+        stats.SetShardNode(i, arenas[i].node);
+    }
+    for (size_t node = 0; node < topology.nodeCount; ++node) {
+        nextArena[node] = 0;
+    }
 
     // Random number generator to create different block sizes
     std::random_device rd;
     std::mt19937 gen(rd());
     std::uniform_int_distribution<> sizeDistribution(20, 200);  // Block sizes between 20 and 200
 
-    // Initialize the heap with segments
-    int blockCounter = 0;
+    // Each segment gets an equal share of the initial heap size, or more if its blocks need it
+    size_t segmentShare = alignSize(segmentsCount > 0 ? initialHeapSize / segmentsCount : initialHeapSize);
+    defaultSegmentCapacity = std::max(segmentShare, minimumSegmentCapacity);
+    retainedSegments = segmentsCount;
+    segments.reserve(maxSegments);
+
+    // Initialize the heap with segments, dealt out to the arenas in turn
     for (size_t i = 0; i < segmentsCount; ++i) {
-        Segment newSegment;
-        newSegment.blocks.resize(blocksPerSegment);
+        std::vector<size_t> blockSizes(blocksPerSegment);
+        size_t blocksTotal = 0;
+        for (size_t& size : blockSizes) {
+            size = alignSize(sizeDistribution(gen));
+            blocksTotal += size;
+        }
+
+        size_t segmentIndex;
+        if (!createSegment(std::max(segmentShare, blocksTotal), segmentIndex, i % arenaCount)) {
+            std::cerr << "Failed to reserve memory for segment " << i << ".\n";
+            break;
+        }
 
-        // Initialize blocks within the segment with varying sizes and Block IDs
-        for (size_t j = 0; j < blocksPerSegment; ++j) {
-            newSegment.blocks[j].blockId = blockCounter++;  // Assign unique Block ID at creation
-            newSegment.blocks[j].size = sizeDistribution(gen);  // Set block size randomly
-            newSegment.blocks[j].marked = false;  // Initially, the block is free (not marked)
-            newSegment.blocks[j].memoryPointer = nullptr;  // No memory allocated yet
+        // Carve the region into blocks with varying sizes and Block IDs, initially all free
+        Block* last = nullptr;
+        size_t offset = 0;
+        for (size_t size : blockSizes) {
+            last = &addBlock(segmentIndex, last, size);  // Assign unique Block ID at creation
+            offset += size;
         }
 
-        segments.push_back(newSegment);
+        // Whatever the blocks leave of the segment's share becomes one more free block
+        if (offset < segments[segmentIndex].capacity) {
+            addBlock(segmentIndex, last, segments[segmentIndex].capacity - offset);
+        }
     }
+
+    RebuildFreeIndex();
 }
 
 
 
 Heap::~Heap() {
+    // A running concurrent cycle stops at its next pause and must be gone before the segments
+    gcStopRequested = true;
+    WaitForConcurrentGC();
+
     for (Segment& segment : segments) {
-        for (Block& block : segment.blocks) {
-            freeMemory(block);
-        }
+        releaseSegmentMemory(segment);
     }
     segments.clear();
     rootSet.clear();
 }
 
 
-void* Heap::Allocate(size_t size, const std::string& strategy) {
-    std::lock_guard<std::mutex> lock(heapMutex);
+void* Heap::Allocate(size_t size, const std::string& strategy, int* blockId) {
+    if (strategy == "Next-Fit") return Allocate<NextFit>(size, blockId);
+    if (strategy == "Best-Fit") return Allocate<BestFit>(size, blockId);
+    if (strategy == "Worst-Fit") return Allocate<WorstFit>(size, blockId);
+    if (strategy == "Buddy") return Allocate<BuddySystem>(size, blockId);
+    return Allocate<FirstFit>(size, blockId);
+}
 
-    Block* selectedBlock = nullptr;
+template <typename FitPolicy>
+void* Heap::Allocate(size_t size, int* blockId) {
+    return allocate<FitPolicy>(size, blockId, nullptr, nullptr);
+}
+
+void* Heap::allocateObject(const TypeInfo& type, const void* object, int* blockId) {
+    return allocate<FirstFit>(type.size, blockId, &type, object);
+}
 
-    // Choose the strategy to find a block
-    if (strategy == "First-Fit") {
-        selectedBlock = findFirstFit(size);
+template <typename FitPolicy>
+void* Heap::allocate(size_t size, int* blockId, const TypeInfo* type, const void* object) {
+    paceAllocation(size);
+    if (isLargeObject(size)) {
+        return allocateLarge(size, blockId, type, object);
     }
-    else if (strategy == "Best-Fit") {
-        selectedBlock = findBestFit(size);
+    // Untyped blocks stay out of the nursery: a minor collection would move them from under the address Allocate returned
+    if (nurseryEnabled && type && size <= nurseryObjectLimit) {
+        void* nurseryMemory = allocateFromNursery(size, blockId, type, object);
+        if (nurseryMemory) {
+            return nurseryMemory;
+        }
     }
-    else if (strategy == "Worst-Fit") {
-        selectedBlock = findWorstFit(size);
+
+    size_t sizeClass = ThreadCache::SizeClassOf(size);
+    ThreadCache& cache = *localThreadCache();
+    bool cacheable = sizeClass < ThreadCache::sizeClassCount && threadCacheDepth > 0;
+    if (cacheable) {
+        void* cachedMemory = allocateFromThreadCache(cache, sizeClass, size, blockId, type, object);
+        if (cachedMemory) {
+            return cachedMemory;
+        }
     }
 
-    // If a suitable block is found, allocate memory (without changing the blockId)
-    if (selectedBlock) {
-        selectedBlock->marked = true;
-        void* allocatedMemory = malloc(size);
-        selectedBlock->memoryPointer = allocatedMemory;
+    // Splitting blocks changes segment layout, so the arena's cache fast paths are held off meanwhile
+    Arena& arena = arenas[cache.arena];
+    auto arenaLocks = LockArena(cache.arena);
+
+    // Cache miss: refill the size class in one batch and hand out the first block
+    if (cacheable) {
+        ++cache.allocationMisses;
+        refillThreadCache<FitPolicy>(cache, sizeClass);
+
+        std::vector<FreeBlockIndex::Position>& bin = cache.bins[sizeClass];
+        if (!bin.empty()) {
+            FreeBlockIndex::Position position = bin.back();
+            bin.pop_back();
+            Block& block = *blockAt(position);
+            block.cached = false;
+            void* allocatedMemory = commitBlock(segmentOf(position), block, type, object);
+            TRACE_ALLOC(Allocate, size, block.blockId);
+            stats.RecordAllocation(cache.arena, size, block.size);
+            if (blockId) *blockId = block.blockId;
+            trackAllocatedBlock(block);
+            return allocatedMemory;
+        }
+    }
 
-        std::cout << "Allocated memory at address: " << allocatedMemory
-            << " (Block ID: " << selectedBlock->blockId
-            << ", Strategy: " << strategy << ")\n";
+    size_t blockSize = alignSize(size);
+    Block* selectedBlock = nullptr;
+    FreeBlockIndex::Position position = FreeBlockIndex::npos;
+    size_t ownerIndex = cache.arena;
+
+    // Find a block with the policy, sweeping the arena's segments left by a lazy collection until one fits
+    do {
+        selectedBlock = findFit<FitPolicy>(arena, blockSize, position);
+    } while (!selectedBlock && sweepPendingSegment(cache.arena));
+
+    // Only the initial segments are spread over the arenas, and remote frees go back to the arena
+    // that owns the block, so other arenas may have room while this one is full. Only one arena is
+    // locked at a time, which keeps the lock order.
+    if (!selectedBlock && arenaCount > 1) {
+        arenaLocks.clear();
+        selectedBlock = findFitInOtherArena<FitPolicy>(cache.arena, blockSize, ownerIndex, position, arenaLocks);
+        if (!selectedBlock) {
+            ownerIndex = cache.arena;
+            arenaLocks = LockArena(cache.arena);
+        }
+    }
 
-        rootSet.push_back(selectedBlock);
+    // If a suitable block is found, carve the request out of it
+    if (selectedBlock) {
+        arenas[ownerIndex].freeIndex.Erase(selectedBlock->size, position);
+        splitBlock(segmentOf(position), *selectedBlock, blockSize);
+        void* allocatedMemory = commitBlock(segmentOf(position), *selectedBlock, type, object);
+        TRACE_ALLOC(Allocate, size, selectedBlock->blockId);
+        stats.RecordAllocation(ownerIndex, size, selectedBlock->size);
+        if (blockId) *blockId = selectedBlock->blockId;
+        trackAllocatedBlock(*selectedBlock);
         return allocatedMemory;
     }
 
-    // If no suitable block is found, fall back to the existing allocation logic
-    std::cerr << "No suitable block found using strategy " << strategy << ". Falling back to existing logic.\n";
+    // The indexes hold every free block of the arenas, so nothing in their segments fits either
+    size_t segmentIndex;
+    if (!createSegment(std::max(defaultSegmentCapacity, blockSize), segmentIndex, cache.arena)) {
+        std::cerr << "Allocation failed: could not reserve a segment for " << blockSize << " bytes.\n";
+        return nullptr;
+    }
 
-    for (Segment& segment : segments) {
-        if (segment.blocks.size() < maxBlocksPerSegment) {
-            for (Block& block : segment.blocks) {
-                if (!block.marked && block.size >= size) {
-                    block.marked = true;
-
-                    void* allocatedMemory = malloc(size);
-                    block.memoryPointer = allocatedMemory;
-                    std::cout << "Allocated memory at address: " << allocatedMemory
-                        << " (Block ID: " << block.blockId << ")" << std::endl;
-
-                    rootSet.push_back(&block);
-                    return allocatedMemory;
+    // The new segment starts as one free block with a new blockId
+    Block& newBlock = addBlock(segmentIndex, nullptr, segments[segmentIndex].capacity);
+    splitBlock(segmentIndex, newBlock, blockSize);
+    void* allocatedMemory = commitBlock(segmentIndex, newBlock, type, object);
+    TRACE_ALLOC(Allocate, size, newBlock.blockId);
+    stats.RecordAllocation(cache.arena, size, newBlock.size);
+    if (blockId) *blockId = newBlock.blockId;
+    trackAllocatedBlock(newBlock);
+    return allocatedMemory;
+}
+
+template <typename FitPolicy>
+size_t Heap::AllocateBatch(const size_t* sizes, size_t count, void** memory, int* blockIds) {
+    // Bytes still to carve from each request on, the size of the free block a batch would like
+    std::vector<size_t> wanted(count + 1, 0);
+    size_t totalSize = 0;
+    for (size_t i = count; i-- > 0;) {
+        wanted[i] = wanted[i + 1] + (isLargeObject(sizes[i]) ? 0 : alignSize(sizes[i]));
+        totalSize += sizes[i];
+    }
+    paceAllocation(totalSize);
+
+    // Large objects take heapMutex, which comes before the arena locks, so they are served first
+    size_t largeObjects = 0;
+    for (size_t i = 0; i < count; ++i) {
+        memory[i] = nullptr;
+        if (blockIds) blockIds[i] = -1;
+        if (isLargeObject(sizes[i])) {
+            memory[i] = allocateLarge(sizes[i], blockIds ? &blockIds[i] : nullptr, nullptr, nullptr);
+            if (memory[i]) ++largeObjects;
+        }
+    }
+
+    ThreadCache& cache = *localThreadCache();
+    auto arenaLocks = LockArena(cache.arena);
+
+    std::vector<Block*> allocatedBlocks;
+    allocatedBlocks.reserve(count);
+    Block* current = nullptr;
+    size_t currentSegment = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (isLargeObject(sizes[i])) continue;
+        size_t blockSize = alignSize(sizes[i]);
+        size_t segmentIndex;
+        Block* block = nullptr;
+
+        // The cache's own blocks go first, its lock is among the arena's
+        size_t sizeClass = ThreadCache::SizeClassOf(sizes[i]);
+        if (threadCacheDepth > 0 && sizeClass < ThreadCache::sizeClassCount && !cache.bins[sizeClass].empty()) {
+            FreeBlockIndex::Position position = cache.bins[sizeClass].back();
+            cache.bins[sizeClass].pop_back();
+            block = blockAt(position);
+            block->cached = false;
+            segmentIndex = segmentOf(position);
+            ++cache.allocationHits;
+        }
+        else {
+            // Consecutive requests come off the front of one free block, which is indexed again only
+            // once the batch is done with it
+            if (current && current->size < blockSize) {
+                freeIndexOf(currentSegment).Insert(current->size, makePosition(currentSegment, current->offset));
+                current = nullptr;
+            }
+            if (!current) {
+                current = takeBatchBlock<FitPolicy>(cache.arena, wanted[i], blockSize, currentSegment);
+                if (!current) {
+                    std::cerr << "Allocation failed: could not reserve a segment for " << blockSize << " bytes.\n";
+                    continue;
                 }
             }
+            block = current;
+            segmentIndex = currentSegment;
+            current = nullptr;
+            if (block->size >= blockSize + blockAlignment) {
+                size_t remainderSize = block->size - blockSize;
+                block->size = static_cast<uint32_t>(blockSize);
+                current = &addBlock(segmentIndex, block, remainderSize);
+            }
         }
+
+        memory[i] = commitBlock(segmentIndex, *block);
+        TRACE_ALLOC(Allocate, sizes[i], block->blockId);
+        stats.RecordAllocation(cache.arena, sizes[i], block->size);
+        if (blockIds) blockIds[i] = block->blockId;
+        allocatedBlocks.push_back(block);
+    }
+    if (current) {
+        freeIndexOf(currentSegment).Insert(current->size, makePosition(currentSegment, current->offset));
     }
 
-    // If no suitable block is found in existing segments, allocate in a new segment
-    Segment* newSegment = nullptr;
-    for (Segment& segment : segments) {
-        if (segment.blocks.size() < maxBlocksPerSegment) {
-            newSegment = &segment;
-            break;
-        }
+    // Still under the arena lock, so no collection can find the blocks allocated but unrooted
+    trackAllocatedBlocks(allocatedBlocks);
+    return allocatedBlocks.size() + largeObjects;
+}
+
+template <typename FitPolicy>
+Heap::Block* Heap::takeBatchBlock(size_t arenaIndex, size_t wanted, size_t size, size_t& segmentIndex) {
+    Arena& arena = arenas[arenaIndex];
+    FreeBlockIndex::Position position = FreeBlockIndex::npos;
+    Block* block = nullptr;
+    do {
+        block = findFit<FitPolicy>(arena, wanted, position);
+    } while (!block && sweepPendingSegment(arenaIndex));
+    if (!block && wanted > size) {
+        block = findFit<FitPolicy>(arena, size, position);
+    }
+    if (block) {
+        arena.freeIndex.Erase(block->size, position);
+        segmentIndex = segmentOf(position);
+        return block;
     }
 
-    if (newSegment == nullptr) {
-        // No existing segment has available space, create a new segment
-        segments.emplace_back();
-        newSegment = &segments.back();
+    // A segment too large to reserve is retried at the size of the request alone
+    if (!createSegment(std::max(defaultSegmentCapacity, wanted), segmentIndex, arenaIndex)
+        && (wanted == size || !createSegment(std::max(defaultSegmentCapacity, size), segmentIndex, arenaIndex))) {
+        return nullptr;
     }
+    return &addBlock(segmentIndex, nullptr, segments[segmentIndex].capacity);
+}
 
-    // Create a new block and assign it a new blockId
-    Block* newBlock = new Block;  // Allocate dynamically
-    newBlock->size = size;
-    newBlock->marked = true;
-    newBlock->blockId = ++blockCounter;  // Assign a new Block ID for the new block
+template <typename FitPolicy>
+Heap::Block* Heap::findFitInOtherArena(size_t arenaIndex, size_t size, size_t& ownerIndex, FreeBlockIndex::Position& position,
+    std::vector<std::unique_lock<std::mutex>>& locks) {
+    size_t node = arenas[arenaIndex].node;
+    for (size_t pass = 0; pass < 2; ++pass) {
+        for (size_t i = 1; i < arenaCount; ++i) {
+            size_t otherIndex = (arenaIndex + i) % arenaCount;
+            if ((arenas[otherIndex].node == node) != (pass == 0)) continue;
+
+            // Locking the arena releases its remote frees, which may be what fits
+            locks = LockArena(otherIndex);
+            Block* block = findFit<FitPolicy>(arenas[otherIndex], size, position);
+            if (block) {
+                ownerIndex = otherIndex;
+                return block;
+            }
+            locks.clear();
+        }
+    }
+    return nullptr;
+}
 
-    void* allocatedMemory = malloc(size);
-    newBlock->memoryPointer = allocatedMemory;
 
-    std::cout << "Allocated memory at address: " << allocatedMemory
-        << " (Block ID: " << newBlock->blockId << ")" << std::endl;
 
-    newSegment->blocks.push_back(*newBlock);
-    rootSet.push_back(newBlock);
-    return allocatedMemory;
-}
+bool Heap::Deallocate(int blockId) {
+    ThreadCache& cache = *localThreadCache();
+    size_t arenaIndex = noArena;
+    if (deallocateToThreadCache(cache, blockId, arenaIndex)) {
+        return true;
+    }
 
+    // Merging blocks changes segment layout, so the owning arena and its cache fast paths are held off meanwhile
+    while (true) {
+        auto arenaLocks = LockArena(arenaIndex);
 
+        // A compaction may have moved the block to another arena before the lock was taken
+        BlockHandle* handle = blockHandles.Find(blockId);
+        if (handle && segments[handle->block->segment].arena != arenaIndex) {
+            arenaIndex = segments[handle->block->segment].arena;
+            continue;
+        }
+        if (!canDeallocate(blockId, handle)) {
+            return false;
+        }
 
-void Heap::Deallocate(int blockId) {
-    std::lock_guard<std::mutex> lock(heapMutex);
-    for (Segment& segment : segments) {
-        for (Block& block : segment.blocks) {
-            if (block.blockId == blockId && block.marked) {
-                RemoveFromRootSet(block);
-                block.marked = false;
-                freeMemory(block);
-                std::cout << "Deallocated memory with Block ID: " << blockId << std::endl;
-                return;
-            }
+        Block& block = *handle->block;
+        TRACE_ALLOC(Deallocate, blockId, block.size);
+        stats.RecordFree(arenaIndex, block.size);
+        untrackBlock(block);
+        size_t sizeClass = ThreadCache::BinForBlock(block.size);
+        releaseBlock(block.segment, block);
+
+        // Cache miss: make room in the block's size class for the next frees
+        if (arenaIndex == cache.arena && threadCacheDepth > 0 && sizeClass < ThreadCache::sizeClassCount) {
+            ++cache.freeMisses;
+            trimThreadCacheBin(cache, sizeClass);
         }
+        return true;
     }
-    std::cerr << "Deallocate failed: Block ID " << blockId << " not found or already deallocated.\n";
 }
 
-Heap::Block* Heap::findFirstFit(size_t size) {
-    for (Segment& segment : segments) {
-        for (Block& block : segment.blocks) {
-            std::cout << "Checking Block ID: " << block.blockId
-                << " | Marked: " << block.marked
-                << " | Size: " << block.size
-                << " | Memory Pointer: " << block.memoryPointer << "\n";
-            if (!block.marked && block.size >= size) {
-                std::cout << "First-Fit selected Block ID: " << block.blockId << "\n";
-                return &block;
-            }
+bool Heap::canDeallocate(int blockId, BlockHandle* handle) {
+    if (!handle) {
+        // Another arena may be reusing the slot, and only Find is safe alongside that
+        bool stale;
+        {
+            std::lock_guard<std::mutex> lock(blockTableMutex);
+            stale = blockHandles.IsStale(blockId);
+        }
+        if (stale) {
+            std::cerr << "Deallocate failed: Block ID " << blockId << " is stale (its block was freed, merged or released).\n";
         }
+        else {
+            std::cerr << "Deallocate failed: Block ID " << blockId << " not found.\n";
+        }
+        return false;
     }
-    return nullptr;
-}
-
 
+    Block& block = *handle->block;
+    if (!block.allocated || block.remotePending) {
+        std::cerr << "Deallocate failed: Block ID " << blockId << " is already deallocated.\n";
+        return false;
+    }
+    if (block.type) {
+        std::lock_guard<std::mutex> rootsLock(rootsMutex);
+        if (block.rootHandles > 0) {
+            std::cerr << "Deallocate failed: Block ID " << blockId << " is still held by "
+                << block.rootHandles << " roots.\n";
+            return false;
+        }
+    }
+    return true;
+}
 
-Heap::Block* Heap::findBestFit(size_t size) {
-    Block* bestFit = nullptr;
-    size_t smallestSize = std::numeric_limits<size_t>::max();
+size_t Heap::DeallocateBatch(const int* blockIds, size_t count) {
+    // Sorted by the arena each block was in when looked up, so every arena is locked once
+    std::vector<std::pair<size_t, int>> requests;
+    requests.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        BlockHandle* handle = blockHandles.Find(blockIds[i]);
+        requests.emplace_back(handle ? segments[handle->block->segment].arena : noArena, blockIds[i]);
+    }
+    std::sort(requests.begin(), requests.end());
+
+    size_t freedBlocks = 0;
+    // Blocks a compaction moved to another arena before its lock was taken
+    std::vector<int> movedBlocks;
+    std::vector<std::pair<Block*, size_t>> releasedBlocks;
+    std::vector<Block*> untracked;
+    for (size_t i = 0; i < requests.size();) {
+        size_t arenaIndex = requests[i].first;
+        auto arenaLocks = LockArena(arenaIndex);
+        releasedBlocks.clear();
+        for (; i < requests.size() && requests[i].first == arenaIndex; ++i) {
+            int blockId = requests[i].second;
+            if (i > 0 && requests[i - 1] == requests[i]) {
+                std::cerr << "Deallocate failed: Block ID " << blockId << " is already deallocated.\n";
+                continue;
+            }
+            BlockHandle* handle = blockHandles.Find(blockId);
+            if (handle && segments[handle->block->segment].arena != arenaIndex) {
+                movedBlocks.push_back(blockId);
+                continue;
+            }
+            if (!canDeallocate(blockId, handle)) continue;
 
-    std::cout << "Running Best-Fit strategy...\n";
-    for (Segment& segment : segments) {
-        for (Block& block : segment.blocks) {
-            std::cout << "Checking Block ID: " << block.blockId
-                << " | Marked: " << block.marked
-                << " | Size: " << block.size
-                << " | Memory Pointer: " << block.memoryPointer << "\n";
+            TRACE_ALLOC(Deallocate, blockId, handle->block->size);
+            stats.RecordFree(arenaIndex, handle->block->size);
+            releasedBlocks.emplace_back(handle->block, handle->block->segment);
+        }
 
-            if (!block.marked && block.size >= size && block.size < smallestSize) {
-                smallestSize = block.size;
-                bestFit = &block;
-                std::cout << "Current Best-Fit candidate Block ID: " << block.blockId
-                    << " with size: " << block.size << "\n";
-            }
+        // Out of the root set in one step, then back into the free index, where merging may retire them
+        untracked.clear();
+        for (const auto& released : releasedBlocks) {
+            untracked.push_back(released.first);
+        }
+        untrackBlocks(untracked);
+        for (const auto& released : releasedBlocks) {
+            releaseBlock(released.second, *released.first);
         }
+        freedBlocks += releasedBlocks.size();
     }
 
-    if (bestFit) {
-        std::cout << "Best-Fit selected Block ID: " << bestFit->blockId
-            << " with size: " << bestFit->size << "\n";
+    for (int blockId : movedBlocks) {
+        if (Deallocate(blockId)) ++freedBlocks;
     }
-    else {
-        std::cerr << "No suitable block found using Best-Fit strategy.\n";
+    return freedBlocks;
+}
+
+int Heap::GetBlockId(const void* memory) {
+    std::lock_guard<std::mutex> lock(heapMutex);
+    auto arenaLocks = LockArenas(false);
+
+    const char* address = static_cast<const char*>(memory);
+    for (const Segment& segment : segments) {
+        if (!segment.base || address < segment.base || address >= segment.base + segment.capacity) continue;
+        const Block* block = blockAtOffset(segment, static_cast<size_t>(address - segment.base));
+        if (block && block->allocated) {
+            return block->blockId;
+        }
+        break;
     }
+    return -1;
+}
 
-    return bestFit;
+void* Heap::GetBlockMemory(int blockId) {
+    std::lock_guard<std::mutex> lock(heapMutex);
+    auto arenaLocks = LockArenas(false);
+    Block* block = resolve(blockId);
+    return block ? payloadOf(*block) : nullptr;
 }
 
-Heap::Block* Heap::findWorstFit(size_t size) {
-    Block* worstFit = nullptr;
-    size_t largestSize = 0;  // Initialize with 0 to find the largest block
+// The calling thread's caches, keyed by heap instance so an entry left behind by a
+// destroyed heap is never reused. On thread exit the caches are released for adoption.
+struct LocalThreadCaches {
+    std::unordered_map<uint64_t, std::shared_ptr<ThreadCache>> caches;
 
-    std::cout << "Running Worst-Fit strategy...\n";
-    for (Segment& segment : segments) {
-        for (Block& block : segment.blocks) {
-            std::cout << "Checking Block ID: " << block.blockId
-                << " | Marked: " << block.marked
-                << " | Size: " << block.size
-                << " | Memory Pointer: " << block.memoryPointer << "\n";
-
-            if (!block.marked && block.size >= size) {
-                if (block.size > largestSize) {
-                    largestSize = block.size;
-                    worstFit = &block;
-                    std::cout << "Current Worst-Fit candidate Block ID: " << block.blockId
-                        << " with size: " << block.size << "\n";
-                }
-            }
+    ~LocalThreadCaches() {
+        for (auto& entry : caches) {
+            entry.second->orphaned = true;
         }
     }
+};
 
-    if (worstFit) {
-        std::cout << "Worst-Fit selected Block ID: " << worstFit->blockId
-            << " with size: " << worstFit->size << "\n";
+ThreadCache* Heap::localThreadCache() {
+    static thread_local LocalThreadCaches localCaches;
+
+    auto it = localCaches.caches.find(instanceId);
+    if (it != localCaches.caches.end()) {
+        return it->second.get();
     }
-    else {
-        std::cerr << "No suitable block found using Worst-Fit strategy.\n";
+
+    size_t node = topology.CurrentNode();
+    size_t arenaIndex = node + nextArena[node]++ % arenasOnNode(node) * topology.nodeCount;
+    Arena& arena = arenas[arenaIndex];
+    std::lock_guard<std::mutex> lock(arena.lock);
+
+    // Reuse the cache of a thread of this arena that has exited, with whatever blocks it still holds
+    std::shared_ptr<ThreadCache> cache;
+    for (std::shared_ptr<ThreadCache>& candidate : arena.caches) {
+        if (candidate->orphaned) {
+            std::lock_guard<std::mutex> cacheLock(candidate->lock);
+            candidate->orphaned = false;
+            candidate->owner = std::this_thread::get_id();
+            cache = candidate;
+            break;
+        }
     }
 
-    return worstFit;
+    if (!cache) {
+        cache = std::make_shared<ThreadCache>(std::this_thread::get_id(), arenaIndex);
+        arena.caches.push_back(cache);
+    }
+    localCaches.caches[instanceId] = cache;
+    return cache.get();
 }
 
+size_t Heap::arenasOnNode(size_t node) const {
+    return (arenaCount - node + topology.nodeCount - 1) / topology.nodeCount;
+}
 
-void Heap::freeMemory(Block& block) {
-    if (block.allocatedMemory) {
-        free(block.allocatedMemory);
-        block.allocatedMemory = nullptr;
+size_t Heap::nodeWorker(size_t node, size_t ordinal, size_t threadCount) const {
+    if (node >= threadCount) {
+        return ordinal % threadCount;
     }
+    size_t workers = (threadCount - node + topology.nodeCount - 1) / topology.nodeCount;
+    return node + ordinal % workers * topology.nodeCount;
 }
 
-void Heap::RemoveFromRootSet(const Block& block) {
-    rootSet.erase(std::remove_if(rootSet.begin(), rootSet.end(),
-        [&block](const void* root) {
-            const Block* rootBlock = static_cast<const Block*>(root);
-            return rootBlock && rootBlock->blockId == block.blockId;
-        }), rootSet.end());
+void* Heap::allocateFromThreadCache(ThreadCache& cache, size_t sizeClass, size_t size, int* blockId, const TypeInfo* type, const void* object) {
+    std::lock_guard<std::mutex> cacheLock(cache.lock);
+    std::vector<FreeBlockIndex::Position>& bin = cache.bins[sizeClass];
+    if (bin.empty() || cache.dirty.size() >= threadCacheDepth) {
+        return nullptr;
+    }
+
+    FreeBlockIndex::Position position = bin.back();
+    bin.pop_back();
+    Block& block = *blockAt(position);
+    block.cached = false;
+    void* allocatedMemory = commitBlock(segmentOf(position), block, type, object);
+    cache.dirty.push_back(position);
+    ++cache.allocationHits;
+    TRACE_ALLOC(Allocate, size, block.blockId);
+    stats.RecordAllocation(cache.arena, size, block.size);
+    if (blockId) *blockId = block.blockId;
+    return allocatedMemory;
 }
 
-/*
-void Heap::CollectGarbage() {
-    std::lock_guard<std::mutex> lock(heapMutex);
-    for (void* root : rootSet) {
-        Mark(*reinterpret_cast<Block*>(root));
+bool Heap::deallocateToThreadCache(ThreadCache& cache, int blockId, size_t& arenaIndex) {
+    std::lock_guard<std::mutex> cacheLock(cache.lock);
+
+    // Unknown, stale and double frees fall through to the slow path, which reports them
+    BlockHandle* handle = blockHandles.Find(blockId);
+    if (!handle) {
+        return false;
+    }
+
+    Block& block = *handle->block;
+    arenaIndex = segments[handle->block->segment].arena;
+    // Typed objects take the slow path, which refuses to free one that is still rooted
+    if (!isAllocated(block) || block.remotePending || block.typed) {
+        return false;
     }
-    Sweep();
-}
 
-void Heap::Mark(Block& block) {
-    if (block.marked) return;
-    block.marked = true;
-    for (Block* ptr : block.pointers) {
-        if (ptr && !ptr->marked) {
-            Mark(*ptr);
+    // Another arena's block goes onto its remote-free list, the nursery and buddy ones take heapMutex.
+    // Its owner may be changing its other fields, so the owner counts the free when it drains the list.
+    if (arenaIndex != cache.arena) {
+        if (arenaIndex == noArena || block.remotePending.exchange(true)) {
+            return false;
         }
+        pushRemoteFree(arenas[arenaIndex], block);
+        ++cache.remoteFrees;
+        return true;
     }
-}
 
-void Heap::Sweep() {
-    for (Segment& segment : segments) {
-        auto newEnd = std::remove_if(segment.blocks.begin(), segment.blocks.end(),
-            [](const Block& block) { return !block.marked; });
+    // During a concurrent mark the freed block's references must pass the write barrier first
+    size_t sizeClass = ThreadCache::BinForBlock(block.size);
+    if (threadCacheDepth == 0 || cache.dirty.size() >= threadCacheDepth || concurrentMarking
+        || sizeClass == ThreadCache::sizeClassCount || cache.bins[sizeClass].size() >= threadCacheDepth) {
+        return false;
+    }
 
-        for (auto it = newEnd; it != segment.blocks.end(); ++it) {
-            RemoveFromRootSet(*it);
-            freeMemory(*it);
-        }
-        segment.blocks.erase(newEnd, segment.blocks.end());
+    setAllocated(block, false);
+    block.cached = true;
+    dropReferences(block);
+    FreeBlockIndex::Position position = makePosition(block.segment, block.offset);
+    cache.bins[sizeClass].push_back(position);
+    cache.dirty.push_back(position);
+    ++cache.freeHits;
+    TRACE_ALLOC(Deallocate, blockId, block.size);
+    stats.RecordFree(cache.arena, block.size);
+    return true;
+}
 
-        for (Block& block : segment.blocks) {
-            block.marked = false;
-        }
+void Heap::pushRemoteFree(Arena& arena, Block& block) {
+    Block* head = arena.remoteFrees.load(std::memory_order_relaxed);
+    do {
+        setPayloadLink(block, head);
+    } while (!arena.remoteFrees.compare_exchange_weak(head, &block, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void Heap::drainRemoteFrees(size_t arenaIndex) {
+    Block* block = arenas[arenaIndex].remoteFrees.exchange(nullptr, std::memory_order_acquire);
+    size_t drainedBlocks = 0;
+    while (block) {
+        Block* next = payloadLink(*block);
+        block->remotePending = false;
+        TRACE_ALLOC(Deallocate, block->blockId, block->size);
+        stats.RecordFree(arenaIndex, block->size);
+        untrackBlock(*block);
+        releaseBlock(getSegmentIndexForBlock(*block), *block);
+        ++drainedBlocks;
+        block = next;
+    }
+    if (drainedBlocks > 0) {
+        TRACE_ALLOC(RemoteFreesDrained, arenaIndex, drainedBlocks);
     }
 }
-*/
-void Heap::CollectGarbage() {
-    std::lock_guard<std::mutex> lock(heapMutex);
 
-    // Mark phase: Mark all reachable objects from the root set
-    std::cout << "Starting garbage collection...\n";
-    for (void* root : rootSet) {
-        if (root) {
-            Mark(*reinterpret_cast<Block*>(root));
-        }
+template <typename FitPolicy>
+void Heap::refillThreadCache(ThreadCache& cache, size_t sizeClass) {
+    std::vector<FreeBlockIndex::Position>& bin = cache.bins[sizeClass];
+    size_t previousSize = bin.size();
+    size_t limit = std::min<size_t>(threadCacheDepth, previousSize + threadCacheBatchSize);
+
+    // Each block is cut down to the class size, so one large free block can fill the whole batch
+    size_t classSize = ThreadCache::ClassLimit(sizeClass);
+    Arena& arena = arenas[cache.arena];
+    while (bin.size() < limit) {
+        FreeBlockIndex::Position position = FitPolicy::Find(arena.freeIndex, classSize, arena.nextFitRover);
+        if (position == FreeBlockIndex::npos) break;
+        Block& block = *blockAt(position);
+        arena.freeIndex.Erase(block.size, position);
+        splitBlock(segmentOf(position), block, classSize);
+        block.cached = true;
+        bin.push_back(position);
     }
 
-    // Sweep phase: Free memory that is not marked
-    Sweep();
-    std::cout << "Garbage collection complete.\n";
+    // The bin is used from the back, so the block the strategy picked first goes out first
+    std::reverse(bin.begin() + previousSize, bin.end());
+    if (bin.size() > previousSize) {
+        ++cache.refills;
+        TRACE_FIT(ThreadCacheRefill, sizeClass, bin.size() - previousSize);
+    }
 }
 
-void Heap::Mark(Block& block) {
-    // If the block is already marked, skip it
-    if (block.marked) return;
+void Heap::trimThreadCacheBin(ThreadCache& cache, size_t sizeClass) {
+    std::vector<FreeBlockIndex::Position>& bin = cache.bins[sizeClass];
+    if (bin.size() < threadCacheDepth) return;
+
+    size_t keep = bin.size() > threadCacheBatchSize ? bin.size() - threadCacheBatchSize : 0;
+    for (size_t i = keep; i < bin.size(); ++i) {
+        returnCachedBlock(bin[i]);
+    }
+    bin.resize(keep);
+    ++cache.drains;
+}
 
-    // Mark the current block as reachable
-    block.marked = true;
+void Heap::returnCachedBlock(FreeBlockIndex::Position position) {
+    size_t segmentIndex = segmentOf(position);
+    Block& block = *blockAt(position);
+    block.cached = false;
+    coalesceAndIndex(segmentIndex, block);
+    releaseSegmentIfEmpty(segmentIndex);
+}
 
-    // Recursively mark objects referenced by pointers in this block (if any)
-    for (Block* referencedBlock : block.pointers) {
-        if (referencedBlock && !referencedBlock->marked) {
-            Mark(*referencedBlock);
+void Heap::reconcileRoots(ThreadCache& cache) {
+    for (FreeBlockIndex::Position position : cache.dirty) {
+        Block& block = *blockAt(position);
+        // Both check the root slot under rootsMutex, other arenas move slots while untracking
+        if (block.allocated) {
+            trackAllocatedBlock(block);
+        }
+        else {
+            untrackBlock(block);
         }
     }
+    cache.dirty.clear();
 }
 
-void Heap::Sweep() {
-    for (Segment& segment : segments) {
-        auto newEnd = std::remove_if(segment.blocks.begin(), segment.blocks.end(),
-            [](const Block& block) {
-                // Blocks that are unmarked should be removed (freed)
-                return !block.marked;
-            });
+std::vector<std::unique_lock<std::mutex>> Heap::LockArena(size_t arenaIndex) {
+    std::vector<std::unique_lock<std::mutex>> locks;
+    if (arenaIndex == noArena) {
+        locks.emplace_back(heapMutex);
+        return locks;
+    }
+
+    // Every cache of the arena is locked before any block changes, since returning a block can
+    // merge it with a neighbour that another thread's cache is about to hand out
+    Arena& arena = arenas[arenaIndex];
+    locks.emplace_back(arena.lock);
+    for (std::shared_ptr<ThreadCache>& cache : arena.caches) {
+        locks.emplace_back(cache->lock);
+    }
+
+    // Roots first: a remotely freed block may still be waiting in a cache's dirty list
+    for (std::shared_ptr<ThreadCache>& cache : arena.caches) {
+        reconcileRoots(*cache);
+    }
+    drainRemoteFrees(arenaIndex);
+    return locks;
+}
 
-        // Free memory for swept (unmarked) blocks
-        for (auto it = newEnd; it != segment.blocks.end(); ++it) {
-            freeMemory(*it);
+std::vector<std::unique_lock<std::mutex>> Heap::LockArenas(bool returnBlocks) {
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (size_t i = 0; i < arenaCount; ++i) {
+        locks.emplace_back(arenas[i].lock);
+    }
+    for (size_t i = 0; i < arenaCount; ++i) {
+        for (std::shared_ptr<ThreadCache>& cache : arenas[i].caches) {
+            locks.emplace_back(cache->lock);
         }
+    }
 
-        // Remove swept blocks from the segment
-        segment.blocks.erase(newEnd, segment.blocks.end());
+    for (size_t i = 0; i < arenaCount; ++i) {
+        for (std::shared_ptr<ThreadCache>& cache : arenas[i].caches) {
+            reconcileRoots(*cache);
 
-        // Reset the marked flag for the remaining blocks (marked blocks)
-        for (Block& block : segment.blocks) {
-            block.marked = false;  // Reset for the next garbage collection cycle
+            if (returnBlocks && cache->CachedBlocks() > 0) {
+                for (std::vector<FreeBlockIndex::Position>& bin : cache->bins) {
+                    for (FreeBlockIndex::Position position : bin) {
+                        returnCachedBlock(position);
+                    }
+                    bin.clear();
+                }
+                ++cache->drains;
+            }
         }
     }
+    for (size_t i = 0; i < arenaCount; ++i) {
+        drainRemoteFrees(i);
+    }
+    return locks;
 }
 
-size_t Heap::getSegmentIndexForBlock(const Block& block) const {
-    for (size_t i = 0; i < segments.size(); ++i) {
-        const Segment& segment = segments[i];
-        auto it = std::find_if(segment.blocks.begin(), segment.blocks.end(),
-            [&block](const Block& segBlock) {
-                return block.blockId == segBlock.blockId;
-            });
-        if (it != segment.blocks.end()) {
-            return i;
+void Heap::SetThreadCacheLimits(size_t depth, size_t batchSize) {
+    std::lock_guard<std::mutex> lock(heapMutex);
+    // Return everything first so no bin is left above the new depth
+    auto arenaLocks = LockArenas(true);
+    threadCacheDepth = depth;
+    threadCacheBatchSize = std::max<size_t>(batchSize, 1);
+}
+
+std::vector<Heap::ThreadCacheStats> Heap::GetThreadCacheStats() {
+    std::vector<ThreadCacheStats> stats;
+    for (size_t i = 0; i < arenaCount; ++i) {
+        std::lock_guard<std::mutex> arenaLock(arenas[i].lock);
+        for (std::shared_ptr<ThreadCache>& cache : arenas[i].caches) {
+            std::lock_guard<std::mutex> cacheLock(cache->lock);
+            stats.push_back({ cache->owner, cache->arena, cache->allocationHits, cache->allocationMisses,
+                cache->freeHits, cache->freeMisses, cache->remoteFrees, cache->refills, cache->drains, cache->CachedBlocks() });
         }
     }
-    return SIZE_MAX;
+    return stats;
 }
 
-void Heap::CheckMemory() {
-    std::lock_guard<std::mutex> lock(heapMutex);
-    std::cout << "Checking memory integrity...\n";
+void Heap::PrintThreadCacheStats() {
+    std::vector<ThreadCacheStats> stats = GetThreadCacheStats();
+    std::cout << arenaCount << " arenas, thread cache depth: " << threadCacheDepth << ", batch size: " << threadCacheBatchSize << "\n";
+    if (stats.empty()) {
+        std::cout << "No thread caches in use.\n";
+    }
+    for (const ThreadCacheStats& entry : stats) {
+        std::cout << "Thread " << entry.threadId << " (arena " << entry.arena << ")"
+            << " | Allocation hits: " << entry.allocationHits << ", misses: " << entry.allocationMisses
+            << " | Free hits: " << entry.freeHits << ", misses: " << entry.freeMisses << ", remote: " << entry.remoteFrees
+            << " | Refills: " << entry.refills << ", drains: " << entry.drains
+            << " | Cached blocks: " << entry.cachedBlocks << "\n";
+    }
+}
 
-    for (size_t i = 0; i < segments.size(); ++i) {
-        const Segment& segment = segments[i];
-        std::cout << "Segment " << i << ":\n";
 
-        for (const Block& block : segment.blocks) {
-            if (block.marked) {
-                std::cout << "  Block at address " << block.memoryPointer
-                    << " (Block ID: " << block.blockId
-                    << ", Size: " << block.size << ") is allocated.\n";
-            }
-            else {
-                std::cout << "  Block at address " << block.memoryPointer
-                    << " (Block ID: " << block.blockId
-                    << ", Size: " << block.size << ") is deallocated.\n";
-            }
+HeapStats::Snapshot Heap::GetStats() {
+    HeapStats::Snapshot snapshot = stats.Take();
+    snapshot.handleTableBytes = blockHandles.ReservedBytes();
+    snapshot.metadataBytes += snapshot.handleTableBytes;
+    return snapshot;
+}
+
+void Heap::PrintNumaStats() {
+    HeapStats::Snapshot snapshot = stats.Take();
+    std::vector<size_t> threads(topology.nodeCount, 0);
+    for (size_t i = 0; i < arenaCount; ++i) {
+        std::lock_guard<std::mutex> arenaLock(arenas[i].lock);
+        for (std::shared_ptr<ThreadCache>& cache : arenas[i].caches) {
+            if (!cache->orphaned) ++threads[arenas[i].node];
         }
     }
 
-    std::cout << "Root set:\n";
-    for (void* root : rootSet) {
-        const Block* block = reinterpret_cast<const Block*>(root);
-        if (block) {
-            size_t segmentIndex = getSegmentIndexForBlock(*block);
-            if (segmentIndex != SIZE_MAX) {
-                std::cout << "Root at address " << root
-                    << " points to Block ID: " << block->blockId
-                    << " (Size: " << block->size << ") in Segment " << segmentIndex << ".\n";
-            }
-            else {
-                std::cerr << "Error: Block not found in any segment.\n";
-            }
-        }
-        else {
-            std::cerr << "Error: Null pointer in root set.\n";
+    std::cout << topology.nodeCount << " NUMA node(s)" << (topology.simulated ? ", simulated" : "")
+        << (!topology.simulated && topology.nodeCount > 1 ? ", segments bound to their node" : "") << "\n";
+    for (size_t node = 0; node < topology.nodeCount; ++node) {
+        const HeapStats::NodeStats& counters = snapshot.nodes[node];
+        std::cout << "Node " << node << " | Arenas:";
+        for (size_t i = node; i < arenaCount; i += topology.nodeCount) {
+            std::cout << " " << i;
         }
+        std::cout << " | Threads: " << threads[node]
+            << " | Segments: " << counters.reservedSegments << " (" << counters.reservedBytes << " bytes)"
+            << " | Allocations: " << counters.allocations << " (" << counters.allocatedBytes << " bytes)"
+            << " | Frees: " << counters.frees << " (" << counters.freedBytes << " bytes)\n";
     }
-
-    std::cout << "Memory check complete.\n";
 }
 
+void Heap::SetAllocationSampling(size_t bytesPerSample) {
+    stats.SetSamplingPeriod(bytesPerSample);
+    if (bytesPerSample == 0) {
+        std::cout << "Allocation sampling disabled.\n";
+    }
+    else {
+        std::cout << "Sampling one allocation per " << bytesPerSample << " bytes.\n";
+    }
+}
 
+FreeBlockIndex::Position Heap::makePosition(size_t segmentIndex, size_t offset) {
+    return (static_cast<FreeBlockIndex::Position>(segmentIndex) << 32) | offset;
+}
 
-void Heap::RunGenerationalGC() {
-    std::lock_guard<std::mutex> lock(heapMutex);
-    std::cout << "Running generational garbage collection...\n";
+size_t Heap::segmentOf(FreeBlockIndex::Position position) {
+    return static_cast<size_t>(position >> 32);
+}
 
-    CollectYoungGeneration();
+Heap::Block* Heap::blockAt(FreeBlockIndex::Position position) {
+    return blockAtOffset(segments[segmentOf(position)], position & 0xFFFFFFFFu);
+}
 
-    static int oldCollectionCount = 0;
-    oldCollectionCount++;
-    if (oldCollectionCount >= 5) {
-        CollectOldGeneration();
-        oldCollectionCount = 0;
-    }
+std::vector<size_t>& Heap::segmentsOf(size_t arenaIndex) {
+    return arenaIndex == noArena ? sharedSegments : arenas[arenaIndex].segmentIndices;
+}
 
-    std::cout << "Generational garbage collection complete.\n";
+FreeBlockIndex& Heap::freeIndexOf(size_t segmentIndex) {
+    return arenas[segments[segmentIndex].arena].freeIndex;
 }
 
-void Heap::CollectYoungGeneration() {
-    for (Block* block : youngGeneration) {
-        if (!block->marked) {
-            Mark(*block);
-        }
+void Heap::RebuildFreeIndex() {
+    for (size_t i = 0; i < arenaCount; ++i) {
+        arenas[i].freeIndex.Clear();
     }
-    Sweep();
-
-    for (auto it = youngGeneration.begin(); it != youngGeneration.end();) {
-        if ((*it)->marked) {
-            PromoteToOldGeneration(**it);
-            it = youngGeneration.erase(it);
-        }
-        else {
-            ++it;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        if (segments[i].arena == noArena) continue;
+        for (const Block* current = segments[i].first; current; current = current->next) {
+            const Block& block = *current;
+            if (!block.allocated && !block.cached) {
+                freeIndexOf(i).Insert(block.size, makePosition(i, block.offset));
+            }
         }
     }
 }
 
-void Heap::CollectOldGeneration() {
-    for (Block* block : oldGeneration) {
-        if (!block->marked) {
-            Mark(*block);
-        }
+template <typename FitPolicy>
+Heap::Block* Heap::findFit(Arena& arena, size_t size, FreeBlockIndex::Position& position) {
+    position = FitPolicy::Find(arena.freeIndex, size, arena.nextFitRover);
+    size_t arenaIndex = static_cast<size_t>(&arena - arenas.get());
+    if (position == FreeBlockIndex::npos) {
+        TRACE_FIT(FitMiss, size, 0);
+        stats.RecordFitMiss(arenaIndex);
+        return nullptr;
     }
-    Sweep();
+
+    Block* selectedBlock = blockAt(position);
+    TRACE_FIT(FitSelected, size, selectedBlock->size);
+    stats.RecordFitSearch(arenaIndex, size, selectedBlock->size);
+    return selectedBlock;
 }
 
-void Heap::PromoteToOldGeneration(Block& block) {
-    block.generation = 1;
-    oldGeneration.push_back(&block);
+size_t Heap::alignSize(size_t size) {
+    if (size == 0) size = 1;
+    return (size + blockAlignment - 1) / blockAlignment * blockAlignment;
 }
 
-void Heap::RunConcurrentMarkAndSweep() {
-    if (gcRunning.exchange(true)) {
-        std::cerr << "Concurrent garbage collection already running!\n";
-        return;
+bool Heap::createSegment(size_t capacity, size_t& segmentIndex, size_t arenaIndex, bool large) {
+    if (capacity > maxSegmentCapacity) {
+        return false;
     }
-
-    std::cout << "Starting concurrent mark-and-sweep...\n";
-    std::thread gcThread([this]() {
-        std::lock_guard<std::mutex> lock(heapMutex);
-        for (void* root : rootSet) {
-            Mark(*reinterpret_cast<Block*>(root));
+    // Simulated nodes and single-node machines have nothing to bind to
+    size_t node = arenaIndex != noArena ? arenas[arenaIndex].node : topology.CurrentNode();
+    bool bindToNode = !topology.simulated && topology.nodeCount > 1;
+    void* base = bindToNode ? ReserveSystemMemoryOnNode(capacity, topology.osNodes[node]) : ReserveSystemMemory(capacity);
+    if (!base) {
+        return false;
+    }
+    size_t bitmapWords = large ? 1 : (capacity / blockAlignment + 63) / 64;
+    std::unique_ptr<std::atomic<uint64_t>[]> allocatedBits(new std::atomic<uint64_t>[bitmapWords]());
+    std::unique_ptr<std::atomic<uint64_t>[]> markBits(new std::atomic<uint64_t>[bitmapWords]());
+    size_t directoryEntries = large ? 1 : (capacity + blockDirectoryStride - 1) / blockDirectoryStride;
+    std::unique_ptr<Block*[]> blockDirectory(new Block*[directoryEntries]());
+
+    {
+        std::lock_guard<std::mutex> lock(segmentTableMutex);
+        // Reuse the slot of a released segment before growing the table
+        segmentIndex = segments.size();
+        for (size_t i = retainedSegments; i < segments.size(); ++i) {
+            if (!segments[i].base) {
+                segmentIndex = i;
+                break;
+            }
+        }
+        if (segmentIndex == maxSegments) {
+            ReleaseSystemMemory(base, capacity);
+            return false;
+        }
+        if (segmentIndex == segments.size()) {
+            segments.emplace_back();
         }
-        Sweep();
-        gcRunning = false;
-        std::cout << "Concurrent mark-and-sweep complete.\n";
-        });
 
-    gcThread.detach();
+        segments[segmentIndex].base = static_cast<char*>(base);
+        segments[segmentIndex].capacity = capacity;
+        segments[segmentIndex].arena = arenaIndex;
+        segments[segmentIndex].node = node;
+        segments[segmentIndex].large = large;
+        segments[segmentIndex].allocatedBits = std::move(allocatedBits);
+        segments[segmentIndex].markBits = std::move(markBits);
+        segments[segmentIndex].bitmapWords = bitmapWords;
+        segments[segmentIndex].blockDirectory = std::move(blockDirectory);
+        segments[segmentIndex].directoryEntries = directoryEntries;
+    }
+    segmentsOf(arenaIndex).push_back(segmentIndex);
+    TRACE_ALLOC(SegmentCreated, segmentIndex, capacity);
+    stats.RecordSegmentReserved(node, capacity, 2 * bitmapWords * sizeof(uint64_t), directoryEntries * sizeof(Block*));
+    return true;
 }
 
-void Heap::WorkerFunction(size_t threadIndex, size_t totalTasks, size_t totalThreads, std::function<void(size_t)> taskFunction) {
-    for (size_t i = 0; i < totalTasks; ++i) {
-        if (i % totalThreads == threadIndex) {
-            taskFunction(i);
+void Heap::releaseSegment(size_t segmentIndex) {
+    Segment& segment = segments[segmentIndex];
+    while (segment.first) {
+        Block& block = *segment.first;
+        if (segment.buddy) {
+            buddyLists.Erase(BuddyFreeLists::OrderOf(block.size), makePosition(segmentIndex, block.offset));
         }
+        else if (segment.arena != noArena) {
+            freeIndexOf(segmentIndex).Erase(block.size, makePosition(segmentIndex, block.offset));
+        }
+        removeBlock(segmentIndex, nullptr, block);
+    }
+    if (segment.buddy) {
+        --buddySegments;
     }
-}
 
-void Heap::MeasureAllocationPermeabilitySelective(size_t totalThreads) {
-    auto startTime = std::chrono::high_resolution_clock::now();
-    std::vector<std::future<void>> futures;
-    size_t totalTasks = 5;
+    std::vector<size_t>& owned = segmentsOf(segment.arena);
+    owned.erase(std::find(owned.begin(), owned.end(), segmentIndex));
+    TRACE_ALLOC(SegmentReleased, segmentIndex, segment.capacity);
+    stats.RecordSegmentReleased(segment.node, segment.capacity, 2 * segment.bitmapWords * sizeof(uint64_t),
+        segment.directoryEntries * sizeof(Block*));
+    releaseSegmentMemory(segment);
+    std::lock_guard<std::mutex> lock(segmentTableMutex);
+    segment.base = nullptr;
+    segment.capacity = 0;
+    segment.allocatedBits.reset();
+    segment.markBits.reset();
+    segment.bitmapWords = 0;
+    segment.blockDirectory.reset();
+    segment.directoryEntries = 0;
+    segment.sweepPending = false;
+    segment.sweptWords = 0;
+    segment.nursery = false;
+    segment.buddy = false;
+    segment.large = false;
+    segment.region = false;
+    segment.mapped = false;
+    segment.nextRegionSegment = SIZE_MAX;
+    segment.arena = noArena;
+    segment.node = 0;
+}
 
-    for (size_t i = 0; i < totalThreads; ++i) {
-        futures.emplace_back(std::async(std::launch::async, [this, i, totalTasks, totalThreads]() {
-            WorkerFunction(i, totalTasks, totalThreads, [this](size_t taskIndex) {
-                size_t size = (taskIndex % 100) + 1;
-                void* allocatedMemory = Allocate(size);
-                });
-            }));
+void Heap::releaseSegmentMemory(const Segment& segment) {
+    if (segment.mapped) {
+        UnmapFileMemory(segment.base, segment.capacity);
+    }
+    else {
+        ReleaseSystemMemory(segment.base, segment.capacity);
     }
+}
 
-    for (auto& future : futures) {
-        future.wait();
+void Heap::releaseSegmentIfEmpty(size_t segmentIndex) {
+    if (segmentIndex < retainedSegments) return;
+
+    const Segment& segment = segments[segmentIndex];
+    if (segment.blockCount == 1 && !segment.nursery && !segment.buddy && !segment.large) {
+        const Block& block = *segment.first;
+        if (!block.allocated && !block.cached) {
+            releaseSegment(segmentIndex);
+        }
     }
+}
 
-    auto endTime = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count();
+Heap::Block& Heap::addBlock(size_t segmentIndex, Block* previous, size_t size) {
+    std::unique_lock<std::mutex> blockTableLock(blockTableMutex);
+    Block& block = createBlock(segmentIndex, previous, size);
+    BlockHandle handle;
+    handle.block = &block;
+    block.blockId = blockHandles.Insert(handle);
+    blockTableLock.unlock();
+    if (block.blockId == HandleTable<BlockHandle>::invalidHandle) {
+        std::cerr << "Warning: Block ID table is full, block at offset " << block.offset
+            << " in segment " << segmentIndex << " cannot be deallocated by ID.\n";
+    }
+    return block;
+}
 
-    std::cout << "Selective Allocation Permeability (" << totalThreads << " threads): "
-        << totalTasks * totalThreads << " allocations in " << duration << " ms\n";
+Heap::Block& Heap::createBlock(size_t segmentIndex, Block* previous, size_t size) {
+    Segment& segment = segments[segmentIndex];
+    Block& block = *blockStore.Create();
+    block.offset = previous ? previous->offset + previous->size : 0;
+    block.size = static_cast<uint32_t>(size);
+    block.segment = static_cast<uint16_t>(segmentIndex);
+
+    block.next = previous ? previous->next : segment.first;
+    if (previous) previous->next = &block;
+    else segment.first = &block;
+    ++segment.blockCount;
+    Block*& entry = segment.blockDirectory[directoryEntry(segment, block.offset)];
+    if (!entry || entry->offset > block.offset) entry = &block;
+    block.blockId = HandleTable<BlockHandle>::invalidHandle;
+    stats.RecordBlockCreated();
+    return block;
 }
 
-void Heap::MeasureDeallocationPermeabilitySelective(size_t totalThreads) {
-    auto startTime = std::chrono::high_resolution_clock::now();
-    std::vector<std::future<void>> futures;
-    size_t totalTasks = 5;
+void Heap::removeBlock(size_t segmentIndex, Block* previous, Block& block) {
+    unlinkBlock(segmentIndex, previous, block);
+    retireBlock(block);
+}
 
-    for (size_t i = 0; i < totalThreads; ++i) {
-        futures.emplace_back(std::async(std::launch::async, [this, i, totalTasks, totalThreads]() {
-            WorkerFunction(i, totalTasks, totalThreads, [this](size_t taskIndex) {
-                int blockId = taskIndex + 1;
-                Deallocate(blockId);
-                });
-            }));
+void Heap::unlinkBlock(size_t segmentIndex, Block* previous, Block& block) {
+    Segment& segment = segments[segmentIndex];
+    if (previous) previous->next = block.next;
+    else segment.first = block.next;
+    --segment.blockCount;
+    // The next block takes over the directory entry if it starts in the same stride
+    size_t entry = directoryEntry(segment, block.offset);
+    if (segment.blockDirectory[entry] == &block) {
+        bool sameStride = block.next && directoryEntry(segment, block.next->offset) == entry;
+        segment.blockDirectory[entry] = sameStride ? block.next : nullptr;
     }
+}
+
+size_t Heap::directoryEntry(const Segment& segment, size_t offset) {
+    return segment.large ? 0 : offset / blockDirectoryStride;
+}
 
-    for (auto& future : futures) {
-        future.wait();
+Heap::Block* Heap::blockAtOffset(const Segment& segment, size_t offset) {
+    size_t entry = directoryEntry(segment, offset);
+    if (entry >= segment.directoryEntries) return nullptr;
+    Block* block = segment.blockDirectory[entry];
+    while (block && block->offset < offset) {
+        block = block->next;
     }
+    return block && block->offset == offset ? block : nullptr;
+}
 
-    auto endTime = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count();
+Heap::Block* Heap::blockBefore(const Segment& segment, const Block& block) {
+    if (segment.first == &block) return nullptr;
+    // Some block starts before this one, in its own stride or the nearest earlier one that has any
+    size_t entry = directoryEntry(segment, block.offset);
+    Block* previous = segment.blockDirectory[entry];
+    while (!previous || previous == &block) {
+        previous = segment.blockDirectory[--entry];
+    }
+    while (previous->next != &block) {
+        previous = previous->next;
+    }
+    return previous;
+}
 
-    std::cout << "Selective Deallocation Permeability (" << totalThreads << " threads): "
-        << totalTasks * totalThreads << " deallocations in " << duration << " ms\n";
+void Heap::retireBlock(Block& block) {
+    std::lock_guard<std::mutex> lock(blockTableMutex);
+    blockHandles.Remove(block.blockId);
+    blockStore.Release(&block);
+    stats.RecordBlockRetired();
 }
+
+void Heap::splitBlock(size_t segmentIndex, Block& block, size_t size) {
+    if (block.size < size + blockAlignment) return;
+
+    size_t remainderSize = block.size - size;
+    block.size = static_cast<uint32_t>(size);
+    Block& remainder = addBlock(segmentIndex, &block, remainderSize);
+    freeIndexOf(segmentIndex).Insert(remainder.size, makePosition(segmentIndex, remainder.offset));
+}
+
+Heap::Block& Heap::coalesceAndIndex(size_t segmentIndex, Block& block) {
+    auto isIndexedFree = [](const Block* candidate) {
+        return candidate && !candidate->allocated && !candidate->cached;
+    };
+
+    FreeBlockIndex& freeIndex = freeIndexOf(segmentIndex);
+
+    // Absorb the following block
+    Block* merged = &block;
+    Block* next = merged->next;
+    if (isIndexedFree(next)) {
+        freeIndex.Erase(next->size, makePosition(segmentIndex, next->offset));
+        merged->size += next->size;
+        removeBlock(segmentIndex, merged, *next);
+    }
+
+    // Let the preceding block absorb this one
+    Block* previous = blockBefore(segments[segmentIndex], *merged);
+    if (isIndexedFree(previous)) {
+        freeIndex.Erase(previous->size, makePosition(segmentIndex, previous->offset));
+        previous->size += merged->size;
+        removeBlock(segmentIndex, previous, *merged);
+        merged = previous;
+    }
+
+    freeIndex.Insert(merged->size, makePosition(segmentIndex, merged->offset));
+    return *merged;
+}
+
+Heap::Block* Heap::resolve(int blockId) {
+    if (blockId < 0) return nullptr;
+    BlockHandle* handle = blockHandles.Find(blockId);
+    return handle && handle->block->allocated ? handle->block : nullptr;
+}
+
+template <typename Visit>
+void Heap::forEachReference(Block& block, Visit visit) {
+    if (block.type) {
+        // Also read by releaseBlock once the block no longer counts as allocated
+        const char* object = segments[block.segment].base + block.offset;
+        for (size_t i = 0; i < block.type->referenceCount; ++i) {
+            int blockId;
+            std::memcpy(&blockId, object + block.type->referenceOffsets[i], sizeof(blockId));
+            if (Block* referencedBlock = resolve(blockId)) {
+                visit(referencedBlock);
+            }
+        }
+        return;
+    }
+    if (!block.hasReferences) return;
+    std::lock_guard<std::mutex> lock(referencesMutex);
+    auto references = untypedReferences.find(block.blockId);
+    if (references == untypedReferences.end()) return;
+    for (int blockId : references->second) {
+        if (Block* referencedBlock = resolve(blockId)) {
+            visit(referencedBlock);
+        }
+    }
+}
+
+void Heap::dropReferences(Block& block) {
+    if (block.hasReferences) {
+        std::lock_guard<std::mutex> lock(referencesMutex);
+        untypedReferences.erase(block.blockId);
+        block.hasReferences = false;
+    }
+    setType(block, nullptr);
+}
+
+void* Heap::commitBlock(size_t segmentIndex, Block& block, const TypeInfo* type, const void* object) {
+    // Allocated after marking began, so neither the marker nor an unswept segment may take it for
+    // garbage. The mark goes first: a sweep frees allocated blocks without one. The part of a segment
+    // a sweep has done must not keep marks, they would hide the block from the next mark phase.
+    const Segment& segment = segments[segmentIndex];
+    if (concurrentMarking || (segment.sweepPending && block.offset / blockAlignment / 64 >= segment.sweptWords)) {
+        setMark(block);
+    }
+    setAllocated(block, true);
+    // A reused block gets a fresh Block ID, so an ID kept from its previous allocation is stale
+    if (block.issued) {
+        int reissued = blockHandles.Reissue(block.blockId);
+        // The slot has no version left, so the block moves to another one
+        if (reissued == HandleTable<BlockHandle>::invalidHandle && block.blockId != HandleTable<BlockHandle>::invalidHandle) {
+            std::lock_guard<std::mutex> blockTableLock(blockTableMutex);
+            reissued = blockHandles.Replace(block.blockId);
+            if (reissued == HandleTable<BlockHandle>::invalidHandle) {
+                std::cerr << "Warning: Block ID table is full, block at offset " << block.offset
+                    << " in segment " << segmentIndex << " cannot be deallocated by ID.\n";
+            }
+        }
+        block.blockId = reissued;
+    }
+    block.issued = true;
+    char* payload = segments[segmentIndex].base + block.offset;
+    // The object is in place before a collection can see the block, so its Ref fields are never half written
+    setType(block, type);
+    block.rootHandles = type ? 1 : 0;
+    if (type) {
+        std::memcpy(payload, object, type->size);
+    }
+    return payload;
+}
+
+void Heap::releaseBlock(size_t segmentIndex, Block& block) {
+    setAllocated(block, false);
+    // Dropping references during a concurrent mark goes through the barrier like any pointer store
+    forEachReference(block, [this](Block* referencedBlock) { shade(referencedBlock); });
+    dropReferences(block);
+    // Nursery space is only reclaimed as a whole when the nursery is reset
+    if (block.nursery) return;
+    if (block.buddy) {
+        releaseBuddy(segmentIndex, block);
+        return;
+    }
+    if (segments[segmentIndex].large) {
+        releaseLarge(segmentIndex);
+        return;
+    }
+    coalesceAndIndex(segmentIndex, block);
+    releaseSegmentIfEmpty(segmentIndex);
+}
+
+char* Heap::payloadOf(const Block& block) const {
+    return block.allocated ? segments[block.segment].base + block.offset : nullptr;
+}
+
+Heap::Block* Heap::payloadLink(const Block& block) const {
+    Block* link;
+    std::memcpy(&link, segments[block.segment].base + block.offset, sizeof(link));
+    return link;
+}
+
+void Heap::setPayloadLink(const Block& block, Block* link) {
+    std::memcpy(segments[block.segment].base + block.offset, &link, sizeof(link));
+}
+
+void Heap::setAllocated(Block& block, bool allocated) {
+    block.allocated = allocated;
+    size_t granule = block.offset / blockAlignment;
+    uint64_t bit = uint64_t(1) << (granule % 64);
+    std::atomic<uint64_t>& word = segments[block.segment].allocatedBits[granule / 64];
+    if (allocated) {
+        word.fetch_or(bit, std::memory_order_relaxed);
+    }
+    else {
+        word.fetch_and(~bit, std::memory_order_relaxed);
+    }
+}
+
+bool Heap::isAllocated(const Block& block) const {
+    size_t granule = block.offset / blockAlignment;
+    return (segments[block.segment].allocatedBits[granule / 64].load(std::memory_order_relaxed) >> (granule % 64)) & 1;
+}
+
+void Heap::setType(Block& block, const TypeInfo* type) {
+    block.type = type;
+    block.typed.store(type != nullptr, std::memory_order_release);
+}
+
+bool Heap::isMarked(const Block& block) const {
+    size_t granule = block.offset / blockAlignment;
+    return (segments[block.segment].markBits[granule / 64].load(std::memory_order_relaxed) >> (granule % 64)) & 1;
+}
+
+void Heap::setMark(Block& block) {
+    size_t granule = block.offset / blockAlignment;
+    segments[block.segment].markBits[granule / 64].fetch_or(uint64_t(1) << (granule % 64), std::memory_order_relaxed);
+}
+
+void Heap::clearMark(Block& block) {
+    size_t granule = block.offset / blockAlignment;
+    segments[block.segment].markBits[granule / 64].fetch_and(~(uint64_t(1) << (granule % 64)), std::memory_order_relaxed);
+}
+
+void Heap::AddToRootSet(Block& block) {
+    block.rootIndex = static_cast<uint32_t>(rootSet.size());
+    rootSet.push_back(&block);
+}
+
+void Heap::trackAllocatedBlock(Block& block) {
+    std::lock_guard<std::mutex> lock(rootsMutex);
+    listAllocatedBlock(block);
+}
+
+void Heap::untrackBlock(Block& block) {
+    std::lock_guard<std::mutex> lock(rootsMutex);
+    unlistBlock(block);
+}
+
+void Heap::trackAllocatedBlocks(const std::vector<Block*>& blocks) {
+    std::lock_guard<std::mutex> lock(rootsMutex);
+    rootSet.reserve(rootSet.size() + blocks.size());
+    for (Block* block : blocks) {
+        listAllocatedBlock(*block);
+    }
+}
+
+void Heap::untrackBlocks(const std::vector<Block*>& blocks) {
+    std::lock_guard<std::mutex> lock(rootsMutex);
+    for (Block* block : blocks) {
+        unlistBlock(*block);
+    }
+}
+
+void Heap::listAllocatedBlock(Block& block) {
+    if (block.rootIndex == notListed && (!block.type || block.rootHandles > 0)) {
+        AddToRootSet(block);
+    }
+    if (block.generationIndex == notListed) {
+        block.generation = 0;
+        addToGeneration(block, false);
+    }
+}
+
+void Heap::unlistBlock(Block& block) {
+    if (block.rootIndex != notListed) {
+        RemoveFromRootSet(block);
+    }
+    if (block.generationIndex != notListed) {
+        removeFromGeneration(block);
+    }
+    block.generation = 0;
+    block.old = false;
+    block.remembered = false;
+}
+
+void Heap::RemoveFromRootSet(Block& block) {
+    // Move the last root into the vacated slot
+    Block* lastRoot = static_cast<Block*>(rootSet.back());
+    rootSet[block.rootIndex] = lastRoot;
+    lastRoot->rootIndex = block.rootIndex;
+    rootSet.pop_back();
+    block.rootIndex = notListed;
+}
+
+void Heap::CollectGarbage() {
+    std::cout << "Starting garbage collection...\n";
+    {
+        std::lock_guard<std::mutex> collectionLock(collectionMutex);
+        std::lock_guard<std::mutex> lock(heapMutex);
+        auto arenaLocks = LockArenas(true);
+        ScopedPause pause(stats, PauseKind::Full);
+
+        // Mark phase: Mark all reachable objects from the root set
+        MarkRoots();
+
+        // Sweep phase: Free memory that is not marked, or leave it to Allocate in lazy mode
+        if (lazySweep) {
+            queueLazySweep();
+        }
+        else {
+            Sweep();
+            stats.RecordFragmentation(fragmentation());
+        }
+    }
+    printCollectionLog();
+    std::cout << "Garbage collection complete.\n";
+}
+
+void Heap::printCollectionLog() {
+    std::string messages;
+    {
+        std::lock_guard<std::mutex> lock(heapMutex);
+        messages = collectionLog.str();
+        collectionLog.str(std::string());
+    }
+    std::cout << messages;
+}
+
+void Heap::MarkRoots(const std::vector<Block*>& extraSeeds) {
+    // Marks left by the previous lazy collection would keep its garbage alive
+    finishLazySweep();
+
+    std::vector<Block*> seeds;
+    seeds.reserve(rootSet.size() + extraSeeds.size());
+    for (void* root : rootSet) {
+        if (root) {
+            seeds.push_back(reinterpret_cast<Block*>(root));
+        }
+    }
+    seeds.insert(seeds.end(), extraSeeds.begin(), extraSeeds.end());
+    Mark(seeds);
+}
+
+bool Heap::tryMark(Block& block, bool youngOnly) {
+    // If the block is already marked or not in use, skip it
+    if (!block.allocated || (youngOnly && block.old)) return false;
+    size_t granule = block.offset / blockAlignment;
+    uint64_t bit = uint64_t(1) << (granule % 64);
+    std::atomic<uint64_t>& word = segments[block.segment].markBits[granule / 64];
+    if (word.load(std::memory_order_relaxed) & bit) return false;
+    return !(word.fetch_or(bit) & bit);
+}
+
+void Heap::Mark(const std::vector<Block*>& seeds, bool youngOnly) {
+    auto startTime = std::chrono::high_resolution_clock::now();
+
+    size_t threadCount = std::max<size_t>(totalThreads, 1);
+    if (blockStore.LiveCount() < parallelMarkThreshold) {
+        threadCount = 1;
+    }
+
+    // Each worker starts with an equal share of the seeds in its own deque
+    std::vector<std::unique_ptr<WorkStealingDeque<Block*>>> deques;
+    for (size_t i = 0; i < threadCount; ++i) {
+        deques.emplace_back(new WorkStealingDeque<Block*>());
+    }
+    // Seeds go to the workers on their segment's node
+    size_t seedCount = 0;
+    std::vector<size_t> nodeSeeds(topology.nodeCount, 0);
+    for (Block* seed : seeds) {
+        if (seed && tryMark(*seed, youngOnly)) {
+            size_t node = segments[seed->segment].node;
+            deques[nodeWorker(node, nodeSeeds[node]++, threadCount)]->Push(seed);
+            ++seedCount;
+        }
+    }
+
+    // Blocks marked but not traced yet; the phase is over once this drops to zero
+    std::atomic<size_t> pendingBlocks(seedCount);
+    std::atomic<size_t> markedBlocks(seedCount);
+    std::atomic<size_t> stolenTasks(0);
+
+    // Iterative, so deep object graphs cannot overflow the stack
+    auto worker = [&](size_t workerIndex) {
+        // The calling thread stays where it is; the others move to their node
+        if (workerIndex > 0) {
+            RunOnNode(topology, workerIndex % topology.nodeCount);
+        }
+        WorkStealingDeque<Block*>& own = *deques[workerIndex];
+        size_t marked = 0;
+        size_t stolen = 0;
+
+        while (pendingBlocks.load() > 0) {
+            Block* block = nullptr;
+            if (!own.Pop(block)) {
+                // Workers of the same node are robbed first, whose blocks are likelier local
+                block = nullptr;
+                for (size_t pass = 0; pass < 2 && !block; ++pass) {
+                    for (size_t i = 1; i < threadCount && !block; ++i) {
+                        size_t victim = (workerIndex + i) % threadCount;
+                        bool sameNode = victim % topology.nodeCount == workerIndex % topology.nodeCount;
+                        if (sameNode != (pass == 0)) continue;
+                        if (deques[victim]->Steal(block)) {
+                            ++stolen;
+                        }
+                        else {
+                            block = nullptr;
+                        }
+                    }
+                }
+                if (!block) {
+                    std::this_thread::yield();
+                    continue;
+                }
+            }
+
+            // Referenced blocks become pending before this one stops counting
+            forEachReference(*block, [&](Block* referencedBlock) {
+                if (tryMark(*referencedBlock, youngOnly)) {
+                    ++marked;
+                    pendingBlocks.fetch_add(1);
+                    own.Push(referencedBlock);
+                }
+            });
+            pendingBlocks.fetch_sub(1);
+        }
+
+        markedBlocks += marked;
+        stolenTasks += stolen;
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threadCount; ++i) {
+        workers.emplace_back(worker, i);
+    }
+    worker(0);
+    for (std::thread& thread : workers) {
+        thread.join();
+    }
+
+    auto endTime = std::chrono::high_resolution_clock::now();
+    lastMarkStats.threads = threadCount;
+    lastMarkStats.markedBlocks = markedBlocks;
+    lastMarkStats.stolenTasks = stolenTasks;
+    lastMarkStats.milliseconds = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+    TRACE_GC(MarkDone, markedBlocks, lastMarkStats.milliseconds * 1000.0);
+
+    collectionLog << "Mark phase: " << lastMarkStats.markedBlocks << " blocks marked in "
+        << lastMarkStats.milliseconds << " ms on " << threadCount << " threads ("
+        << lastMarkStats.stolenTasks << " stolen tasks)\n";
+}
+
+Heap::MarkStats Heap::GetLastMarkStats() {
+    std::lock_guard<std::mutex> lock(heapMutex);
+    return lastMarkStats;
+}
+
+void Heap::Sweep() {
+    auto startTime = std::chrono::high_resolution_clock::now();
+
+    // Segments are independent, so each worker sweeps its own share of them, taken from its node
+    size_t threadCount = std::min(std::max<size_t>(totalThreads, 1), std::max<size_t>(segments.size(), 1));
+    if (blockStore.LiveCount() < parallelMarkThreshold) {
+        threadCount = 1;
+    }
+
+    std::vector<SweepResult> results(segments.size());
+    std::vector<std::vector<size_t>> tasks(threadCount);
+    std::vector<size_t> nodeSegments(topology.nodeCount, 0);
+    for (size_t i = 0; i < segments.size(); ++i) {
+        size_t node = segments[i].node;
+        tasks[nodeWorker(node, nodeSegments[node]++, threadCount)].push_back(i);
+    }
+    auto sweepTask = [this, &results](size_t segmentIndex) {
+        if (!segments[segmentIndex].region) {
+            results[segmentIndex] = sweepSegment(segmentIndex);
+        }
+    };
+    // Dedicated threads, as std::async may hand the work to pool threads that would stay pinned
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threadCount; ++i) {
+        workers.emplace_back([this, i, &tasks, sweepTask]() {
+            RunOnNode(topology, i % topology.nodeCount);
+            WorkerFunction(tasks[i], sweepTask);
+            });
+    }
+    WorkerFunction(tasks[0], sweepTask);
+    for (std::thread& thread : workers) {
+        thread.join();
+    }
+
+    // Shared structures are only touched here, in time proportional to what changed
+    size_t freedBlocks = 0;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        freedBlocks += results[i].freedBlocks.size();
+        applySweepResult(i, results[i]);
+    }
+
+    auto endTime = std::chrono::high_resolution_clock::now();
+    double milliseconds = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+    TRACE_GC(SweepDone, freedBlocks, milliseconds * 1000.0);
+    collectionLog << "Sweep phase: " << freedBlocks << " blocks freed in "
+        << milliseconds
+        << " ms on " << threadCount << " threads\n";
+}
+
+Heap::SweepResult Heap::sweepSegment(size_t segmentIndex, size_t wordLimit) {
+    Segment& segment = segments[segmentIndex];
+    size_t firstWord = std::min(segment.sweptWords, segment.bitmapWords);
+    size_t endWord = segment.bitmapWords - firstWord > wordLimit ? firstWord + wordLimit : segment.bitmapWords;
+    segment.sweptWords = endWord;
+    if (endWord == segment.bitmapWords) {
+        segment.sweepPending = false;
+        segment.sweptWords = 0;
+    }
+    SweepResult result;
+
+    // Current run of free, uncached neighbours; it is merged into its first block
+    Block* runHead = nullptr;
+    size_t runHeadSize = 0;
+    bool runHeadIndexed = false;
+    bool runChanged = false;
+    auto closeRun = [&]() {
+        if (runHead && runChanged) {
+            if (runHeadIndexed) {
+                result.indexErasures.emplace_back(runHeadSize, runHead->offset);
+            }
+            result.indexInsertions.push_back(runHead);
+        }
+        runHead = nullptr;
+    };
+
+    // Garbage is allocated without a mark, 64 granules per bitmap word. Marks are cleared for the
+    // next collection as they are read, so only garbage blocks and their neighbours are visited.
+    for (size_t word = firstWord; word < endWord; ++word) {
+        uint64_t marks = segment.markBits[word].exchange(0, std::memory_order_relaxed);
+        uint64_t garbage = segment.allocatedBits[word].load(std::memory_order_relaxed) & ~marks;
+        while (garbage != 0) {
+            size_t granule = word * 64 + countTrailingZeros(garbage);
+            garbage &= garbage - 1;
+            Block* block = blockAtOffset(segment, granule * blockAlignment);
+
+            setAllocated(*block, false);
+            dropReferences(*block);
+            result.freedBlocks.push_back(block);
+            result.freedBytes += block->size;
+
+            // Freed nursery and large blocks are neither merged nor indexed, buddy blocks are merged afterwards
+            if (segment.nursery || segment.buddy || segment.large) continue;
+
+            // Join the run this block continues, or start one at the free block before it
+            if (runHead && runHead->next == block) {
+                runHead->size += block->size;
+                unlinkBlock(segmentIndex, runHead, *block);
+                result.mergedBlocks.push_back(block);
+            }
+            else {
+                closeRun();
+                Block* previous = blockBefore(segment, *block);
+                if (previous && !previous->allocated && !previous->cached) {
+                    runHead = previous;
+                    runHeadSize = previous->size;
+                    runHeadIndexed = true;
+                    runHead->size += block->size;
+                    unlinkBlock(segmentIndex, previous, *block);
+                    result.mergedBlocks.push_back(block);
+                }
+                else {
+                    runHead = block;
+                    runHeadSize = block->size;
+                    runHeadIndexed = false;
+                }
+            }
+            runChanged = true;
+
+            // The free blocks that follow were in the free index; blocks freed later in the scan join on their own
+            for (Block* next = runHead->next; next && !next->allocated && !next->cached; next = runHead->next) {
+                result.indexErasures.emplace_back(next->size, next->offset);
+                runHead->size += next->size;
+                unlinkBlock(segmentIndex, runHead, *next);
+                result.mergedBlocks.push_back(next);
+            }
+        }
+    }
+    closeRun();
+
+    return result;
+}
+
+void Heap::applySweepResult(size_t segmentIndex, SweepResult& result) {
+    stats.RecordCollected(result.freedBlocks.size(), result.freedBytes);
+    for (const auto& erasure : result.indexErasures) {
+        freeIndexOf(segmentIndex).Erase(erasure.first, makePosition(segmentIndex, erasure.second));
+    }
+    for (Block* block : result.indexInsertions) {
+        freeIndexOf(segmentIndex).Insert(block->size, makePosition(segmentIndex, block->offset));
+    }
+    for (Block* block : result.freedBlocks) {
+        untrackBlock(*block);
+    }
+    for (Block* block : result.mergedBlocks) {
+        retireBlock(*block);
+    }
+    if (segments[segmentIndex].large) {
+        if (!result.freedBlocks.empty()) {
+            releaseLarge(segmentIndex);
+        }
+        return;
+    }
+    if (segments[segmentIndex].buddy) {
+        if (!result.freedBlocks.empty()) {
+            relistBuddySegment(segmentIndex);
+        }
+        releaseBuddySegmentIfEmpty(segmentIndex);
+        return;
+    }
+    releaseSegmentIfEmpty(segmentIndex);
+}
+
+void Heap::queueLazySweep() {
+    for (Segment& segment : segments) {
+        if (segment.base && !segment.region) {
+            segment.sweepPending = true;
+            segment.sweptWords = 0;
+        }
+    }
+}
+
+bool Heap::sweepPendingSegment() {
+    for (size_t i = 0; i < segments.size(); ++i) {
+        if (segments[i].sweepPending) {
+            sweepQueuedSegment(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Heap::sweepPendingSegment(size_t arenaIndex) {
+    for (size_t segmentIndex : segmentsOf(arenaIndex)) {
+        if (segments[segmentIndex].sweepPending) {
+            // May release the segment and with it this entry of the list
+            sweepQueuedSegment(segmentIndex);
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t Heap::sweepQueuedSegment(size_t segmentIndex, size_t wordLimit) {
+    SweepResult result = sweepSegment(segmentIndex, wordLimit);
+    size_t changedBlocks = result.freedBlocks.size() + result.mergedBlocks.size();
+    applySweepResult(segmentIndex, result);
+    return changedBlocks;
+}
+
+void Heap::finishLazySweep() {
+    finishIncrementalCycle();
+    while (sweepPendingSegment()) {
+    }
+}
+
+void Heap::SetLazySweep(bool enabled) {
+    std::lock_guard<std::mutex> lock(heapMutex);
+    auto arenaLocks = LockArenas(false);
+    lazySweep = enabled;
+    if (!enabled) {
+        finishLazySweep();
+    }
+    std::cout << "Lazy sweeping " << (enabled ? "enabled" : "disabled") << ".\n";
+}
+
+size_t Heap::getSegmentIndexForBlock(const Block& block) {
+    return block.segment;
+}
+
+void Heap::CheckMemory() {
+    std::lock_guard<std::mutex> lock(heapMutex);
+    auto arenaLocks = LockArenas(false);
+    std::cout << "Checking memory integrity...\n";
+
+    for (size_t i = 0; i < segments.size(); ++i) {
+        const Segment& segment = segments[i];
+        if (!segment.base) {
+            std::cout << "Segment " << i << ": released\n";
+            continue;
+        }
+        std::cout << "Segment " << i << (segment.nursery ? " [nursery]" : segment.buddy ? " [buddy]" : segment.large ? " [large]" : segment.region ? " [region]" : "");
+        if (segment.arena != noArena) {
+            std::cout << " in arena " << segment.arena;
+        }
+        std::cout << " (" << segment.capacity << " bytes at "
+            << static_cast<const void*>(segment.base) << ")"
+            << (segment.mapped ? ", mapped from a snapshot" : "")
+            << (segment.sweepPending ? ", sweep pending" : "") << ":\n";
+
+        size_t expectedOffset = 0;
+        for (const Block* current = segment.first; current; current = current->next) {
+            const Block& block = *current;
+            if (block.allocated) {
+                std::cout << "  Block at address " << static_cast<const void*>(payloadOf(block))
+                    << " (Block ID: " << block.blockId
+                    << ", Size: " << block.size << ") is allocated.\n";
+            }
+            else {
+                std::cout << "  Block at address " << static_cast<const void*>(payloadOf(block))
+                    << " (Block ID: " << block.blockId
+                    << ", Size: " << block.size << ") is deallocated"
+                    << (block.cached ? " (thread cache).\n" : ".\n");
+            }
+
+            if (block.offset != expectedOffset || block.offset % blockAlignment != 0) {
+                std::cerr << "Error: Block ID " << block.blockId << " at offset " << block.offset
+                    << " does not follow its neighbour at offset " << expectedOffset << ".\n";
+            }
+            expectedOffset = block.offset + block.size;
+
+            // What a restored heap rebuilt from the snapshot's metadata must agree with the blocks
+            size_t granule = block.offset / blockAlignment;
+            bool allocatedBit = (segment.allocatedBits[granule / 64].load(std::memory_order_relaxed) >> (granule % 64)) & 1;
+            if (allocatedBit != block.allocated) {
+                std::cerr << "Error: Block ID " << block.blockId << " disagrees with its segment's allocation bitmap.\n";
+            }
+            const BlockHandle* handle = block.blockId >= 0 ? blockHandles.Find(block.blockId) : nullptr;
+            if (block.blockId >= 0 && (!handle || handle->block != &block || block.segment != i)) {
+                std::cerr << "Error: Block ID " << block.blockId << " does not lead back to its block.\n";
+            }
+            if (block.allocated && block.generationIndex == notListed) {
+                std::cerr << "Error: Allocated Block ID " << block.blockId << " is in no generation.\n";
+            }
+            if (block.type && block.type->size > block.size) {
+                std::cerr << "Error: Block ID " << block.blockId << " is smaller than its " << block.type->name << ".\n";
+            }
+        }
+
+        // Region segments are bump-allocated and have no blocks
+        if (!segment.region && expectedOffset != segment.capacity) {
+            std::cerr << "Error: Blocks in segment " << i << " cover " << expectedOffset
+                << " of " << segment.capacity << " bytes.\n";
+        }
+    }
+
+    for (int old = 0; old < 2; ++old) {
+        const std::vector<Block*>& list = old ? oldGeneration : youngGeneration;
+        for (size_t i = 0; i < list.size(); ++i) {
+            if (!list[i]->allocated || list[i]->old != (old == 1) || list[i]->generationIndex != i) {
+                std::cerr << "Error: Block ID " << list[i]->blockId << " is misplaced in the "
+                    << (old ? "old" : "young") << " generation.\n";
+            }
+        }
+    }
+
+    std::cout << "Root set:\n";
+    for (size_t i = 0; i < rootSet.size(); ++i) {
+        void* root = rootSet[i];
+        const Block* block = reinterpret_cast<const Block*>(root);
+        if (block && (!block->allocated || block->rootIndex != i)) {
+            std::cerr << "Error: Root " << i << " holds Block ID " << block->blockId << ", which is "
+                << (block->allocated ? "listed at another slot" : "not allocated") << ".\n";
+        }
+        if (block) {
+            size_t segmentIndex = getSegmentIndexForBlock(*block);
+            if (segmentIndex != SIZE_MAX) {
+                std::cout << "Root at address " << root
+                    << " points to Block ID: " << block->blockId
+                    << " (Size: " << block->size << ") in Segment " << segmentIndex << ".\n";
+            }
+            else {
+                std::cerr << "Error: Block not found in any segment.\n";
+            }
+        }
+        else {
+            std::cerr << "Error: Null pointer in root set.\n";
+        }
+    }
+
+    std::cout << "Memory check complete.\n";
+}
+
+
+
+void Heap::RunGenerationalGC() {
+    std::cout << "Running generational garbage collection...\n";
+    {
+        std::lock_guard<std::mutex> collectionLock(collectionMutex);
+        std::lock_guard<std::mutex> lock(heapMutex);
+        auto arenaLocks = LockArenas(true);
+        ScopedPause pause(stats, PauseKind::Generational);
+
+        CollectYoungGeneration();
+
+        if (++generationalRuns >= oldCollectionInterval) {
+            CollectOldGeneration();
+            generationalRuns = 0;
+        }
+    }
+    printCollectionLog();
+    std::cout << "Generational garbage collection complete.\n";
+}
+
+void Heap::CollectYoungGeneration() {
+    auto startTime = std::chrono::high_resolution_clock::now();
+    // Marks left by a lazy collection would read as young survivors
+    finishLazySweep();
+
+    // Nursery survivors are copied out first and then aged like any other young block
+    size_t evacuatedBlocks = nurserySegment != SIZE_MAX ? evacuateNursery() : 0;
+
+    // Minor roots: rooted young blocks and young blocks referenced from the remembered set
+    std::vector<Block*> seeds;
+    for (Block* block : youngGeneration) {
+        if (block->rootIndex != notListed) {
+            seeds.push_back(block);
+        }
+    }
+    size_t rememberedBlocks = 0;
+    for (Block* block : rememberedSet) {
+        if (!block->remembered || !block->allocated) continue;
+        ++rememberedBlocks;
+        forEachReference(*block, [&](Block* referencedBlock) {
+            if (!referencedBlock->old) {
+                seeds.push_back(referencedBlock);
+            }
+        });
+    }
+    Mark(seeds, true);
+
+    // Only the young generation is swept; survivors age and move up at promotionAge
+    size_t youngBlocks = youngGeneration.size();
+    size_t freedBlocks = 0;
+    size_t freedBytes = 0;
+    size_t promotedBlocks = 0;
+    std::vector<Block*> candidates = youngGeneration;
+    for (Block* block : candidates) {
+        if (!isMarked(*block)) {
+            size_t segmentIndex = getSegmentIndexForBlock(*block);
+            freedBytes += block->size;
+            untrackBlock(*block);
+            releaseBlock(segmentIndex, *block);
+            ++freedBlocks;
+        }
+        else {
+            clearMark(*block);
+            // A block left in the nursery is promoted once it has been copied out
+            if (++block->generation >= promotionAge && !block->nursery) {
+                PromoteToOldGeneration(*block);
+                ++promotedBlocks;
+            }
+        }
+    }
+    rebuildRememberedSet();
+    stats.RecordCollected(freedBlocks, freedBytes);
+    stats.RecordMinorCollection();
+
+    auto endTime = std::chrono::high_resolution_clock::now();
+    TRACE_GC(MinorCollection, youngBlocks, freedBlocks);
+    collectionLog << "Minor collection: " << evacuatedBlocks << " evacuated from the nursery, "
+        << youngBlocks << " young blocks, " << freedBlocks << " freed, " << promotedBlocks << " promoted, "
+        << rememberedBlocks << " remembered old blocks scanned, in "
+        << std::chrono::duration<double, std::milli>(endTime - startTime).count() << " ms\n";
+}
+
+void Heap::CollectOldGeneration() {
+    MarkRoots(oldGeneration);
+    Sweep();
+    if (fragmentation() >= compactionThreshold) {
+        CompactSegments();
+    }
+    stats.RecordFragmentation(fragmentation());
+}
+
+size_t Heap::GetReservedBytes() {
+    // Segments are only created and released under segmentTableMutex
+    std::lock_guard<std::mutex> lock(segmentTableMutex);
+    size_t reservedBytes = 0;
+    for (const Segment& segment : segments) {
+        reservedBytes += segment.capacity;
+    }
+    return reservedBytes;
+}
+
+double Heap::GetFragmentation() {
+    std::lock_guard<std::mutex> lock(heapMutex);
+    // Cached blocks count as used, but their flags must not change mid-scan
+    auto arenaLocks = LockArenas(false);
+    return fragmentation(true);
+}
+
+double Heap::fragmentation(bool includeBuddySegments) const {
+    size_t freeBytes = 0;
+    size_t largestFreeBlock = 0;
+    for (const Segment& segment : segments) {
+        if (segment.nursery || segment.large || (segment.buddy && !includeBuddySegments)) continue;
+        for (const Block* block = segment.first; block; block = block->next) {
+            if (!block->allocated && !block->cached) {
+                freeBytes += block->size;
+                largestFreeBlock = std::max<size_t>(largestFreeBlock, block->size);
+            }
+        }
+    }
+    return freeBytes > 0 ? 1.0 - static_cast<double>(largestFreeBlock) / freeBytes : 0.0;
+}
+
+void Heap::CompactSegments() {
+    auto startTime = std::chrono::high_resolution_clock::now();
+    double fragmentationBefore = fragmentation();
+
+    struct Occupancy {
+        size_t segmentIndex;
+        size_t liveBytes;
+        size_t freeBytes;
+    };
+    std::vector<Occupancy> occupancy;
+    size_t targetFreeBytes = 0;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        if (!segments[i].base || segments[i].nursery || segments[i].buddy || segments[i].large || segments[i].region) continue;
+        Occupancy entry = { i, 0, 0 };
+        // Allocate handed out the addresses of untyped blocks and Get those of pinned objects,
+        // so a segment holding either cannot be emptied
+        bool pinned = false;
+        for (const Block* block = segments[i].first; block; block = block->next) {
+            (block->allocated ? entry.liveBytes : entry.freeBytes) += block->size;
+            pinned = pinned || (block->allocated && (!block->type || isPinned(*block)));
+        }
+        targetFreeBytes += entry.freeBytes;
+        if (!pinned) {
+            occupancy.push_back(entry);
+        }
+    }
+
+    // Empty the sparsest segments for as long as the others have room for their live blocks
+    std::sort(occupancy.begin(), occupancy.end(), [](const Occupancy& a, const Occupancy& b) {
+        return a.liveBytes < b.liveBytes;
+        });
+    std::vector<size_t> sources;
+    size_t movingBytes = 0;
+    for (const Occupancy& entry : occupancy) {
+        if (entry.liveBytes == 0) continue;
+        if (entry.liveBytes * 2 > segments[entry.segmentIndex].capacity) break;
+        if (movingBytes + entry.liveBytes > targetFreeBytes - entry.freeBytes) break;
+        movingBytes += entry.liveBytes;
+        targetFreeBytes -= entry.freeBytes;
+        sources.push_back(entry.segmentIndex);
+    }
+    if (sources.empty()) {
+        collectionLog << "Compaction skipped: no segment can be emptied into the others.\n";
+        return;
+    }
+
+    // With the sources' free space out of the index, moved blocks can only land elsewhere
+    for (size_t segmentIndex : sources) {
+        for (const Block* block = segments[segmentIndex].first; block; block = block->next) {
+            if (!block->allocated) {
+                freeIndexOf(segmentIndex).Erase(block->size, makePosition(segmentIndex, block->offset));
+            }
+        }
+    }
+    size_t movedBlocks = 0;
+    for (size_t segmentIndex : sources) {
+        for (Block* block = segments[segmentIndex].first; block; block = block->next) {
+            if (!block->allocated) continue;
+            // Best-Fit packs the holes tightly; a block that fits nowhere stays where it is
+            size_t destinationSegment;
+            Block* destination = reserveBlock<BestFit>(block->size, destinationSegment, false);
+            if (!destination) continue;
+            moveBlock(*block, *destination, destinationSegment);
+            ++movedBlocks;
+        }
+    }
+
+    // References are Block IDs, which moved with their blocks; only the remembered set follows forwarding pointers
+    for (Block*& block : rememberedSet) {
+        if (block->forwarded) {
+            block = payloadLink(*block);
+        }
+    }
+    rebuildRememberedSet();
+
+    // Emptied segments go back to the OS, anything left gets its free space merged and indexed again
+    size_t releasedSegments = 0;
+    size_t releasedBytes = 0;
+    for (size_t segmentIndex : sources) {
+        Segment& segment = segments[segmentIndex];
+        bool empty = true;
+        for (Block* block = segment.first; block; block = block->next) {
+            block->forwarded = false;
+            empty = empty && !block->allocated;
+        }
+        if (empty && segmentIndex >= retainedSegments) {
+            releasedBytes += segment.capacity;
+            releaseSegment(segmentIndex);
+            ++releasedSegments;
+        }
+        else {
+            mergeAndIndexFreeBlocks(segmentIndex);
+        }
+    }
+
+    auto endTime = std::chrono::high_resolution_clock::now();
+    TRACE_GC(Compaction, movedBlocks, releasedBytes);
+    collectionLog << "Compaction: " << movedBlocks << " blocks moved out of " << sources.size() << " segments, "
+        << releasedSegments << " segments (" << releasedBytes << " bytes) released, fragmentation "
+        << fragmentationBefore << " -> " << fragmentation() << ", in "
+        << std::chrono::duration<double, std::milli>(endTime - startTime).count() << " ms\n";
+}
+
+void Heap::mergeAndIndexFreeBlocks(size_t segmentIndex) {
+    Block* runHead = nullptr;
+    auto closeRun = [&]() {
+        if (runHead) {
+            freeIndexOf(segmentIndex).Insert(runHead->size, makePosition(segmentIndex, runHead->offset));
+        }
+        runHead = nullptr;
+    };
+
+    for (Block* block = segments[segmentIndex].first; block;) {
+        Block* next = block->next;
+        if (block->allocated) {
+            closeRun();
+        }
+        else if (!runHead) {
+            runHead = block;
+        }
+        else {
+            runHead->size += block->size;
+            removeBlock(segmentIndex, runHead, *block);
+        }
+        block = next;
+    }
+    closeRun();
+}
+
+template <>
+void* Heap::Allocate<BuddySystem>(size_t size, int* blockId) {
+    size_t blockSize = alignSize(size);
+    size_t order = std::max(BuddyFreeLists::OrderOf(blockSize), buddyMinimumOrder);
+    if ((size_t(1) << order) < blockSize) {
+        ++order;
+    }
+    if (order > buddySegmentOrder) {
+        std::cerr << "Buddy: " << size << " bytes do not fit a buddy segment, using First-Fit.\n";
+        return Allocate<FirstFit>(size, blockId);
+    }
+    paceAllocation(size);
+
+    // Buddy segments belong to no arena, so heapMutex alone covers them
+    std::lock_guard<std::mutex> lock(heapMutex);
+
+    size_t freeOrder = buddyLists.FindOrder(order);
+    while (freeOrder > buddySegmentOrder && sweepPendingSegment(noArena)) {
+        freeOrder = buddyLists.FindOrder(order);
+    }
+
+    size_t segmentIndex;
+    Block* block;
+    if (freeOrder > buddySegmentOrder) {
+        if (!createSegment(size_t(1) << buddySegmentOrder, segmentIndex, noArena)) {
+            std::cerr << "Allocation failed: could not reserve a buddy segment.\n";
+            return nullptr;
+        }
+        segments[segmentIndex].buddy = true;
+        ++buddySegments;
+        block = &addBlock(segmentIndex, nullptr, segments[segmentIndex].capacity);
+        block->buddy = true;
+        freeOrder = buddySegmentOrder;
+    }
+    else {
+        FreeBlockIndex::Position position = buddyLists.First(freeOrder);
+        buddyLists.Erase(freeOrder, position);
+        segmentIndex = segmentOf(position);
+        block = blockAt(position);
+    }
+
+    // Halve until the block fits, each upper half is a free buddy one order down
+    while (freeOrder > order) {
+        --freeOrder;
+        block->size = uint32_t(1) << freeOrder;
+        Block& upperHalf = addBlock(segmentIndex, block, block->size);
+        upperHalf.buddy = true;
+        buddyLists.Insert(freeOrder, makePosition(segmentIndex, upperHalf.offset));
+    }
+    void* allocatedMemory = commitBlock(segmentIndex, *block);
+    TRACE_ALLOC(Allocate, size, block->blockId);
+    stats.RecordAllocation(noArena, size, block->size);
+    if (blockId) *blockId = block->blockId;
+    trackAllocatedBlock(*block);
+    return allocatedMemory;
+}
+
+// Buddy blocks come from their own segments, so a batch gains nothing over single allocations
+template <>
+size_t Heap::AllocateBatch<BuddySystem>(const size_t* sizes, size_t count, void** memory, int* blockIds) {
+    size_t allocatedBlocks = 0;
+    for (size_t i = 0; i < count; ++i) {
+        int blockId = -1;
+        memory[i] = Allocate<BuddySystem>(sizes[i], &blockId);
+        if (blockIds) blockIds[i] = blockId;
+        if (memory[i]) ++allocatedBlocks;
+    }
+    return allocatedBlocks;
+}
+
+void Heap::releaseBuddy(size_t segmentIndex, Block& block) {
+    Segment& segment = segments[segmentIndex];
+    Block* merged = &block;
+    while (merged->size < segment.capacity) {
+        Block* buddy = blockAtOffset(segment, merged->offset ^ merged->size);
+        // A smaller block at the buddy's offset means the buddy is split
+        if (!buddy || buddy->allocated || buddy->size != merged->size) break;
+
+        buddyLists.Erase(BuddyFreeLists::OrderOf(buddy->size), makePosition(segmentIndex, buddy->offset));
+        Block* lowerHalf = buddy->offset < merged->offset ? buddy : merged;
+        Block* upperHalf = lowerHalf == buddy ? merged : buddy;
+        lowerHalf->size *= 2;
+        removeBlock(segmentIndex, lowerHalf, *upperHalf);
+        merged = lowerHalf;
+    }
+    buddyLists.Insert(BuddyFreeLists::OrderOf(merged->size), makePosition(segmentIndex, merged->offset));
+    releaseBuddySegmentIfEmpty(segmentIndex);
+}
+
+void Heap::relistBuddySegment(size_t segmentIndex) {
+    Segment& segment = segments[segmentIndex];
+    for (const Block* block = segment.first; block; block = block->next) {
+        if (!block->allocated) {
+            buddyLists.Erase(BuddyFreeLists::OrderOf(block->size), makePosition(segmentIndex, block->offset));
+        }
+    }
+
+    // In address order every lower half is final before its upper half is reached,
+    // so merging each free upper half into its predecessor cascades all the way up
+    for (Block* block = segment.first; block;) {
+        Block* next = block->next;
+        Block* merged = block;
+        while (!merged->allocated && (merged->offset & merged->size) != 0) {
+            Block* lowerHalf = blockBefore(segment, *merged);
+            if (lowerHalf->allocated || lowerHalf->size != merged->size) break;
+            lowerHalf->size *= 2;
+            removeBlock(segmentIndex, lowerHalf, *merged);
+            merged = lowerHalf;
+        }
+        block = next;
+    }
+
+    for (const Block* block = segment.first; block; block = block->next) {
+        if (!block->allocated) {
+            buddyLists.Insert(BuddyFreeLists::OrderOf(block->size), makePosition(segmentIndex, block->offset));
+        }
+    }
+}
+
+void Heap::releaseBuddySegmentIfEmpty(size_t segmentIndex) {
+    const Segment& segment = segments[segmentIndex];
+    if (buddySegments > 1 && segment.blockCount == 1 && !segment.first->allocated) {
+        releaseSegment(segmentIndex);
+    }
+}
+
+void Heap::SetCompactionThreshold(double threshold) {
+    std::lock_guard<std::mutex> lock(heapMutex);
+    compactionThreshold = threshold;
+    std::cout << "Old-generation collections compact at fragmentation " << threshold
+        << (threshold > 1.0 ? " (compaction disabled).\n" : ".\n");
+}
+
+void Heap::PromoteToOldGeneration(Block& block) {
+    stats.RecordPromotions(1);
+    removeFromGeneration(block);
+    addToGeneration(block, true);
+    // Its references to blocks that are still young are now old-to-young
+    rememberIfPointsToYoung(block);
+}
+
+void Heap::rememberIfPointsToYoung(Block& block) {
+    if (!block.allocated || !block.old || block.remembered) return;
+    bool pointsToYoung = false;
+    forEachReference(block, [&](Block* referencedBlock) {
+        pointsToYoung = pointsToYoung || !referencedBlock->old;
+    });
+    if (pointsToYoung) {
+        block.remembered = true;
+        rememberedSet.push_back(&block);
+    }
+}
+
+void Heap::rebuildRememberedSet() {
+    // Drops freed blocks, duplicates and blocks whose young targets were promoted or freed
+    std::vector<Block*> previous;
+    previous.swap(rememberedSet);
+    for (Block* block : previous) {
+        block->remembered = false;
+    }
+    for (Block* block : previous) {
+        rememberIfPointsToYoung(*block);
+    }
+}
+
+void Heap::SetPromotionAge(int age) {
+    std::lock_guard<std::mutex> lock(heapMutex);
+    promotionAge = std::min(std::max(age, 1), maxPromotionAge);
+    std::cout << "Promotion age set to " << promotionAge << ".\n";
+}
+
+std::vector<Heap::Block*>& Heap::generationList(const Block& block) {
+    return block.old ? oldGeneration : youngGeneration;
+}
+
+void Heap::addToGeneration(Block& block, bool old) {
+    block.old = old;
+    std::vector<Block*>& list = generationList(block);
+    block.generationIndex = static_cast<uint32_t>(list.size());
+    list.push_back(&block);
+}
+
+void Heap::removeFromGeneration(Block& block) {
+    // Move the last entry into the vacated slot
+    std::vector<Block*>& list = generationList(block);
+    Block* lastBlock = list.back();
+    list[block.generationIndex] = lastBlock;
+    lastBlock->generationIndex = block.generationIndex;
+    list.pop_back();
+    block.generationIndex = notListed;
+}
+
+void Heap::SetNursery(size_t capacity) {
+    std::lock_guard<std::mutex> collectionLock(collectionMutex);
+    std::lock_guard<std::mutex> lock(heapMutex);
+    auto arenaLocks = LockArenas(true);
+    finishLazySweep();
+
+    // Survivors of the current nursery move to regular segments before it goes away
+    if (nurserySegment != SIZE_MAX) {
+        evacuateNursery();
+        Segment& segment = segments[nurserySegment];
+        segment.nursery = false;
+        if (segment.blockCount == 1 && !segment.first->allocated) {
+            releaseSegment(nurserySegment);
+        }
+        else {
+            // Blocks that could not be copied keep the segment, which becomes a regular one in the first arena
+            for (Block* block = segment.first; block; block = block->next) {
+                block->nursery = false;
+            }
+            sharedSegments.erase(std::find(sharedSegments.begin(), sharedSegments.end(), nurserySegment));
+            segment.arena = 0;
+            arenas[0].segmentIndices.push_back(nurserySegment);
+            RebuildFreeIndex();
+        }
+        nurserySegment = SIZE_MAX;
+        nurseryTail = nullptr;
+        nurseryEnabled = false;
+    }
+    if (capacity == 0) {
+        std::cout << "Nursery disabled.\n";
+        return;
+    }
+
+    size_t segmentIndex;
+    if (!createSegment(alignSize(capacity), segmentIndex, noArena)) {
+        std::cerr << "Failed to reserve " << capacity << " bytes for the nursery.\n";
+        return;
+    }
+    segments[segmentIndex].nursery = true;
+    nurserySegment = segmentIndex;
+    resetNursery();
+    nurseryEnabled = true;
+    std::cout << "Nursery of " << segments[segmentIndex].capacity << " bytes in segment " << segmentIndex
+        << ", typed objects up to " << nurseryObjectLimit << " bytes are bump-allocated.\n";
+}
+
+void* Heap::allocateFromNursery(size_t size, int* blockId, const TypeInfo* type, const void* object) {
+    size_t blockSize = alignSize(size);
+    std::lock_guard<std::mutex> lock(heapMutex);
+    if (nurserySegment == SIZE_MAX) {
+        return nullptr;
+    }
+
+    // Only heapMutex is held: the arenas never touch the nursery, and the
+    // handle table lets them look up other blocks while this one is inserted
+    std::vector<std::unique_lock<std::mutex>> arenaLocks;
+    std::unique_lock<std::mutex> collectionLock;
+    if (!nurseryTail || nurseryTail->size < blockSize) {
+        // Full: empty it with a minor collection, unless another collection is running. An incremental
+        // cycle that is marking is left to its slices rather than finished in this pause.
+        collectionLock = std::unique_lock<std::mutex>(collectionMutex, std::try_to_lock);
+        if (!collectionLock || incrementalPhase == IncrementalPhase::Marking) {
+            return nullptr;
+        }
+        arenaLocks = LockArenas(true);
+        ScopedPause pause(stats, PauseKind::Generational);
+        CollectYoungGeneration();
+        // Nobody prints for an allocation, so this collection leaves only its trace events
+        collectionLog.str(std::string());
+        if (!nurseryTail || nurseryTail->size < blockSize) {
+            return nullptr;
+        }
+    }
+
+    // Bump: the tail's front becomes the block, the rest becomes the new tail
+    Block& block = *nurseryTail;
+    if (block.size > blockSize) {
+        size_t remainderSize = block.size - blockSize;
+        block.size = static_cast<uint32_t>(blockSize);
+        nurseryTail = &addBlock(nurserySegment, &block, remainderSize);
+        nurseryTail->nursery = true;
+    }
+    else {
+        nurseryTail = nullptr;
+    }
+    void* allocatedMemory = commitBlock(nurserySegment, block, type, object);
+    TRACE_ALLOC(Allocate, size, block.blockId);
+    stats.RecordAllocation(noArena, size, block.size);
+    if (blockId) *blockId = block.blockId;
+    trackAllocatedBlock(block);
+    return allocatedMemory;
+}
+
+size_t Heap::evacuateNursery() {
+    // Cheney scan: copies are queued in the order they are made and scanned from the front,
+    // so the queue itself is the breadth-first frontier
+    std::vector<Block*> copies;
+    // Pinned blocks and those no free block was found for stay in the nursery
+    size_t stayingBlocks = 0;
+    size_t uncopiedBlocks = 0;
+    // References are Block IDs, which the copies take along, so nothing needs rewriting; once
+    // copied, an ID resolves to the copy outside the nursery
+    auto forward = [&](Block* reference) {
+        if (!reference->nursery || reference->forwarded) return;
+        Block* copy = reference;
+        if (isPinned(*reference)) {
+            // A thread is using its address, so it is forwarded to itself and scanned in place
+            reference->forwarded = true;
+        }
+        else {
+            copy = evacuate(*reference);
+            if (copy->nursery) ++uncopiedBlocks;
+        }
+        copies.push_back(copy);
+        if (copy->nursery) ++stayingBlocks;
+    };
+
+    // Roots: rooted nursery blocks, and references held by remembered old blocks and regular young blocks
+    for (Block* block = segments[nurserySegment].first; block; block = block->next) {
+        if (block->allocated && block->rootIndex != notListed) {
+            forward(block);
+        }
+    }
+    for (Block* block : rememberedSet) {
+        if (!block->remembered || !block->allocated) continue;
+        forEachReference(*block, forward);
+    }
+    std::vector<Block*> youngBlocks = youngGeneration;
+    for (Block* block : youngBlocks) {
+        if (block->nursery) continue;
+        forEachReference(*block, forward);
+    }
+    for (size_t scan = 0; scan < copies.size(); ++scan) {
+        forEachReference(*copies[scan], forward);
+    }
+
+    if (stayingBlocks == 0) {
+        resetNursery();
+    }
+    else {
+        // Those blocks stay put, and the nursery is only emptied by a collection that finds them gone
+        if (uncopiedBlocks > 0) {
+            std::cerr << "Nursery: " << uncopiedBlocks << " blocks could not be copied out and stay in place.\n";
+        }
+        for (Block* block = segments[nurserySegment].first; block; block = block->next) {
+            block->forwarded = false;
+        }
+    }
+    return copies.size() - stayingBlocks;
+}
+
+Heap::Block* Heap::evacuate(Block& block) {
+    size_t segmentIndex;
+    Block* copy = reserveBlock<FirstFit>(block.size, segmentIndex);
+    if (!copy) {
+        // Forwarded to itself, so it is neither retried nor copied twice
+        block.forwarded = true;
+        return &block;
+    }
+    moveBlock(block, *copy, segmentIndex);
+    return copy;
+}
+
+void Heap::moveBlock(Block& block, Block& destination, size_t destinationSegment) {
+    std::memcpy(commitBlock(destinationSegment, destination), payloadOf(block), block.size);
+    setType(destination, block.type);
+    destination.hasReferences = block.hasReferences;
+    destination.rootHandles = block.rootHandles;
+    setType(block, nullptr);
+    block.hasReferences = false;
+    block.rootHandles = 0;
+
+    // The blocks trade Block IDs, so the moved block keeps its ID and the vacated one gets a fresh one
+    std::swap(block.blockId, destination.blockId);
+    bool destinationIssued = destination.issued;
+    destination.issued = block.issued;
+    block.issued = destinationIssued;
+    if (BlockHandle* handle = blockHandles.Find(destination.blockId)) {
+        handle->block = &destination;
+    }
+    if (BlockHandle* handle = blockHandles.Find(block.blockId)) {
+        handle->block = &block;
+    }
+
+    // Root slot, generation and remembered flag go along; references are Block IDs and stay valid
+    if (block.rootIndex != notListed) {
+        destination.rootIndex = block.rootIndex;
+        rootSet[block.rootIndex] = &destination;
+        block.rootIndex = notListed;
+    }
+    if (block.generationIndex != notListed) {
+        removeFromGeneration(block);
+    }
+    addToGeneration(destination, block.old);
+    destination.generation = block.generation;
+    destination.remembered = block.remembered;
+
+    setAllocated(block, false);
+    block.generation = 0;
+    block.old = false;
+    block.remembered = false;
+    block.forwarded = true;
+    setPayloadLink(block, &destination);
+}
+
+void Heap::resetNursery() {
+    Segment& segment = segments[nurserySegment];
+    while (segment.first) {
+        Block& block = *segment.first;
+        // Still allocated but not copied: unreachable
+        if (block.allocated) {
+            stats.RecordCollected(1, block.size);
+            untrackBlock(block);
+            dropReferences(block);
+            setAllocated(block, false);
+        }
+        removeBlock(nurserySegment, nullptr, block);
+    }
+    nurseryTail = &addBlock(nurserySegment, nullptr, segment.capacity);
+    nurseryTail->nursery = true;
+}
+
+bool Heap::isLargeObject(size_t size) const {
+    size_t threshold = largeObjectThreshold.load(std::memory_order_relaxed);
+    return threshold > 0 && size >= threshold;
+}
+
+void* Heap::allocateLarge(size_t size, int* blockId, const TypeInfo* type, const void* object) {
+    bool hugePages = largeObjectHugePages.load(std::memory_order_relaxed) && size >= hugePageObjectSize;
+    size_t granularity = hugePages ? hugePageSize : largeObjectPageSize;
+    size_t capacity = (size + granularity - 1) / granularity * granularity;
+
+    // Large segments belong to no arena, so heapMutex alone covers them
+    std::lock_guard<std::mutex> lock(heapMutex);
+
+    // Reuse the smallest retained range that fits and wastes less than a quarter of itself, on the thread's node if there is one
+    size_t node = topology.CurrentNode();
+    size_t segmentIndex = SIZE_MAX;
+    for (size_t candidate : largeSegments) {
+        const Segment& segment = segments[candidate];
+        if (segment.first->allocated || segment.capacity < capacity || segment.capacity - capacity >= segment.capacity / 4) continue;
+        bool local = segment.node == node;
+        bool chosenLocal = segmentIndex != SIZE_MAX && segments[segmentIndex].node == node;
+        if (segmentIndex == SIZE_MAX || (local && !chosenLocal) || (local == chosenLocal && segment.capacity < segments[segmentIndex].capacity)) {
+            segmentIndex = candidate;
+        }
+    }
+    if (segmentIndex != SIZE_MAX) {
+        if (!CommitSystemMemory(segments[segmentIndex].base, segments[segmentIndex].capacity)) {
+            std::cerr << "Allocation failed: could not recommit " << segments[segmentIndex].capacity << " bytes for a large object.\n";
+            return nullptr;
+        }
+        retainedLargeBytes -= segments[segmentIndex].capacity;
+    }
+    else {
+        if (!createSegment(capacity, segmentIndex, noArena, true)) {
+            std::cerr << "Allocation failed: could not map " << capacity << " bytes for a large object.\n";
+            return nullptr;
+        }
+        if (hugePages) {
+            AdviseHugePages(segments[segmentIndex].base, capacity);
+        }
+        largeSegments.push_back(segmentIndex);
+        addBlock(segmentIndex, nullptr, capacity);
+    }
+
+    Block& block = *segments[segmentIndex].first;
+    void* allocatedMemory = commitBlock(segmentIndex, block, type, object);
+    TRACE_ALLOC(Allocate, size, block.blockId);
+    stats.RecordAllocation(noArena, size, block.size);
+    if (blockId) *blockId = block.blockId;
+    trackAllocatedBlock(block);
+    return allocatedMemory;
+}
+
+void Heap::releaseLarge(size_t segmentIndex) {
+    Segment& segment = segments[segmentIndex];
+    // A mapped range would decommit back to its file contents rather than to zeroes
+    if (segment.mapped || retainedLargeBytes + segment.capacity > maxRetainedLargeBytes) {
+        largeSegments.erase(std::find(largeSegments.begin(), largeSegments.end(), segmentIndex));
+        releaseSegment(segmentIndex);
+        return;
+    }
+    DecommitSystemMemory(segment.base, segment.capacity);
+    retainedLargeBytes += segment.capacity;
+}
+
+void Heap::SetLargeObjectSpace(size_t threshold, bool hugePages) {
+    largeObjectThreshold.store(threshold, std::memory_order_relaxed);
+    largeObjectHugePages.store(hugePages, std::memory_order_relaxed);
+    std::cout << "Large-object space " << (threshold > 0 ? "enabled" : "disabled");
+    if (threshold > 0) {
+        std::cout << " from " << threshold << " bytes, huge pages " << (hugePages ? "on" : "off");
+    }
+    std::cout << ".\n";
+}
+
+Heap::Region::Region(Heap& heap) : heap(heap), parent(nullptr) {}
+
+Heap::Region::Region(Region& parent) : heap(parent.heap), parent(&parent), current(parent.current), offset(parent.offset) {
+    parent.child = this;
+}
+
+Heap::Region::~Region() {
+    // Everything after the parent's last segment was added by this region
+    size_t mark = parent ? parent->current : SIZE_MAX;
+    size_t added = mark != SIZE_MAX ? heap.segments[mark].nextRegionSegment : first;
+    if (added != SIZE_MAX) {
+        heap.returnRegionSegments(added, current);
+        if (mark != SIZE_MAX) heap.segments[mark].nextRegionSegment = SIZE_MAX;
+    }
+    if (parent) parent->child = nullptr;
+    TRACE_ALLOC(RegionReleased, addedSegments, usedBytes);
+}
+
+void* Heap::Region::Allocate(size_t size) {
+    if (child) {
+        std::cerr << "Region allocation failed: a nested region is still active.\n";
+        return nullptr;
+    }
+
+    size_t blockSize = alignSize(size);
+    if (current == SIZE_MAX || offset + blockSize > heap.segments[current].capacity) {
+        size_t segmentIndex = heap.acquireRegionSegment(blockSize);
+        if (segmentIndex == SIZE_MAX) {
+            std::cerr << "Region allocation failed: could not reserve a segment for " << blockSize << " bytes.\n";
+            return nullptr;
+        }
+        if (current != SIZE_MAX) heap.segments[current].nextRegionSegment = segmentIndex;
+        else first = segmentIndex;
+        current = segmentIndex;
+        offset = 0;
+        ++addedSegments;
+    }
+
+    void* memory = heap.segments[current].base + offset;
+    offset += blockSize;
+    usedBytes += blockSize;
+    return memory;
+}
+
+size_t Heap::acquireRegionSegment(size_t size) {
+    {
+        // Only the head is tried, so taking a segment stays O(1); a larger request reserves a new one
+        std::lock_guard<std::mutex> lock(regionMutex);
+        if (regionPool != SIZE_MAX && segments[regionPool].capacity >= size) {
+            size_t segmentIndex = regionPool;
+            regionPool = segments[segmentIndex].nextRegionSegment;
+            segments[segmentIndex].nextRegionSegment = SIZE_MAX;
+            return segmentIndex;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(heapMutex);
+    size_t segmentIndex;
+    if (!createSegment(std::max(regionSegmentCapacity, size), segmentIndex, noArena)) {
+        return SIZE_MAX;
+    }
+    segments[segmentIndex].region = true;
+    return segmentIndex;
+}
+
+void Heap::returnRegionSegments(size_t first, size_t last) {
+    std::lock_guard<std::mutex> lock(regionMutex);
+    segments[last].nextRegionSegment = regionPool;
+    regionPool = first;
+}
+
+void Heap::TrimRegionSegments() {
+    std::lock_guard<std::mutex> lock(heapMutex);
+    std::lock_guard<std::mutex> regionLock(regionMutex);
+    while (regionPool != SIZE_MAX) {
+        size_t segmentIndex = regionPool;
+        regionPool = segments[segmentIndex].nextRegionSegment;
+        releaseSegment(segmentIndex);
+    }
+}
+
+bool Heap::SaveSnapshot(const std::string& path) {
+    std::lock_guard<std::mutex> collectionLock(collectionMutex);
+    std::lock_guard<std::mutex> lock(heapMutex);
+    auto arenaLocks = LockArenas(true);
+    // Marks of a pending sweep or a running incremental cycle mean nothing to the process that loads the snapshot
+    finishLazySweep();
+    auto startTime = std::chrono::high_resolution_clock::now();
+
+    // Written under another name and renamed, so a heap mapped from `path` never sees its file change
+    std::string temporaryPath = path + ".tmp";
+    std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        std::cerr << "Snapshot failed: cannot create " << temporaryPath << ".\n";
+        return false;
+    }
+    SnapshotHeader header = {};
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    // Payloads and segment records first, which also collects the type table
+    std::vector<const TypeInfo*> types;
+    std::unordered_map<const TypeInfo*, uint32_t> typeIndexes;
+    SnapshotWriter segmentRecords;
+    uint64_t dataOffset = snapshotAlignment;
+    size_t savedSegments = 0;
+    size_t savedBlocks = 0;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        const Segment& segment = segments[i];
+        // Regions end with their process, and a freed large object is only a retained range
+        bool saved = segment.base && !segment.region && !(segment.large && !segment.first->allocated);
+        segmentRecords.Put<uint8_t>(saved ? 1 : 0);
+        if (!saved) continue;
+
+        // The gaps between payloads are left as holes
+        file.seekp(static_cast<std::streamoff>(dataOffset));
+        file.write(segment.base, static_cast<std::streamsize>(segment.capacity));
+        segmentRecords.Put<uint64_t>(segment.capacity);
+        segmentRecords.Put<uint64_t>(segment.arena);
+        segmentRecords.Put<uint8_t>(segment.nursery ? 1 : segment.buddy ? 2 : segment.large ? 3 : 0);
+        segmentRecords.Put<uint64_t>(dataOffset);
+        segmentRecords.Put<uint64_t>(SnapshotChecksum(segment.base, segment.capacity));
+        segmentRecords.Put<uint64_t>(segment.blockCount);
+        for (const Block* block = segment.first; block; block = block->next) {
+            SnapshotBlock record = {};
+            record.offset = block->offset;
+            record.size = block->size;
+            record.blockId = block->blockId;
+            record.rootHandles = block->rootHandles;
+            if (block->type) {
+                auto entry = typeIndexes.emplace(block->type, static_cast<uint32_t>(types.size()));
+                if (entry.second) types.push_back(block->type);
+                record.typeIndex = entry.first->second + 1;
+            }
+            record.generation = block->generation;
+            record.flags = (block->allocated ? SnapshotBlock::Allocated : 0) | (block->old ? SnapshotBlock::Old : 0)
+                | (block->remembered ? SnapshotBlock::Remembered : 0) | (block->nursery ? SnapshotBlock::Nursery : 0)
+                | (block->buddy ? SnapshotBlock::Buddy : 0) | (block->hasReferences ? SnapshotBlock::HasReferences : 0);
+            segmentRecords.Put(record);
+        }
+        dataOffset = (dataOffset + segment.capacity + snapshotAlignment - 1) / snapshotAlignment * snapshotAlignment;
+        ++savedSegments;
+        savedBlocks += segment.blockCount;
+    }
+
+    SnapshotWriter metadata;
+    metadata.Put<uint64_t>(segments.size());
+    metadata.Put<uint64_t>(retainedSegments);
+    metadata.Put<uint64_t>(types.size());
+    for (const TypeInfo* type : types) {
+        metadata.PutString(type->name);
+        metadata.Put<uint64_t>(type->size);
+        metadata.Put<uint64_t>(type->referenceCount);
+        for (size_t i = 0; i < type->referenceCount; ++i) {
+            metadata.Put<uint64_t>(type->referenceOffsets[i]);
+        }
+    }
+    metadata.PutBytes(segmentRecords.Bytes().data(), segmentRecords.Bytes().size());
+
+    // The lists by Block ID, in their current order
+    auto putList = [&metadata](const std::vector<Block*>& list) {
+        metadata.Put<uint64_t>(list.size());
+        for (const Block* block : list) {
+            metadata.Put<int32_t>(block->blockId);
+        }
+    };
+    {
+        std::lock_guard<std::mutex> rootsLock(rootsMutex);
+        std::vector<Block*> roots;
+        for (void* root : rootSet) {
+            if (root) roots.push_back(static_cast<Block*>(root));
+        }
+        putList(roots);
+        putList(youngGeneration);
+        putList(oldGeneration);
+    }
+    putList(rememberedSet);
+    {
+        std::lock_guard<std::mutex> referencesLock(referencesMutex);
+        metadata.Put<uint64_t>(untypedReferences.size());
+        for (const auto& entry : untypedReferences) {
+            metadata.Put<int32_t>(entry.first);
+            metadata.Put<uint64_t>(entry.second.size());
+            for (int targetId : entry.second) {
+                metadata.Put<int32_t>(targetId);
+            }
+        }
+    }
+
+    header.magic = snapshotMagic;
+    header.version = snapshotVersion;
+    header.headerBytes = sizeof(header);
+    header.metadataOffset = dataOffset;
+    header.metadataBytes = metadata.Bytes().size();
+    header.fileBytes = header.metadataOffset + header.metadataBytes;
+    header.checksum = SnapshotChecksum(metadata.Bytes().data(), metadata.Bytes().size(), SnapshotChecksum(&header, sizeof(header)));
+    file.seekp(static_cast<std::streamoff>(header.metadataOffset));
+    file.write(metadata.Bytes().data(), static_cast<std::streamsize>(metadata.Bytes().size()));
+    file.seekp(0);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.close();
+    if (!file) {
+        std::cerr << "Snapshot failed: could not write " << temporaryPath << ".\n";
+        std::remove(temporaryPath.c_str());
+        return false;
+    }
+    if (std::rename(temporaryPath.c_str(), path.c_str()) != 0) {
+        // Windows does not rename over an existing file
+        std::remove(path.c_str());
+        if (std::rename(temporaryPath.c_str(), path.c_str()) != 0) {
+            std::cerr << "Snapshot failed: could not replace " << path << ".\n";
+            std::remove(temporaryPath.c_str());
+            return false;
+        }
+    }
+
+    auto endTime = std::chrono::high_resolution_clock::now();
+    std::cout << "Snapshot of " << savedSegments << " segments and " << savedBlocks << " blocks saved to " << path
+        << " (" << header.fileBytes << " bytes) in " << std::chrono::duration<double, std::milli>(endTime - startTime).count() << " ms.\n";
+    return true;
+}
+
+bool Heap::LoadSnapshot(const std::string& path, bool verifyData) {
+    auto startTime = std::chrono::high_resolution_clock::now();
+    std::ifstream file(path, std::ios::binary);
+    SnapshotHeader header = {};
+    if (file) {
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    }
+    if (!file || header.magic != snapshotMagic) {
+        std::cerr << "Snapshot load failed: " << path << " is not a heap snapshot.\n";
+        return false;
+    }
+    if (header.version != snapshotVersion) {
+        std::cerr << "Snapshot load failed: " << path << " has format version " << header.version
+            << ", this heap reads version " << snapshotVersion << ".\n";
+        return false;
+    }
+    file.seekg(0, std::ios::end);
+    uint64_t fileBytes = static_cast<uint64_t>(file.tellg());
+    if (header.headerBytes != sizeof(header) || header.fileBytes != fileBytes || header.metadataOffset > fileBytes
+        || header.metadataBytes != fileBytes - header.metadataOffset) {
+        std::cerr << "Snapshot load failed: " << path << " is truncated.\n";
+        return false;
+    }
+    std::string metadata(static_cast<size_t>(header.metadataBytes), '\0');
+    file.seekg(static_cast<std::streamoff>(header.metadataOffset));
+    if (!metadata.empty()) {
+        file.read(&metadata[0], static_cast<std::streamsize>(metadata.size()));
+    }
+    uint64_t expectedChecksum = header.checksum;
+    header.checksum = 0;
+    if (!file || SnapshotChecksum(metadata.data(), metadata.size(), SnapshotChecksum(&header, sizeof(header))) != expectedChecksum) {
+        std::cerr << "Snapshot load failed: " << path << " fails its checksum.\n";
+        return false;
+    }
+
+    // The metadata is read and checked in full before the heap is touched
+    struct SavedSegment {
+        uint64_t capacity = 0;
+        uint64_t arena = noArena;
+        uint8_t kind = 0;
+        uint64_t dataOffset = 0;
+        uint64_t checksum = 0;
+        std::vector<SnapshotBlock> blocks;
+    };
+    struct SavedId {
+        int blockId;
+        size_t segment;
+        size_t block;
+    };
+    SnapshotReader reader(metadata.data(), metadata.size());
+    uint64_t slotCount = reader.Get<uint64_t>();
+    uint64_t savedRetainedSegments = reader.Get<uint64_t>();
+    bool valid = slotCount <= maxSegments;
+
+    std::vector<std::unique_ptr<RestoredType>> types;
+    uint64_t typeCount = reader.GetCount(3 * sizeof(uint64_t));
+    for (uint64_t t = 0; t < typeCount && valid && !reader.Failed(); ++t) {
+        std::unique_ptr<RestoredType> type(new RestoredType());
+        type->name = reader.GetString();
+        size_t size = static_cast<size_t>(reader.Get<uint64_t>());
+        uint64_t referenceCount = reader.GetCount(sizeof(uint64_t));
+        for (uint64_t r = 0; r < referenceCount; ++r) {
+            uint64_t offset = reader.Get<uint64_t>();
+            valid = valid && offset < size && size - offset >= sizeof(int);
+            type->referenceOffsets.push_back(static_cast<size_t>(offset));
+        }
+        type->info = { type->name.c_str(), size, type->referenceOffsets.data(), type->referenceOffsets.size() };
+        types.push_back(std::move(type));
+    }
+
+    std::vector<SavedSegment> saved(valid ? static_cast<size_t>(slotCount) : 0);
+    std::vector<SavedId> ids;
+    size_t nurseryCount = 0;
+    size_t allocatedCount = 0;
+    for (size_t i = 0; i < saved.size() && valid && !reader.Failed(); ++i) {
+        SavedSegment& segment = saved[i];
+        if (reader.Get<uint8_t>() == 0) continue;
+        segment.capacity = reader.Get<uint64_t>();
+        segment.arena = reader.Get<uint64_t>();
+        segment.kind = reader.Get<uint8_t>();
+        segment.dataOffset = reader.Get<uint64_t>();
+        segment.checksum = reader.Get<uint64_t>();
+        uint64_t blockCount = reader.GetCount(sizeof(SnapshotBlock));
+        segment.blocks.resize(static_cast<size_t>(blockCount));
+        if (blockCount > 0) {
+            reader.GetBytes(segment.blocks.data(), segment.blocks.size() * sizeof(SnapshotBlock));
+        }
+
+        // Arena segments are regular ones, the nursery, buddy and large ones belong to no arena
+        valid = segment.capacity > 0 && segment.capacity <= maxSegmentCapacity && segment.capacity % blockAlignment == 0
+            && segment.kind <= 3 && (segment.kind != 0) == (segment.arena == noArena)
+            && segment.dataOffset % snapshotAlignment == 0 && segment.dataOffset >= snapshotAlignment
+            && segment.dataOffset <= header.metadataOffset && segment.capacity <= header.metadataOffset - segment.dataOffset
+            && !segment.blocks.empty() && (segment.kind != 3 || segment.blocks.size() == 1);
+        nurseryCount += segment.kind == 1 ? 1 : 0;
+        uint64_t expectedOffset = 0;
+        for (size_t b = 0; b < segment.blocks.size() && valid; ++b) {
+            const SnapshotBlock& block = segment.blocks[b];
+            bool allocated = (block.flags & SnapshotBlock::Allocated) != 0;
+            valid = block.offset == expectedOffset && block.size > 0 && block.size % blockAlignment == 0
+                && block.typeIndex <= types.size()
+                && (block.typeIndex == 0 || (allocated && types[block.typeIndex - 1]->info.size <= block.size));
+            expectedOffset += block.size;
+            allocatedCount += allocated ? 1 : 0;
+            if (block.blockId >= 0) {
+                ids.push_back({ block.blockId, i, b });
+            }
+        }
+        valid = valid && expectedOffset == segment.capacity;
+    }
+    valid = valid && nurseryCount <= 1;
+
+    // Handles are restored in slot order, and no two blocks may share a slot
+    const uint32_t indexMask = (1u << HandleTable<BlockHandle>::indexBits) - 1;
+    auto slotOf = [indexMask](int blockId) { return static_cast<uint32_t>(blockId) & indexMask; };
+    std::sort(ids.begin(), ids.end(), [&slotOf](const SavedId& a, const SavedId& b) { return slotOf(a.blockId) < slotOf(b.blockId); });
+    for (size_t i = 1; i < ids.size() && valid; ++i) {
+        valid = slotOf(ids[i - 1].blockId) != slotOf(ids[i].blockId);
+    }
+    // Position of an allocated block's ID in `ids`, or ids.size()
+    auto findAllocated = [&](int blockId) {
+        auto it = std::lower_bound(ids.begin(), ids.end(), blockId,
+            [&slotOf](const SavedId& id, int value) { return slotOf(id.blockId) < slotOf(value); });
+        if (blockId < 0 || it == ids.end() || it->blockId != blockId
+            || !(saved[it->segment].blocks[it->block].flags & SnapshotBlock::Allocated)) {
+            return ids.size();
+        }
+        return static_cast<size_t>(it - ids.begin());
+    };
+
+    // A block is at most once in the root set, in one generation and in the remembered set
+    std::vector<uint8_t> listed(ids.size(), 0);
+    auto readList = [&](uint8_t listBit, int generation) {
+        std::vector<size_t> positions;
+        uint64_t count = reader.GetCount(sizeof(int32_t));
+        for (uint64_t n = 0; n < count && valid; ++n) {
+            size_t position = findAllocated(reader.Get<int32_t>());
+            valid = position < ids.size() && !(listed[position] & listBit)
+                && (generation < 0 || ((saved[ids[position].segment].blocks[ids[position].block].flags & SnapshotBlock::Old) != 0) == (generation == 1));
+            if (valid) {
+                listed[position] |= listBit;
+                positions.push_back(position);
+            }
+        }
+        return positions;
+    };
+    std::vector<size_t> roots = readList(1, -1);
+    std::vector<size_t> young = readList(2, 0);
+    std::vector<size_t> old = readList(2, 1);
+    std::vector<size_t> remembered = readList(4, -1);
+    valid = valid && young.size() + old.size() == allocatedCount;
+
+    std::vector<std::pair<size_t, std::vector<int>>> references;
+    uint64_t referenceCount = reader.GetCount(sizeof(int32_t) + sizeof(uint64_t));
+    for (uint64_t n = 0; n < referenceCount && valid; ++n) {
+        size_t position = findAllocated(reader.Get<int32_t>());
+        valid = position < ids.size() && saved[ids[position].segment].blocks[ids[position].block].typeIndex == 0;
+        std::vector<int> targetIds(static_cast<size_t>(reader.GetCount(sizeof(int32_t))));
+        for (int& targetId : targetIds) {
+            targetId = reader.Get<int32_t>();
+        }
+        references.emplace_back(position, std::move(targetIds));
+    }
+    if (!valid || reader.Failed() || !reader.AtEnd()) {
+        std::cerr << "Snapshot load failed: " << path << " is damaged.\n";
+        return false;
+    }
+
+    // Payloads are mapped before the world stops, so the pause only covers the metadata
+    std::vector<char*> bases(saved.size(), nullptr);
+    std::vector<bool> mapped(saved.size(), false);
+    MappableFile mappable = OpenMappableFile(path.c_str());
+    bool loaded = true;
+    for (size_t i = 0; i < saved.size() && loaded; ++i) {
+        const SavedSegment& segment = saved[i];
+        if (segment.blocks.empty()) continue;
+        bases[i] = static_cast<char*>(MapFileCopyOnWrite(mappable, segment.dataOffset, static_cast<size_t>(segment.capacity)));
+        mapped[i] = bases[i] != nullptr;
+        // Where the file cannot be mapped, the payload is read instead
+        if (!bases[i]) {
+            bases[i] = static_cast<char*>(ReserveSystemMemory(static_cast<size_t>(segment.capacity)));
+            file.clear();
+            file.seekg(static_cast<std::streamoff>(segment.dataOffset));
+            if (bases[i]) {
+                file.read(bases[i], static_cast<std::streamsize>(segment.capacity));
+            }
+            if (!bases[i] || !file) {
+                std::cerr << "Snapshot load failed: could not map or read segment " << i << " of " << path << ".\n";
+                loaded = false;
+            }
+        }
+        if (loaded && verifyData && SnapshotChecksum(bases[i], static_cast<size_t>(segment.capacity)) != segment.checksum) {
+            std::cerr << "Snapshot load failed: segment " << i << " of " << path << " fails its checksum.\n";
+            loaded = false;
+        }
+    }
+    CloseMappableFile(mappable);
+    if (!loaded) {
+        for (size_t i = 0; i < saved.size(); ++i) {
+            if (!bases[i]) continue;
+            if (mapped[i]) UnmapFileMemory(bases[i], static_cast<size_t>(saved[i].capacity));
+            else ReleaseSystemMemory(bases[i], static_cast<size_t>(saved[i].capacity));
+        }
+        return false;
+    }
+
+    std::lock_guard<std::mutex> collectionLock(collectionMutex);
+    std::lock_guard<std::mutex> lock(heapMutex);
+    auto arenaLocks = LockArenas(true);
+    finishLazySweep();
+    releaseContents();
+    restoredTypes = std::move(types);
+
+    // Segments keep their slots, and arenas are dealt out again when this heap has fewer
+    {
+        std::lock_guard<std::mutex> segmentTableLock(segmentTableMutex);
+        segments.resize(saved.size());
+    }
+    std::vector<std::vector<Block*>> created(saved.size());
+    size_t restoredSegments = 0;
+    size_t mappedSegments = 0;
+    size_t blockCount = 0;
+    for (size_t i = 0; i < saved.size(); ++i) {
+        const SavedSegment& record = saved[i];
+        if (record.blocks.empty()) continue;
+
+        size_t arenaIndex = record.arena == noArena ? noArena : static_cast<size_t>(record.arena % arenaCount);
+        size_t node = arenaIndex != noArena ? arenas[arenaIndex].node : topology.CurrentNode();
+        size_t bitmapWords = record.kind == 3 ? 1 : static_cast<size_t>((record.capacity / blockAlignment + 63) / 64);
+        size_t directoryEntries = record.kind == 3 ? 1 : static_cast<size_t>((record.capacity + blockDirectoryStride - 1) / blockDirectoryStride);
+        {
+            std::lock_guard<std::mutex> segmentTableLock(segmentTableMutex);
+            Segment& segment = segments[i];
+            segment.base = bases[i];
+            segment.capacity = static_cast<size_t>(record.capacity);
+            segment.arena = arenaIndex;
+            segment.node = node;
+            segment.nursery = record.kind == 1;
+            segment.buddy = record.kind == 2;
+            segment.large = record.kind == 3;
+            segment.mapped = mapped[i];
+            segment.allocatedBits.reset(new std::atomic<uint64_t>[bitmapWords]());
+            segment.markBits.reset(new std::atomic<uint64_t>[bitmapWords]());
+            segment.bitmapWords = bitmapWords;
+            segment.blockDirectory.reset(new Block*[directoryEntries]());
+            segment.directoryEntries = directoryEntries;
+        }
+        segmentsOf(arenaIndex).push_back(i);
+        stats.RecordSegmentReserved(node, segments[i].capacity, 2 * bitmapWords * sizeof(uint64_t), directoryEntries * sizeof(Block*));
+        if (record.kind == 1) nurserySegment = i;
+        if (record.kind == 2) ++buddySegments;
+        if (record.kind == 3) largeSegments.push_back(i);
+        ++restoredSegments;
+        mappedSegments += mapped[i] ? 1 : 0;
+
+        std::lock_guard<std::mutex> blockTableLock(blockTableMutex);
+        Block* previous = nullptr;
+        for (const SnapshotBlock& savedBlock : record.blocks) {
+            Block& block = createBlock(i, previous, savedBlock.size);
+            block.rootHandles = savedBlock.rootHandles;
+            setType(block, savedBlock.typeIndex > 0 ? &restoredTypes[savedBlock.typeIndex - 1]->info : nullptr);
+            block.generation = savedBlock.generation;
+            block.old = (savedBlock.flags & SnapshotBlock::Old) != 0;
+            block.remembered = false;
+            block.nursery = (savedBlock.flags & SnapshotBlock::Nursery) != 0;
+            block.buddy = (savedBlock.flags & SnapshotBlock::Buddy) != 0;
+            block.hasReferences = false;
+            // The saved heap may have handed out any of its IDs
+            block.issued = true;
+            if (savedBlock.flags & SnapshotBlock::Allocated) {
+                setAllocated(block, true);
+            }
+            created[i].push_back(&block);
+            previous = &block;
+        }
+        blockCount += record.blocks.size();
+    }
+
+    auto blockAtPosition = [&](size_t position) { return created[ids[position].segment][ids[position].block]; };
+    {
+        std::lock_guard<std::mutex> blockTableLock(blockTableMutex);
+        for (size_t position = 0; position < ids.size(); ++position) {
+            Block* block = blockAtPosition(position);
+            BlockHandle handle;
+            handle.block = block;
+            blockHandles.Restore(ids[position].blockId, handle);
+            block->blockId = ids[position].blockId;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> rootsLock(rootsMutex);
+        for (size_t position : roots) {
+            AddToRootSet(*blockAtPosition(position));
+        }
+        for (size_t position : young) {
+            addToGeneration(*blockAtPosition(position), false);
+        }
+        for (size_t position : old) {
+            addToGeneration(*blockAtPosition(position), true);
+        }
+        for (size_t position = 0; position < ids.size(); ++position) {
+            Block* block = blockAtPosition(position);
+            if (block->allocated && block->type && block->rootHandles > 0) {
+                restoredRootHandles[block->blockId] = block->rootHandles;
+            }
+        }
+    }
+    for (size_t position : remembered) {
+        blockAtPosition(position)->remembered = true;
+        rememberedSet.push_back(blockAtPosition(position));
+    }
+    {
+        std::lock_guard<std::mutex> referencesLock(referencesMutex);
+        for (auto& entry : references) {
+            Block* block = blockAtPosition(entry.first);
+            block->hasReferences = true;
+            untypedReferences[block->blockId] = std::move(entry.second);
+        }
+    }
+
+    RebuildFreeIndex();
+    for (size_t segmentIndex : sharedSegments) {
+        if (segments[segmentIndex].buddy) {
+            relistBuddySegment(segmentIndex);
+        }
+    }
+    if (nurserySegment != SIZE_MAX) {
+        Block* last = segments[nurserySegment].first;
+        while (last->next) last = last->next;
+        nurseryTail = last->allocated ? nullptr : last;
+        nurseryEnabled = true;
+    }
+    retainedSegments = std::min<size_t>(static_cast<size_t>(savedRetainedSegments), segments.size());
+
+    auto endTime = std::chrono::high_resolution_clock::now();
+    std::cout << "Snapshot " << path << " loaded: " << blockCount << " blocks in " << restoredSegments << " segments, "
+        << mappedSegments << " of them mapped, in "
+        << std::chrono::duration<double, std::milli>(endTime - startTime).count() << " ms.\n";
+    return true;
+}
+
+void Heap::releaseContents() {
+    for (size_t i = 0; i < segments.size(); ++i) {
+        Segment& segment = segments[i];
+        if (!segment.base) continue;
+        while (segment.first) {
+            removeBlock(i, nullptr, *segment.first);
+        }
+        stats.RecordSegmentReleased(segment.node, segment.capacity, 2 * segment.bitmapWords * sizeof(uint64_t),
+            segment.directoryEntries * sizeof(Block*));
+        releaseSegmentMemory(segment);
+    }
+    {
+        std::lock_guard<std::mutex> segmentTableLock(segmentTableMutex);
+        segments.clear();
+    }
+    for (size_t i = 0; i < arenaCount; ++i) {
+        arenas[i].freeIndex.Clear();
+        arenas[i].nextFitRover = 0;
+        arenas[i].segmentIndices.clear();
+    }
+    sharedSegments.clear();
+    buddyLists.Clear();
+    buddySegments = 0;
+    largeSegments.clear();
+    retainedLargeBytes = 0;
+    nurserySegment = SIZE_MAX;
+    nurseryTail = nullptr;
+    nurseryEnabled = false;
+    {
+        std::lock_guard<std::mutex> regionLock(regionMutex);
+        regionPool = SIZE_MAX;
+    }
+    {
+        std::lock_guard<std::mutex> rootsLock(rootsMutex);
+        rootSet.clear();
+        youngGeneration.clear();
+        oldGeneration.clear();
+        restoredRootHandles.clear();
+    }
+    rememberedSet.clear();
+    pinnedObjects.clear();
+    {
+        std::lock_guard<std::mutex> referencesLock(referencesMutex);
+        untypedReferences.clear();
+    }
+    {
+        std::lock_guard<std::mutex> blockTableLock(blockTableMutex);
+        blockHandles.Clear();
+    }
+    restoredTypes.clear();
+}
+
+template <typename FitPolicy>
+Heap::Block* Heap::reserveBlock(size_t size, size_t& segmentIndex, bool mayGrow) {
+    // Every arena is locked, so the block may come from any of them
+    Block* block = nullptr;
+    for (size_t i = 0; i < arenaCount && !block; ++i) {
+        Arena& arena = arenas[i];
+        FreeBlockIndex::Position position = FitPolicy::Find(arena.freeIndex, size, arena.nextFitRover);
+        if (position != FreeBlockIndex::npos) {
+            segmentIndex = segmentOf(position);
+            block = blockAt(position);
+            arena.freeIndex.Erase(block->size, position);
+        }
+    }
+    if (!block) {
+        if (!mayGrow || !createSegment(std::max(defaultSegmentCapacity, size), segmentIndex, 0)) {
+            return nullptr;
+        }
+        block = &addBlock(segmentIndex, nullptr, segments[segmentIndex].capacity);
+    }
+    splitBlock(segmentIndex, *block, size);
+    return block;
+}
+
+void Heap::RunConcurrentMarkAndSweep() {
+    std::lock_guard<std::mutex> lifecycleLock(collectorLifecycleMutex);
+    if (gcRunning.exchange(true)) {
+        std::cerr << "Concurrent garbage collection already running!\n";
+        return;
+    }
+
+    // The previous cycle has finished (it cleared gcRunning), so this join does not block for long
+    if (concurrentCollector.joinable()) {
+        concurrentCollector.join();
+    }
+    concurrentCollector = std::thread(&Heap::ConcurrentMarkAndSweep, this);
+}
+
+void Heap::WaitForConcurrentGC() {
+    std::lock_guard<std::mutex> lifecycleLock(collectorLifecycleMutex);
+    if (concurrentCollector.joinable()) {
+        concurrentCollector.join();
+    }
+}
+
+void Heap::ConcurrentMarkAndSweep() {
+    // The collector thread reports before it takes a lock and after it has released them all
+    std::cout << "Starting concurrent mark-and-sweep...\n";
+    // Other collections wait for this cycle instead of marking over it
+    std::unique_lock<std::mutex> collectionLock(collectionMutex);
+    auto cycleStart = std::chrono::high_resolution_clock::now();
+    std::vector<double> pauses;
+
+    // Runs one step with the mutators held off and records how long they were held
+    auto slice = [this, &pauses](const std::function<bool()>& step) {
+        std::lock_guard<std::mutex> lock(heapMutex);
+        auto arenaLocks = LockArenas(false);
+        auto sliceStart = std::chrono::high_resolution_clock::now();
+        bool more = step();
+        auto sliceEnd = std::chrono::high_resolution_clock::now();
+        pauses.push_back(std::chrono::duration<double, std::milli>(sliceEnd - sliceStart).count());
+        TRACE_GC(ConcurrentPause, pauses.size(), pauses.back() * 1000.0);
+        stats.RecordPause(PauseKind::ConcurrentSlice, static_cast<uint64_t>(pauses.back() * 1000.0));
+        return more && !gcStopRequested;
+    };
+
+    // An incremental cycle owns the gray set until it is done. Segments left by a lazy collection still carry its marks.
+    slice([this]() {
+        finishIncrementalCycle();
+        return true;
+        });
+    while (slice([this]() { return sweepPendingSegment(); })) {
+    }
+
+    // Initial mark: roots turn gray, and from now on new blocks are allocated black
+    size_t markedBlocks = 0;
+    slice([this, &markedBlocks]() {
+        concurrentMarking = true;
+        for (void* root : rootSet) {
+            Block* block = reinterpret_cast<Block*>(root);
+            if (block && tryMark(*block)) {
+                grayBlocks.push_back(block);
+                ++markedBlocks;
+            }
+        }
+        return true;
+        });
+
+    // Concurrent mark: blacken a bounded number of gray blocks per slice. The slice that finds
+    // no gray block left is the final remark, and hands the heap over to sweeping.
+    while (slice([this, &markedBlocks]() {
+        for (size_t i = 0; i < concurrentSliceBlocks && !grayBlocks.empty(); ++i) {
+            Block* block = grayBlocks.back();
+            grayBlocks.pop_back();
+            forEachReference(*block, [&](Block* referencedBlock) {
+                if (tryMark(*referencedBlock)) {
+                    grayBlocks.push_back(referencedBlock);
+                    ++markedBlocks;
+                }
+            });
+        }
+        if (gcStopRequested) {
+            // The heap is being destroyed, the marks are incomplete and must not be swept
+            grayBlocks.clear();
+            concurrentMarking = false;
+            return false;
+        }
+        if (!grayBlocks.empty()) {
+            return true;
+        }
+
+        concurrentMarking = false;
+        queueLazySweep();
+        return false;
+        })) {
+    }
+
+    // Concurrent sweep, one segment per slice, unless Allocate is left to do it
+    if (!lazySweep && !gcStopRequested) {
+        while (slice([this]() { return sweepPendingSegment(); })) {
+        }
+    }
+
+    auto cycleEnd = std::chrono::high_resolution_clock::now();
+    std::sort(pauses.begin(), pauses.end());
+    double maxPause = pauses.empty() ? 0 : pauses.back();
+    double p99Pause = pauses.empty() ? 0 : pauses[pauses.size() * 99 / 100];
+    {
+        std::lock_guard<std::mutex> lock(heapMutex);
+        lastMarkStats.threads = 1;
+        lastMarkStats.markedBlocks = markedBlocks;
+        lastMarkStats.stolenTasks = 0;
+        lastMarkStats.milliseconds = std::chrono::duration<double, std::milli>(cycleEnd - cycleStart).count();
+    }
+    collectionLock.unlock();
+
+    std::cout << "Concurrent mark-and-sweep complete: " << markedBlocks << " blocks marked, "
+        << pauses.size() << " pauses, p99 " << p99Pause << " ms, max " << maxPause << " ms, cycle "
+        << std::chrono::duration<double, std::milli>(cycleEnd - cycleStart).count() << " ms\n";
+    gcRunning = false;
+}
+
+void Heap::shade(Block* block) {
+    if (concurrentMarking && block && tryMark(*block)) {
+        std::lock_guard<std::mutex> lock(grayMutex);
+        grayBlocks.push_back(block);
+    }
+}
+
+void Heap::SetIncrementalGC(bool enabled) {
+    std::lock_guard<std::mutex> collectionLock(collectionMutex);
+    std::lock_guard<std::mutex> lock(heapMutex);
+    auto arenaLocks = LockArenas(false);
+    if (enabled) {
+        setIncrementalTrigger();
+    }
+    else {
+        finishIncrementalCycle();
+        incrementalPhase = IncrementalPhase::Idle;
+        incrementalCycleActive = false;
+    }
+    incrementalEnabled = enabled;
+    std::cout << "Incremental garbage collection " << (enabled ? "enabled" : "disabled") << ".\n";
+}
+
+void Heap::SetIncrementalBudget(uint64_t microseconds, size_t workUnits) {
+    incrementalSliceMicroseconds = microseconds;
+    incrementalSliceWork = workUnits;
+    std::cout << "Incremental slices take at most " << (microseconds > 0 ? std::to_string(microseconds) + " us" : "unlimited time")
+        << " and " << (workUnits > 0 ? std::to_string(workUnits) : "unlimited") << " work units.\n";
+}
+
+void Heap::paceAllocation(size_t size) {
+    if (!incrementalEnabled.load(std::memory_order_relaxed)) return;
+    ThreadCache& cache = *localThreadCache();
+    cache.unpacedBytes += size;
+    if (cache.unpacedBytes >= pacingQuantum) {
+        size_t bytes = cache.unpacedBytes;
+        cache.unpacedBytes = 0;
+        incrementalStep(bytes);
+    }
+}
+
+void Heap::incrementalStep(size_t bytes) {
+    size_t allocated = allocatedSinceCycle.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    if (incrementalCycleActive.load(std::memory_order_relaxed)) {
+        incrementalDebt.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    else if (allocated < incrementalTrigger.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    // Another thread's slice or another collection is at work; the debt waits for the next slice
+    std::unique_lock<std::mutex> collectionLock(collectionMutex, std::try_to_lock);
+    if (!collectionLock) return;
+    std::lock_guard<std::mutex> lock(heapMutex);
+    auto arenaLocks = LockArenas(false);
+    if (incrementalPhase == IncrementalPhase::Idle) {
+        if (!incrementalEnabled || allocatedSinceCycle.load(std::memory_order_relaxed) < incrementalTrigger.load(std::memory_order_relaxed)) {
+            return;
+        }
+        startIncrementalCycle();
+    }
+
+    ScopedPause pause(stats, PauseKind::IncrementalSlice);
+    auto sliceStart = std::chrono::steady_clock::now();
+    uint64_t budget = incrementalSliceMicroseconds.load(std::memory_order_relaxed);
+    auto deadline = budget > 0 ? sliceStart + std::chrono::microseconds(budget) : std::chrono::steady_clock::time_point::max();
+
+    // This slice's share: the work left over the headroom left, per byte allocated since the last
+    // slice, plus what earlier slices ran out of time for. Once the headroom is gone, everything left.
+    size_t debt = incrementalDebt.exchange(0, std::memory_order_relaxed);
+    pacer.allocatedBytes += debt;
+    // An estimate the cycle has outrun grows by half, so the slices speed up rather than stall
+    if (pacer.workDone >= pacer.estimatedWork) {
+        pacer.estimatedWork = pacer.workDone + pacer.estimatedWork / 2 + 1;
+    }
+    size_t workLeft = pacer.estimatedWork - pacer.workDone;
+    size_t headroomLeft = pacer.headroom > pacer.allocatedBytes ? pacer.headroom - pacer.allocatedBytes : 0;
+    size_t work = pacer.owedWork + (headroomLeft > pacingQuantum
+        ? static_cast<size_t>(static_cast<double>(workLeft) * debt / headroomLeft) + 1
+        : workLeft);
+    size_t workLimit = incrementalSliceWork.load(std::memory_order_relaxed);
+    size_t sliceWork = workLimit > 0 ? std::min(work, workLimit) : work;
+
+    size_t done = runIncrementalWork(sliceWork, deadline);
+    if (incrementalPhase != IncrementalPhase::Idle) {
+        pacer.workDone += done;
+        pacer.owedWork = work - std::min(work, done);
+    }
+    TRACE_GC(IncrementalSlice, done, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - sliceStart).count());
+}
+
+void Heap::startIncrementalCycle() {
+    incrementalCycleActive = true;
+    incrementalDebt.store(0, std::memory_order_relaxed);
+    // Marking costs a unit per root and per live block, sweeping at most one per block of the heap
+    size_t blocks = blockStore.LiveCount();
+    pacer.estimatedWork = rootSet.size() + (pacer.liveBlocks > 0 ? pacer.liveBlocks : blocks) + (lazySweep ? 0 : blocks);
+    incrementalPhase = IncrementalPhase::Preparing;
+}
+
+size_t Heap::runIncrementalWork(size_t work, std::chrono::steady_clock::time_point deadline) {
+    size_t done = 0;
+    // Marking checks the clock every few blocks, sweeping after every piece of a segment
+    size_t steps = 0;
+    auto visit = [this](Block* referencedBlock) {
+        if (tryMark(*referencedBlock)) {
+            grayBlocks.push_back(referencedBlock);
+            ++pacer.markedBlocks;
+            pacer.markedBytes += referencedBlock->size;
+        }
+    };
+
+    while (done < work) {
+        if (incrementalPhase == IncrementalPhase::Preparing || incrementalPhase == IncrementalPhase::Sweeping) {
+            size_t segmentIndex = 0;
+            while (segmentIndex < segments.size() && !segments[segmentIndex].sweepPending) {
+                ++segmentIndex;
+            }
+            if (segmentIndex == segments.size()) {
+                if (incrementalPhase == IncrementalPhase::Sweeping) {
+                    endIncrementalCycle();
+                    break;
+                }
+                // Initial mark: from now on new blocks are allocated black and the roots are
+                // taken as they are, to be scanned over the next slices
+                concurrentMarking = true;
+                pacer.rootSnapshot = rootSet;
+                pacer.rootCursor = 0;
+                incrementalPhase = IncrementalPhase::Marking;
+                continue;
+            }
+            done += 1 + sweepQueuedSegment(segmentIndex, incrementalSweepWords);
+            steps = 0;
+        }
+        else if (incrementalPhase == IncrementalPhase::Marking) {
+            if (pacer.rootCursor < pacer.rootSnapshot.size()) {
+                // A root freed since the snapshot is no longer allocated and is skipped
+                Block* root = static_cast<Block*>(pacer.rootSnapshot[pacer.rootCursor++]);
+                if (root) visit(root);
+            }
+            else if (!grayBlocks.empty()) {
+                Block* block = grayBlocks.back();
+                grayBlocks.pop_back();
+                forEachReference(*block, visit);
+            }
+            else {
+                completeIncrementalMarking();
+                continue;
+            }
+            ++done;
+            if (++steps % 32 != 0) continue;
+        }
+        else {
+            break;
+        }
+        if (std::chrono::steady_clock::now() >= deadline) break;
+    }
+    return done;
+}
+
+void Heap::completeIncrementalMarking() {
+    concurrentMarking = false;
+    std::vector<void*>().swap(pacer.rootSnapshot);
+    pacer.rootCursor = 0;
+    pacer.liveBlocks = pacer.markedBlocks;
+    pacer.liveBytes = pacer.markedBytes;
+    queueLazySweep();
+    // In lazy mode Allocate sweeps on demand, as after any other collection
+    if (lazySweep) {
+        endIncrementalCycle();
+    }
+    else {
+        incrementalPhase = IncrementalPhase::Sweeping;
+    }
+}
+
+void Heap::endIncrementalCycle() {
+    // Move the trigger halfway towards the one that would have had this cycle end as the headroom ran out
+    pacer.allocatedBytes += incrementalDebt.exchange(0, std::memory_order_relaxed);
+    double idealRatio = 1.0 - static_cast<double>(pacer.allocatedBytes) / pacer.headroom;
+    pacer.triggerRatio = std::min(std::max(pacer.triggerRatio + (idealRatio - pacer.triggerRatio) / 2, 0.05), 0.95);
+    setIncrementalTrigger();
+
+    pacer.estimatedWork = 0;
+    pacer.workDone = 0;
+    pacer.owedWork = 0;
+    pacer.allocatedBytes = 0;
+    pacer.markedBlocks = 0;
+    pacer.markedBytes = 0;
+    stats.RecordIncrementalCycle();
+    allocatedSinceCycle.store(0, std::memory_order_relaxed);
+    incrementalPhase = IncrementalPhase::Idle;
+    incrementalCycleActive = false;
+}
+
+void Heap::finishIncrementalCycle() {
+    // A cycle still preparing has marked nothing, it carries on once the caller is done
+    while (incrementalPhase == IncrementalPhase::Marking || incrementalPhase == IncrementalPhase::Sweeping) {
+        runIncrementalWork(SIZE_MAX, std::chrono::steady_clock::time_point::max());
+    }
+}
+
+void Heap::setIncrementalTrigger() {
+    pacer.headroom = std::max(static_cast<size_t>(pacer.liveBytes * incrementalHeapGrowth), minimumIncrementalHeadroom);
+    incrementalTrigger.store(static_cast<size_t>(pacer.headroom * pacer.triggerRatio), std::memory_order_relaxed);
+}
+
+bool Heap::SetPointer(int sourceBlockId, size_t slot, int targetBlockId) {
+    std::lock_guard<std::mutex> lock(heapMutex);
+
+    BlockHandle* source = blockHandles.Find(sourceBlockId);
+    if (!source || !source->block->allocated) {
+        std::cerr << "SetPointer failed: Block ID " << sourceBlockId << " is not allocated.\n";
+        return false;
+    }
+    if (source->block->type) {
+        std::cerr << "SetPointer failed: Block ID " << sourceBlockId << " is a " << source->block->type->name
+            << ", whose references are set with Store.\n";
+        return false;
+    }
+
+    Block* target = nullptr;
+    if (targetBlockId >= 0) {
+        BlockHandle* targetHandle = blockHandles.Find(targetBlockId);
+        if (!targetHandle || !targetHandle->block->allocated) {
+            std::cerr << "SetPointer failed: Block ID " << targetBlockId << " is not allocated.\n";
+            return false;
+        }
+        target = targetHandle->block;
+    }
+
+    Block* sourceBlock = source->block;
+    int previousBlockId;
+    {
+        // The flag shares a byte with those reconcileRoots sets under rootsMutex
+        std::lock_guard<std::mutex> rootsLock(rootsMutex);
+        std::lock_guard<std::mutex> referencesLock(referencesMutex);
+        std::vector<int>& references = untypedReferences[sourceBlockId];
+        if (slot >= references.size()) {
+            references.resize(slot + 1, -1);
+        }
+        previousBlockId = references[slot];
+        references[slot] = target ? targetBlockId : -1;
+        sourceBlock->hasReferences = true;
+    }
+    // Snapshot-at-the-beginning barrier: the reference being overwritten is still traced
+    shade(resolve(previousBlockId));
+
+    // Generational barrier: an old block that now references a young one is remembered. Another
+    // arena's thread may be listing either block's generation, under rootsMutex.
+    std::lock_guard<std::mutex> rootsLock(rootsMutex);
+    if (target && sourceBlock->old && !sourceBlock->remembered && !target->old) {
+        sourceBlock->remembered = true;
+        rememberedSet.push_back(sourceBlock);
+    }
+    return true;
+}
+
+bool Heap::hasType(const Block& block, const TypeInfo& type) {
+    if (block.type == &type) return true;
+    if (!block.type || restoredTypes.empty()) return false;
+    for (const std::unique_ptr<RestoredType>& restored : restoredTypes) {
+        if (block.type != &restored->info) continue;
+        if (restored->matched.load(std::memory_order_acquire) == &type) return true;
+        const TypeInfo& saved = restored->info;
+        bool sameLayout = std::strcmp(saved.name, type.name) == 0 && saved.size == type.size && saved.referenceCount == type.referenceCount
+            && std::equal(saved.referenceOffsets, saved.referenceOffsets + saved.referenceCount, type.referenceOffsets);
+        if (sameLayout) {
+            restored->matched.store(&type, std::memory_order_release);
+        }
+        return sameLayout;
+    }
+    return false;
+}
+
+bool Heap::adoptRestoredRoot(int blockId, const TypeInfo& type) {
+    std::lock_guard<std::mutex> lock(heapMutex);
+    Block* block = resolve(blockId);
+    if (!block || !hasType(*block, type)) {
+        std::cerr << "Adopt failed: Block ID " << blockId << " is not an allocated " << type.name << ".\n";
+        return false;
+    }
+    std::lock_guard<std::mutex> rootsLock(rootsMutex);
+    auto entry = restoredRootHandles.find(blockId);
+    if (entry == restoredRootHandles.end()) {
+        std::cerr << "Adopt failed: Block ID " << blockId << " has no restored root left.\n";
+        return false;
+    }
+    if (--entry->second == 0) {
+        restoredRootHandles.erase(entry);
+    }
+    return true;
+}
+
+void* Heap::pinObject(int blockId, const TypeInfo& type) {
+    std::lock_guard<std::mutex> lock(heapMutex);
+    Block* block = resolve(blockId);
+    if (!block || !hasType(*block, type)) {
+        return nullptr;
+    }
+    // A root handle keeps the object alive and out of Deallocate's reach while it is pinned
+    {
+        std::lock_guard<std::mutex> rootsLock(rootsMutex);
+        if (block->rootHandles++ == 0 && block->rootIndex == notListed) {
+            AddToRootSet(*block);
+        }
+    }
+    shade(block);
+    ++pinnedObjects[block];
+    return payloadOf(*block);
+}
+
+void Heap::unpinObject(int blockId) {
+    std::lock_guard<std::mutex> lock(heapMutex);
+    // Pinned objects keep their Block IDs; one a snapshot load has voided is no longer listed
+    Block* block = resolve(blockId);
+    auto pin = block ? pinnedObjects.find(block) : pinnedObjects.end();
+    if (pin == pinnedObjects.end()) return;
+    if (--pin->second == 0) {
+        pinnedObjects.erase(pin);
+    }
+    releaseRootHandle(*block);
+}
+
+bool Heap::isPinned(const Block& block) const {
+    return pinnedObjects.count(&block) > 0;
+}
+
+bool Heap::storeReference(int objectId, const TypeInfo& type, size_t offset, int targetId) {
+    std::lock_guard<std::mutex> lock(heapMutex);
+
+    Block* object = resolve(objectId);
+    if (!object || !hasType(*object, type)) {
+        std::cerr << "Store failed: Block ID " << objectId << " is not an allocated " << type.name << ".\n";
+        return false;
+    }
+    if (std::find(type.referenceOffsets, type.referenceOffsets + type.referenceCount, offset) == type.referenceOffsets + type.referenceCount) {
+        std::cerr << "Store failed: the field at offset " << offset << " of " << type.name << " is not listed in its HEAP_TYPE.\n";
+        return false;
+    }
+    Block* target = resolve(targetId);
+    if (targetId >= 0 && !target) {
+        std::cerr << "Store failed: Block ID " << targetId << " is not allocated.\n";
+        return false;
+    }
+
+    char* field = payloadOf(*object) + offset;
+    int previousId;
+    std::memcpy(&previousId, field, sizeof(previousId));
+    // The same barriers as SetPointer
+    shade(resolve(previousId));
+    std::memcpy(field, &targetId, sizeof(targetId));
+    std::lock_guard<std::mutex> rootsLock(rootsMutex);
+    if (target && object->old && !object->remembered && !target->old) {
+        object->remembered = true;
+        rememberedSet.push_back(object);
+    }
+    return true;
+}
+
+void Heap::addRoot(int blockId) {
+    std::lock_guard<std::mutex> lock(heapMutex);
+    Block* block = resolve(blockId);
+    if (!block || !block->type) return;
+    {
+        std::lock_guard<std::mutex> rootsLock(rootsMutex);
+        if (block->rootHandles++ == 0 && block->rootIndex == notListed) {
+            AddToRootSet(*block);
+        }
+    }
+    // A root taken while marking runs may come from a reference the marker has not reached yet
+    shade(block);
+}
+
+void Heap::removeRoot(int blockId) {
+    std::lock_guard<std::mutex> lock(heapMutex);
+    Block* block = resolve(blockId);
+    if (!block || !block->type) return;
+    releaseRootHandle(*block);
+}
+
+void Heap::releaseRootHandle(Block& block) {
+    std::lock_guard<std::mutex> rootsLock(rootsMutex);
+    if (block.rootHandles > 0 && --block.rootHandles == 0 && block.rootIndex != notListed) {
+        RemoveFromRootSet(block);
+    }
+}
+
+void Heap::WorkerFunction(const std::vector<size_t>& tasks, std::function<void(size_t)> taskFunction) {
+    for (size_t task : tasks) {
+        taskFunction(task);
+    }
+}
+
+template void* Heap::Allocate<FirstFit>(size_t size, int* blockId);
+template void* Heap::Allocate<NextFit>(size_t size, int* blockId);
+template void* Heap::Allocate<BestFit>(size_t size, int* blockId);
+template void* Heap::Allocate<WorstFit>(size_t size, int* blockId);
+template size_t Heap::AllocateBatch<FirstFit>(const size_t* sizes, size_t count, void** memory, int* blockIds);
+template size_t Heap::AllocateBatch<NextFit>(const size_t* sizes, size_t count, void** memory, int* blockIds);
+template size_t Heap::AllocateBatch<BestFit>(const size_t* sizes, size_t count, void** memory, int* blockIds);
+template size_t Heap::AllocateBatch<WorstFit>(const size_t* sizes, size_t count, void** memory, int* blockIds);
@@ -1,81 +1,852 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 #include <mutex>
 #include <vector>
 #include <functional>
 #include <future>
 #include <thread>
 #include <atomic>
+#include <chrono>
+#include <string>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+#include <type_traits>
+#include <utility>
 
+#include "FreeBlockIndex.h"
+#include "FitPolicies.h"
+#include "BuddyFreeLists.h"
+#include "HandleTable.h"
+#include "SlabStore.h"
+#include "WorkStealingDeque.h"
+#include "ThreadCache.h"
+#include "HeapStats.h"
+#include "HeapObjects.h"
+#include "NumaTopology.h"
+
+template <typename T>
+class Root;
+template <typename T>
+class Pinned;
 
 class Heap {
 private:
+    // One cache line per block. Reachability marks live in the segment's bitmaps, payload
+    // addresses are computed from the segment, and references are kept outside the header.
     struct Block {
-        size_t size = 0;
-        bool marked = false;
-
+        // Payload location inside the owning segment's region, which stays below 4 GiB
+        uint32_t offset = 0;
+        uint32_t size = 0;
         int blockId;
-        void* allocatedMemory = nullptr;
-        void* memoryPointer = nullptr;
-        // Example: Assume blocks have pointers to other objects
-        std::vector<Block*> pointers;
-        int generation = 0;
+        // Root handles holding a typed block; it is in rootSet while this is above 0
+        uint32_t rootHandles = 0;
+        // Slots in rootSet and in the generation list, or notListed
+        uint32_t rootIndex = notListed;
+        uint32_t generationIndex = notListed;
+
+        // Next block in address order within the segment, or the blockStore free list while
+        // the block is unused. Predecessors are found through the segment's block directory.
+        union {
+            Block* next = nullptr;
+            Block* nextFree;
+        };
+        // Pointer map of an object allocated by New, nullptr for Allocate's untyped blocks
+        const TypeInfo* type = nullptr;
+
+        uint16_t segment = 0;
+        bool allocated = false;
+        // Free, but held by a thread cache instead of the free index
+        bool cached = false;
+        // Minor collections survived, up to maxPromotionAge
+        uint8_t generation = 0;
+        // Freed by a thread of another arena and waiting on the owner's remote-free list
+        std::atomic<bool> remotePending{ false };
+        // Whether type is set, for threads of other arenas, which read no plain field but offset and segment
+        std::atomic<bool> typed{ false };
+        // Only the block's current owner writes these (its allocating or freeing thread, or a
+        // collector with the world stopped), so they can share a byte. The write barriers and
+        // reconcileRoots touch old, remembered and hasReferences while other threads hold the block,
+        // so they do that under rootsMutex. Bit-fields take no initializers; blockStore value-initializes blocks, which zeroes them.
+        // In oldGeneration rather than youngGeneration
+        bool old : 1;
+        // Old block in rememberedSet, it may point into the young generation
+        bool remembered : 1;
+        // Bump-allocated in the nursery segment
+        bool nursery : 1;
+        // Lives in a buddy segment, its size is a power of two
+        bool buddy : 1;
+        // Untyped block with SetPointer references in untypedReferences
+        bool hasReferences : 1;
+        // Its Block ID has been handed out, so the next allocation of the block reissues it
+        bool issued : 1;
+        // Moved while the world is stopped; the copy's address is stored in the vacated payload
+        bool forwarded : 1;
     };
+    // The owner's remote-free list and forwarding pointers live in the blocks' own payloads
+    // (see payloadLink), which leaves this much per block
+    static_assert(sizeof(void*) != 8 || sizeof(Block) == 48, "Block header grew");
+    static const uint32_t notListed = UINT32_MAX;
 
+    // One contiguous region from the OS, carved into blocks without gaps.
+    // A released segment keeps its slot (with no region) so positions in other segments stay valid.
     struct Segment {
-        std::vector<Block> blocks;
+        char* base = nullptr;
+        size_t capacity = 0;
+        // Lowest block, the rest follow through Block::next
+        Block* first = nullptr;
+        size_t blockCount = 0;
+        // Lowest block starting in each blockDirectoryStride bytes, or nullptr. With the next
+        // links it finds a block by offset for free index and thread cache positions, and the
+        // block before another one.
+        std::unique_ptr<Block*[]> blockDirectory;
+        size_t directoryEntries = 0;
+        // One bit per blockAlignment bytes, set at the first byte of allocated and of marked
+        // blocks. A sweep reads both 64 granules at a time and only visits the garbage.
+        std::unique_ptr<std::atomic<uint64_t>[]> allocatedBits;
+        std::unique_ptr<std::atomic<uint64_t>[]> markBits;
+        size_t bitmapWords = 0;
+        // Marked by a lazy collection but not swept yet, up to the first sweptWords bitmap words
+        bool sweepPending = false;
+        size_t sweptWords = 0;
+        // Filled by bump allocation and emptied by evacuating its survivors
+        bool nursery = false;
+        // Power-of-two region managed by the buddy system
+        bool buddy = false;
+        // One large object: a single block with one bitmap word, freed in place and never moved
+        bool large = false;
+        // Bump-allocated by a Region and freed with it; it has no blocks, so the collector never visits it
+        bool region = false;
+        // Mapped copy-on-write from a snapshot file: unmapped rather than released, and never decommitted
+        bool mapped = false;
+        // Next segment of the same region, or of the pool of spare region segments
+        size_t nextRegionSegment = SIZE_MAX;
+        // Owning arena, or noArena for the nursery, buddy, large-object and region segments
+        size_t arena = noArena;
+        // NUMA node its memory was placed on: its arena's, or for the others that of the thread that created it
+        size_t node = 0;
     };
 
+    // Block records never move once created, so rootSet, the generation lists and the handle
+    // table can all point at them directly
+    SlabStore<Block> blockStore;
+    // Reserved up front and never reallocated, so arenas can use their segments while another one adds a segment
     std::vector<Segment> segments;
-    std::vector<Block> memory;
+    static const size_t maxSegments = 1 << 14;
+    // Guards nursery, buddy and collector state; held with every arena lock it stops the world
     std::mutex heapMutex;
+    // Innermost locks for what arenas share: segment slots, blockStore with blockHandles, and the root set with the generation lists
+    std::mutex segmentTableMutex;
+    std::mutex blockTableMutex;
+    std::mutex rootsMutex;
+
+    // Arenas: the regular segments are split between arenaCount arenas, each with its own lock,
+    // free index and thread caches. A thread allocates from the arena its cache was assigned to.
+    // A block freed by a thread of another arena is pushed onto the owner's remoteFrees list
+    // without taking a lock, and released the next time the owning arena is locked.
+    struct Arena {
+        std::mutex lock;
+        FreeBlockIndex freeIndex;
+        // Where the last Next-Fit search ended
+        FreeBlockIndex::Position nextFitRover = 0;
+        std::vector<size_t> segmentIndices;
+        std::vector<std::shared_ptr<ThreadCache>> caches;
+        // Lock-free stack linked through the freed blocks' payloads
+        std::atomic<Block*> remoteFrees{ nullptr };
+        size_t node = 0;
+    };
+    static const size_t noArena = SIZE_MAX;
+    // NUMA placement: arena i belongs to node i % nodeCount, so every node has an arena. A thread
+    // is assigned to an arena of its own node, whose segments are bound to that node, and collector
+    // workers are spread over the nodes the same way and handed the blocks and segments of theirs.
+    NumaTopology topology;
+    size_t arenaCount;
+    std::unique_ptr<Arena[]> arenas;
+    // Threads are assigned to their node's arenas round-robin on their first call
+    std::unique_ptr<std::atomic<size_t>[]> nextArena;
+    size_t arenasOnNode(size_t node) const;
+    // The ordinal-th (modulo their number) of the first threadCount collector workers on a node;
+    // worker w runs on node w % nodeCount. Nodes without a worker share them all.
+    size_t nodeWorker(size_t node, size_t ordinal, size_t threadCount) const;
+    // Nursery, buddy, large-object and region segments, guarded by heapMutex
+    std::vector<size_t> sharedSegments;
+    std::vector<size_t>& segmentsOf(size_t arenaIndex);
+    FreeBlockIndex& freeIndexOf(size_t segmentIndex);
+    // Locks an arena and its thread caches (heapMutex for noArena), reconciles their roots and releases its remote frees
+    std::vector<std::unique_lock<std::mutex>> LockArena(size_t arenaIndex);
+    // Locks every arena and thread cache; the caller holds heapMutex. Optionally returns cached blocks to the free indexes.
+    std::vector<std::unique_lock<std::mutex>> LockArenas(bool returnBlocks);
+    void pushRemoteFree(Arena& arena, Block& block);
+    void drainRemoteFrees(size_t arenaIndex);
 
 
+    // Each rooted block records its slot, so removal swaps the last root into it
     std::vector<void*> rootSet;
-    //int blockCounter = 0;
-    static const size_t maxBlocksPerSegment = 10;
+    // Payload alignment, also the smallest block a split leaves behind
+    static const size_t blockAlignment = 16;
+    static const size_t minimumSegmentCapacity = 4096;
+    // Block offsets and sizes are 32 bits
+    static const size_t maxSegmentCapacity = UINT32_MAX & ~(blockAlignment - 1);
+    static size_t alignSize(size_t size);
+    size_t defaultSegmentCapacity;
+    // Segments below this index are kept even when empty, the rest go back to the OS
+    size_t retainedSegments;
+
+    // Segment helpers
+    // A large segment gets one bitmap word, enough for its single block
+    bool createSegment(size_t capacity, size_t& segmentIndex, size_t arenaIndex, bool large = false);
+    void releaseSegment(size_t segmentIndex);
+    // Hands a segment's region back to the OS, however it was obtained
+    void releaseSegmentMemory(const Segment& segment);
+    void releaseSegmentIfEmpty(size_t segmentIndex);
+    // Creates a block right after `previous` (or at offset 0) and hands out its Block ID
+    Block& addBlock(size_t segmentIndex, Block* previous, size_t size);
+    // The same without a Block ID; the caller holds blockTableMutex
+    Block& createBlock(size_t segmentIndex, Block* previous, size_t size);
+    // Unlinks a block that was merged into a neighbour or released with its segment;
+    // `previous` is the block before it, nullptr for the segment's first block
+    void removeBlock(size_t segmentIndex, Block* previous, Block& block);
+    // The two halves of removeBlock: segment-local, then heap-wide
+    void unlinkBlock(size_t segmentIndex, Block* previous, Block& block);
+    void retireBlock(Block& block);
+    // Block directory: one entry per blockDirectoryStride bytes costs as much as the segment's two bitmaps
+    static const size_t blockDirectoryStride = 512;
+    static size_t directoryEntry(const Segment& segment, size_t offset);
+    // The block starting at `offset`, or nullptr if none does
+    static Block* blockAtOffset(const Segment& segment, size_t offset);
+    // The block just before `block` in its segment, nullptr for the first one
+    static Block* blockBefore(const Segment& segment, const Block& block);
+    // Cuts a block that is not in the free index down to `size`, indexing the remainder
+    void splitBlock(size_t segmentIndex, Block& block, size_t size);
+    // Merges a free, unindexed block with free indexed neighbours and indexes the result
+    Block& coalesceAndIndex(size_t segmentIndex, Block& block);
+    // With a type, copies `object` into the payload and gives the block the root New returns
+    void* commitBlock(size_t segmentIndex, Block& block, const TypeInfo* type = nullptr, const void* object = nullptr);
+    void releaseBlock(size_t segmentIndex, Block& block);
+    // Address of an allocated block's payload, nullptr for a free block
+    char* payloadOf(const Block& block) const;
+    // The first bytes of a payload nobody else uses: a remote-freed block's link in its owner's
+    // list, or a moved block's copy. Payloads are at least blockAlignment bytes.
+    Block* payloadLink(const Block& block) const;
+    void setPayloadLink(const Block& block, Block* link);
+    // Block::allocated together with the segment's allocated bit
+    void setAllocated(Block& block, bool allocated);
+    // The allocated bit alone, which a thread of another arena may read
+    bool isAllocated(const Block& block) const;
+    // Block::type together with Block::typed
+    void setType(Block& block, const TypeInfo* type);
+    bool isMarked(const Block& block) const;
+    void clearMark(Block& block);
+    // Makes the block count as reachable for the current collection
+    void setMark(Block& block);
+
     // Helper functions
-    void Mark(Block& block);
+    // Marks everything reachable from the seeds, on up to totalThreads workers.
+    // A young-only mark treats old blocks as live and does not trace through them.
+    void Mark(const std::vector<Block*>& seeds, bool youngOnly = false);
+    // Marks from the root set plus any extra seeds
+    void MarkRoots(const std::vector<Block*>& extraSeeds = {});
+    bool tryMark(Block& block, bool youngOnly = false);
+    // Below this many live blocks the mark phase stays on the calling thread
+    static const size_t parallelMarkThreshold = 4096;
     void Sweep();
+
+    // What sweeping one segment changed outside the segment, applied under heapMutex afterwards
+    struct SweepResult {
+        // Freed blocks still to leave the root set and generation lists
+        std::vector<Block*> freedBlocks;
+        size_t freedBytes = 0;
+        // Blocks merged into a preceding free block, already unlinked from the segment
+        std::vector<Block*> mergedBlocks;
+        // Free index entries by (size, offset) and merged runs to index
+        std::vector<std::pair<size_t, size_t>> indexErasures;
+        std::vector<Block*> indexInsertions;
+    };
+    // Only touches the segment itself, so segments can be swept in parallel. A pending sweep may
+    // be done a few bitmap words at a time; the segment stays pending until its last word.
+    SweepResult sweepSegment(size_t segmentIndex, size_t wordLimit = SIZE_MAX);
+    void applySweepResult(size_t segmentIndex, SweepResult& result);
+
+    // Lazy sweeping: a collection only marks and queues segments, Allocate sweeps them on demand
+    bool lazySweep = false;
+    void queueLazySweep();
+    // Sweeps one queued segment, false if none is left; with an arena index only that arena's segments
+    bool sweepPendingSegment();
+    bool sweepPendingSegment(size_t arenaIndex);
+    // Returns the blocks freed or merged
+    size_t sweepQueuedSegment(size_t segmentIndex, size_t wordLimit = SIZE_MAX);
+    void finishLazySweep();
     size_t totalThreads;
-    void WorkerFunction(size_t threadIndex, size_t totalTasks, size_t totalThreads, std::function<void(size_t)> taskFunction);
-    void RemoveFromRootSet(const Block& block);
-    size_t getSegmentIndexForBlock(const Block& block) const;
+    void WorkerFunction(const std::vector<size_t>& tasks, std::function<void(size_t)> taskFunction);
+    void AddToRootSet(Block& block);
+    void RemoveFromRootSet(Block& block);
+    // Enters a newly allocated block in the young generation and roots it, unless it is typed and
+    // no root handle holds it. Does nothing that is done already.
+    void trackAllocatedBlock(Block& block);
+    // Takes a freed block out of the root set and its generation list
+    void untrackBlock(Block& block);
+    // The same for a whole batch under one rootsMutex acquisition
+    void trackAllocatedBlocks(const std::vector<Block*>& blocks);
+    void untrackBlocks(const std::vector<Block*>& blocks);
+    // Bodies of the above, the caller holds rootsMutex
+    void listAllocatedBlock(Block& block);
+    void unlistBlock(Block& block);
+    // Takes a free block of the arena for AllocateBatch, preferably one for all `wanted` bytes and
+    // otherwise one for `size`, from a new segment if nothing fits. The block is out of the free index.
+    template <typename FitPolicy>
+    Block* takeBatchBlock(size_t arenaIndex, size_t wanted, size_t size, size_t& segmentIndex);
+    // Finds a fit in the arenas other than `arenaIndex`, those of its node first, before that arena grows.
+    // The caller holds no arena lock; `locks` is left holding the locks of the arena the block is in.
+    template <typename FitPolicy>
+    Block* findFitInOtherArena(size_t arenaIndex, size_t size, size_t& ownerIndex, FreeBlockIndex::Position& position,
+        std::vector<std::unique_lock<std::mutex>>& locks);
+    size_t getSegmentIndexForBlock(const Block& block);
+
+    // Allocate and New: a typed allocation is committed with its object already in place
+    template <typename FitPolicy>
+    void* allocate(size_t size, int* blockId, const TypeInfo* type, const void* object);
 
     // Custom Allocation Strategies
-    Block* findFirstFit(size_t size);
-    Block* findBestFit(size_t size);
-    Block* findWorstFit(size_t size);
+    // Returns the free block the policy selects in an arena's free index and its position, or nullptr
+    template <typename FitPolicy>
+    Block* findFit(Arena& arena, size_t size, FreeBlockIndex::Position& position);
+
+    static FreeBlockIndex::Position makePosition(size_t segmentIndex, size_t offset);
+    static size_t segmentOf(FreeBlockIndex::Position position);
+    Block* blockAt(FreeBlockIndex::Position position);
+    void RebuildFreeIndex();
+
+    // Block IDs are handles into this table, so lookups are O(1). Each allocation reissues the
+    // block's handle, so IDs from an earlier use of the block, and IDs of merged or released
+    // blocks, are rejected instead of reaching whichever allocation reuses the block or slot.
+    struct BlockHandle {
+        Block* block = nullptr;
+    };
+    HandleTable<BlockHandle> blockHandles;
+    // Deallocate's checks: reports and returns false unless the block may be freed now
+    bool canDeallocate(int blockId, BlockHandle* handle);
 
     // Generational GC
+    // Allocated blocks by generation, each block records its slot for O(1) removal
     std::vector<Block*> youngGeneration;
     std::vector<Block*> oldGeneration;
+    std::vector<Block*>& generationList(const Block& block);
+    void addToGeneration(Block& block, bool old);
+    void removeFromGeneration(Block& block);
+    // Survivors of this many minor collections move to the old generation
+    int promotionAge = 1;
+    static const int maxPromotionAge = UINT8_MAX;
+    // Old blocks that may hold references into the young generation, filled by the
+    // SetPointer barrier and by promotion. Minor collections trace from these instead of the old generation.
+    std::vector<Block*> rememberedSet;
+    void rememberIfPointsToYoung(Block& block);
+    void rebuildRememberedSet();
+    // Traces only young blocks and sweeps only the young generation
     void CollectYoungGeneration();
     void CollectOldGeneration();
     void PromoteToOldGeneration(Block& block);
+    // RunGenerationalGC collects the old generation every oldCollectionInterval runs
+    static const int oldCollectionInterval = 5;
+    int generationalRuns = 0;
+
+    // Nursery: small typed objects are bump-allocated from the free tail of one segment. A minor
+    // collection copies the reachable ones out (Cheney scan) and empties the segment at once, unless
+    // a pinned one had to stay.
+    // Untyped blocks never go there, since copying them would move them from under their callers.
+    std::atomic<bool> nurseryEnabled{ false };
+    size_t nurserySegment = SIZE_MAX;
+    Block* nurseryTail = nullptr;
+    static const size_t nurseryObjectLimit = 1024;
+    void* allocateFromNursery(size_t size, int* blockId, const TypeInfo* type, const void* object);
+    // Copies the survivors into regular segments, returns the number of blocks copied
+    size_t evacuateNursery();
+    Block* evacuate(Block& block);
+    // Copies an allocated block into a reserved free one, which takes over its Block ID,
+    // root slot and generation; the source is left free and forwarded to it
+    void moveBlock(Block& block, Block& destination, size_t destinationSegment);
+    void resetNursery();
+    // A free block of at least `size` in any arena, already taken out of its free index.
+    // Creates a segment in the first arena when nothing fits, unless mayGrow is false.
+    template <typename FitPolicy>
+    Block* reserveBlock(size_t size, size_t& segmentIndex, bool mayGrow = true);
+
+    // Compaction: after an old-generation collection, live blocks in the sparsest segments are
+    // moved into the free space of the others and the emptied segments are released. Only typed
+    // blocks move, which callers find again through Get; segments with untyped or pinned blocks stay put.
+    double compactionThreshold = 0.5;
+    // Share of free bytes outside the largest free block, 0 when free space is contiguous.
+    // Compaction leaves buddy segments alone, so they only count when asked for.
+    double fragmentation(bool includeBuddySegments = false) const;
+    void CompactSegments();
+    // Merges adjacent free blocks of a segment whose free blocks are not indexed, and indexes them
+    void mergeAndIndexFreeBlocks(size_t segmentIndex);
+
+    // Buddy system: blocks of a buddy segment are halved on allocation until they fit and
+    // merge with their buddy (offset ^ size) on release. Their free blocks live in buddyLists.
+    BuddyFreeLists buddyLists;
+    static const size_t buddySegmentOrder = 20;
+    static const size_t buddyMinimumOrder = 4;
+    size_t buddySegments = 0;
+    // Merges a freed buddy block with its free buddies and lists the result
+    void releaseBuddy(size_t segmentIndex, Block& block);
+    // Merges and relists every free block of a buddy segment after a sweep
+    void relistBuddySegment(size_t segmentIndex);
+    // One empty buddy segment is kept for the next allocation, others go back to the OS
+    void releaseBuddySegmentIfEmpty(size_t segmentIndex);
+
+    // Thread caches
+    // Lock order is heapMutex, then arena locks, then thread cache locks. The fast paths only take
+    // their own cache lock, so anything that splits or merges an arena's blocks also locks its caches.
+    static std::atomic<uint64_t> instanceCounter;
+    const uint64_t instanceId;
+    std::atomic<size_t> threadCacheDepth{ 32 };
+    std::atomic<size_t> threadCacheBatchSize{ 8 };
+    ThreadCache* localThreadCache();
+    void* allocateFromThreadCache(ThreadCache& cache, size_t sizeClass, size_t size, int* blockId, const TypeInfo* type, const void* object);
+    // Also hands blocks of other arenas to their remote-free lists, deciding on their atomic state
+    // alone. Otherwise returns false and sets arenaIndex to the block's arena, whose lock the slow path takes.
+    bool deallocateToThreadCache(ThreadCache& cache, int blockId, size_t& arenaIndex);
+    template <typename FitPolicy>
+    void refillThreadCache(ThreadCache& cache, size_t sizeClass);
+    void trimThreadCacheBin(ThreadCache& cache, size_t sizeClass);
+    void returnCachedBlock(FreeBlockIndex::Position position);
+    void reconcileRoots(ThreadCache& cache);
 
     // Concurrent GC
+    // The collector thread works in short slices under heapMutex, so mutators run in between.
+    // Marking is tri-color: gray blocks wait in grayBlocks, black blocks are marked and scanned.
     std::atomic<bool> gcRunning = false;
+    std::atomic<bool> gcStopRequested{ false };
+    // While set, new blocks are allocated black and overwritten references are shaded gray
+    std::atomic<bool> concurrentMarking{ false };
+    std::vector<Block*> grayBlocks;
+    // The write barrier runs under an arena lock or heapMutex, so grayBlocks needs its own between slices
+    std::mutex grayMutex;
+    // Gray blocks blackened per slice
+    static const size_t concurrentSliceBlocks = 256;
+    // Serializes collections, the concurrent cycle holds it from start to finish
+    std::mutex collectionMutex;
+    std::mutex collectorLifecycleMutex;
+    std::thread concurrentCollector;
     void ConcurrentMarkAndSweep();
+    // Write barrier: a reference about to disappear is shaded gray while marking runs
+    void shade(Block* block);
+
+    // Incremental GC: allocation volume starts a cycle, and Allocate pays for it in slices of the
+    // concurrent collector's marking and sweeping, each under heapMutex within a time and work budget.
+    // The phase and the pacer below are guarded by heapMutex. A cycle is Preparing while it sweeps what
+    // an earlier lazy collection left, whose marks would otherwise pass for its own.
+    enum class IncrementalPhase { Idle, Preparing, Marking, Sweeping };
+    IncrementalPhase incrementalPhase = IncrementalPhase::Idle;
+    std::atomic<bool> incrementalEnabled{ false };
+    std::atomic<bool> incrementalCycleActive{ false };
+    std::atomic<uint64_t> incrementalSliceMicroseconds{ 200 };
+    // Work units per slice at most, 0 for no limit. A unit is one root or gray block, one block freed or
+    // merged by the sweep, or one piece of incrementalSweepWords bitmap words swept.
+    std::atomic<size_t> incrementalSliceWork{ 0 };
+    // Bytes allocated since the last cycle ended, and during the running one but not paid for by a slice yet
+    std::atomic<size_t> allocatedSinceCycle{ 0 };
+    std::atomic<size_t> incrementalDebt{ 0 };
+    std::atomic<size_t> incrementalTrigger{ 0 };
+    // Slices sweep this many bitmap words (32 KiB of a segment) between looks at the clock
+    static const size_t incrementalSweepWords = 32;
+    // Threads report their allocations to the pacer in batches of this many bytes
+    static const size_t pacingQuantum = 16 * 1024;
+    // The heap may grow by this share of its live bytes, and at least minimumIncrementalHeadroom,
+    // before a cycle should be done
+    static const double incrementalHeapGrowth;
+    static const size_t minimumIncrementalHeadroom = 1 << 20;
+    // The pacer: a cycle starts once triggerRatio of the headroom is allocated, and each slice does
+    // the work left divided by the headroom left, per byte allocated since the last slice. The
+    // trigger moves so that the next cycle ends as the headroom runs out. A cycle that falls behind
+    // lets the heap grow past the headroom; it never stops the world to catch up.
+    struct IncrementalPacer {
+        double triggerRatio = 0.5;
+        size_t headroom = minimumIncrementalHeadroom;
+        // Marked by the last cycle
+        size_t liveBlocks = 0;
+        size_t liveBytes = 0;
+        // The running cycle: the roots as its mark phase began, scanned a few per slice
+        std::vector<void*> rootSnapshot;
+        size_t rootCursor = 0;
+        size_t estimatedWork = 0;
+        size_t workDone = 0;
+        // Units the last slices ran out of time for
+        size_t owedWork = 0;
+        size_t allocatedBytes = 0;
+        size_t markedBlocks = 0;
+        size_t markedBytes = 0;
+    };
+    IncrementalPacer pacer;
+    // Counts an allocation towards the pacer, and runs a slice once the thread has a quantum to report
+    void paceAllocation(size_t size);
+    void incrementalStep(size_t bytes);
+    // The remaining functions run with heapMutex and every arena lock held
+    void startIncrementalCycle();
+    // Advances the cycle until `work` units are done or the deadline passes; returns the units done
+    size_t runIncrementalWork(size_t work, std::chrono::steady_clock::time_point deadline);
+    void completeIncrementalMarking();
+    void endIncrementalCycle();
+    // Runs the rest of a cycle that has begun marking in one go. Collections that need complete
+    // marks, or move blocks, call it through finishLazySweep.
+    void finishIncrementalCycle();
+    void setIncrementalTrigger();
+
+    // Typed objects: the marker reads a typed block's Ref fields at its type's offsets. Untyped blocks
+    // keep the references SetPointer gives them here instead, by Block ID, guarded by referencesMutex.
+    std::unordered_map<int, std::vector<int>> untypedReferences;
+    std::mutex referencesMutex;
+    // Allocated block behind a Block ID, or nullptr
+    Block* resolve(int blockId);
+    template <typename Visit>
+    void forEachReference(Block& block, Visit visit);
+    // Forgets a freed block's references and type
+    void dropReferences(Block& block);
+    void* allocateObject(const TypeInfo& type, const void* object, int* blockId);
+    bool storeReference(int objectId, const TypeInfo& type, size_t offset, int targetId);
+    void addRoot(int blockId);
+    void removeRoot(int blockId);
+    // Drops one root handle of a typed block; the caller holds heapMutex
+    void releaseRootHandle(Block& block);
+    template <typename T>
+    friend class Root;
+
+    // Pinning: Get hands out an object's address only inside a Pinned, which holds a root handle on the
+    // object and counts it here. The nursery and compaction leave pinned objects where they are, so the
+    // address stays valid while other threads' allocations run collections. Guarded by heapMutex.
+    std::unordered_map<const Block*, size_t> pinnedObjects;
+    // Pins a live object of the type and returns its address, or nullptr
+    void* pinObject(int blockId, const TypeInfo& type);
+    void unpinObject(int blockId);
+    bool isPinned(const Block& block) const;
+    template <typename T>
+    friend class Pinned;
+
+    // Large-object space: a request of at least largeObjectThreshold bytes gets a page-aligned segment
+    // of its own, so big buffers never fragment the regular segments. A freed one keeps its addresses
+    // with its pages decommitted, for a later request of about its size, while the retained ones stay
+    // within maxRetainedLargeBytes. The segments are listed in largeSegments, guarded by heapMutex.
+    static const size_t defaultLargeObjectThreshold = 256 * 1024;
+    static const size_t largeObjectPageSize = 4096;
+    // With huge pages on, objects of hugePageObjectSize bytes and more are advised onto them and
+    // rounded up to whole huge pages
+    static const size_t hugePageSize = 2 * 1024 * 1024;
+    static const size_t hugePageObjectSize = 4 * 1024 * 1024;
+    static const size_t maxRetainedLargeBytes = 64 * 1024 * 1024;
+    std::atomic<size_t> largeObjectThreshold{ defaultLargeObjectThreshold };
+    std::atomic<bool> largeObjectHugePages{ false };
+    std::vector<size_t> largeSegments;
+    size_t retainedLargeBytes = 0;
+    bool isLargeObject(size_t size) const;
+    void* allocateLarge(size_t size, int* blockId, const TypeInfo* type, const void* object);
+    // Decommits a freed large object for reuse, or releases it past the retention limit
+    void releaseLarge(size_t segmentIndex);
+
+    // Regions: a region chains its segments through Segment::nextRegionSegment and hands them all
+    // back with one splice onto the pool, from which later regions take them. regionMutex guards
+    // the pool and is taken after heapMutex.
+    std::mutex regionMutex;
+    size_t regionPool = SIZE_MAX;
+    static const size_t regionSegmentCapacity = 64 * 1024;
+    // A spare region segment of at least `size` bytes or a new one, SIZE_MAX if none can be reserved
+    size_t acquireRegionSegment(size_t size);
+    // Puts the chain from `first` to `last` back into the pool
+    void returnRegionSegments(size_t first, size_t last);
+
+    // Snapshots: typed blocks of a loaded snapshot keep pointing at copies of their saved pointer maps,
+    // which a typed access accepts for the program's TypeInfo of the same name and layout. Root handles
+    // the snapshot restored wait in restoredRootHandles, by Block ID, until AdoptRestoredRoot takes them.
+    struct RestoredType {
+        std::string name;
+        std::vector<size_t> referenceOffsets;
+        TypeInfo info;
+        // The program's TypeInfo found to match, so the layouts are compared once
+        std::atomic<const TypeInfo*> matched{ nullptr };
+    };
+    std::vector<std::unique_ptr<RestoredType>> restoredTypes;
+    std::unordered_map<int, uint32_t> restoredRootHandles;
+    // True if the block holds a `type`, or a restored type with its layout
+    bool hasType(const Block& block, const TypeInfo& type);
+    bool adoptRestoredRoot(int blockId, const TypeInfo& type);
+    // Releases every segment and block and empties the lists, for LoadSnapshot; the world is stopped
+    void releaseContents();
+
+    // Statistics: counters kept on every path, read by GetStats without stopping the mutators
+    HeapStats stats;
 
 public:
+    struct MarkStats {
+        size_t threads = 0;
+        size_t markedBlocks = 0;
+        // Blocks a worker took from another worker's deque
+        size_t stolenTasks = 0;
+        double milliseconds = 0;
+    };
+
+private:
+    MarkStats lastMarkStats;
+    // Phase reports written while the world is stopped, guarded by heapMutex. The public
+    // collection calls print them once they have released their locks.
+    std::ostringstream collectionLog;
+    void printCollectionLog();
+
+public:
+    struct ThreadCacheStats {
+        std::thread::id threadId;
+        size_t arena;
+        size_t allocationHits;
+        size_t allocationMisses;
+        size_t freeHits;
+        size_t freeMisses;
+        size_t remoteFrees;
+        size_t refills;
+        size_t drains;
+        size_t cachedBlocks;
+    };
+
+    // totalThreads sets the number of arenas (0 for one per core) and the collector's worker threads
     Heap(size_t initialHeapSize, size_t totalThreads, size_t segmentsCount, size_t blocksPerSegment);
     ~Heap();
 
-    void* Allocate(size_t size, const std::string& strategy = "First-Fit");
-    void Deallocate(int blockId);
+    // FitPolicy is one of FirstFit, NextFit, BestFit and WorstFit (FitPolicies.h)
+    // blockId, if given, receives the new block's Block ID for Deallocate and SetPointer
+    template <typename FitPolicy>
+    void* Allocate(size_t size, int* blockId = nullptr);
+    // Runtime selection by strategy name for the interactive menu, including "Buddy"; unknown names use First-Fit
+    void* Allocate(size_t size, const std::string& strategy = "First-Fit", int* blockId = nullptr);
+    // False if the Block ID is unknown, stale or already deallocated. Any thread may free a block, but not while
+    // another thread is still using or freeing the same Block ID
+    bool Deallocate(int blockId);
+    // Allocate `count` blocks under one arena lock, carving consecutive ones out of the same free block
+    // where it fits and rooting them in bulk; the nursery is not used. memory[i] and blockIds[i], if given,
+    // receive nullptr and -1 where a request fails. Returns the blocks allocated.
+    template <typename FitPolicy>
+    size_t AllocateBatch(const size_t* sizes, size_t count, void** memory, int* blockIds = nullptr);
+    // Deallocate each Block ID, locking every arena involved once. Returns the blocks freed; the others
+    // are reported as Deallocate does.
+    size_t DeallocateBatch(const int* blockIds, size_t count);
+    // Block ID of the allocated block at this address, or -1
+    int GetBlockId(const void* memory);
+    // Address of the allocated block with this Block ID, or nullptr; how a loaded snapshot's untyped
+    // blocks are found again
+    void* GetBlockMemory(int blockId);
     void CollectGarbage();
-    static int blockCounter;
+    // Statistics of the most recent mark phase
+    MarkStats GetLastMarkStats();
+    // Leave sweeping to Allocate instead of the collection pause
+    void SetLazySweep(bool enabled);
     void CheckMemory();
-    void freeMemory(Block& block);
-    // Measure and output allocation permeability on specific threads
-    void MeasureAllocationPermeabilitySelective(size_t totalThreads);
-    // Measure and output deallocation permeability on specific threads
-    void MeasureDeallocationPermeabilitySelective(size_t totalThreads);
+
+    // Thread cache tunables: blocks kept per size class (0 disables the caches) and blocks moved per refill
+    void SetThreadCacheLimits(size_t depth, size_t batchSize);
+    std::vector<ThreadCacheStats> GetThreadCacheStats();
+    void PrintThreadCacheStats();
+    // Allocation, fit, GC pause and profiling counters, taken without locking the heap
+    HeapStats::Snapshot GetStats();
+    // The NUMA topology the heap was created with (see SimulateNumaTopology), its arenas by node and the per-node counters
+    void PrintNumaStats();
+    // Samples about one allocation per `bytesPerSample` bytes by its HEAP_ALLOCATION_SITE(); 0 stops sampling
+    void SetAllocationSampling(size_t bytesPerSample);
+
+    // Stores a reference from one untyped block to another in reference slot `slot`,
+    // growing the slot list as needed. A targetBlockId of -1 clears the slot.
+    bool SetPointer(int sourceBlockId, size_t slot, int targetBlockId);
+
+    // Typed objects (HeapObjects.h). New copies a T built from the arguments into the heap and
+    // returns a root that keeps it alive; it is collected once no root or reachable Ref is left.
+    // An empty root means the allocation failed.
+    template <typename T, typename... Args>
+    Root<T> New(Args&&... args);
+    // Address of a live object, null if there is none. Collections neither move nor free the object
+    // while the Pinned exists, so keep it only as long as the address is used.
+    template <typename T>
+    Pinned<T> Get(Ref<T> object);
+    // Writes a Ref field of a live object through the collector's write barriers
+    template <typename T, typename U>
+    bool Store(Ref<T> object, Ref<U> T::* field, Ref<U> value);
 
     // New methods for advanced garbage collection
     void RunGenerationalGC();
+    // Number of minor collections a block survives before promotion (at least 1)
+    void SetPromotionAge(int age);
+    // Bump-allocate typed objects up to 1 KiB in a nursery of this many bytes (0 disables it)
+    void SetNursery(size_t capacity);
+    // Fragmentation (0 to 1) at which an old-generation collection compacts; above 1 disables compaction
+    void SetCompactionThreshold(double threshold);
+    // Bytes of all segments currently reserved from the OS
+    size_t GetReservedBytes();
+    // Share of free bytes outside the largest free block, the nursery and large objects aside
+    double GetFragmentation();
     void RunConcurrentMarkAndSweep();
+    // Blocks until the running concurrent cycle, if any, has finished
+    void WaitForConcurrentGC();
+    // Collect incrementally from Allocate: allocation volume starts a cycle, and allocating threads
+    // run its slices. Disabling finishes the running cycle.
+    void SetIncrementalGC(bool enabled);
+    // Budget of one incremental slice: wall time and work units (0 for no limit on either)
+    void SetIncrementalBudget(uint64_t microseconds, size_t workUnits);
+
+    // Scratch memory that dies all at once. A region bump-allocates from segments of its own that are
+    // never rooted, traced or swept, and gives them back to the heap in O(1) when it ends. A nested
+    // region continues where its parent stands and gives back only what it added; the parent cannot
+    // allocate until it ends. A region belongs to one thread, must not outlive its heap, and what it
+    // holds does not keep heap blocks alive.
+    class Region {
+    public:
+        explicit Region(Heap& heap);
+        explicit Region(Region& parent);
+        ~Region();
+        Region(const Region&) = delete;
+        Region& operator=(const Region&) = delete;
+
+        // Aligned like heap blocks; nullptr if no segment can be reserved or a nested region is active
+        void* Allocate(size_t size);
+        // Bytes handed out by this region, not counting its parent's
+        size_t UsedBytes() const { return usedBytes; }
+
+    private:
+        Heap& heap;
+        Region* parent;
+        Region* child = nullptr;
+        // The region's own first segment, unless it continues its parent's last one
+        size_t first = SIZE_MAX;
+        size_t current = SIZE_MAX;
+        size_t offset = 0;
+        size_t usedBytes = 0;
+        size_t addedSegments = 0;
+    };
+    // Returns the spare region segments to the OS
+    void TrimRegionSegments();
+    // Requests of at least `threshold` bytes get a mapping of their own, 0 turns this off. With
+    // hugePages, those of several MiB are advised onto transparent huge pages.
+    void SetLargeObjectSpace(size_t threshold, bool hugePages);
+
+    // Writes the heap's segments, blocks, root set, generation lists and references to a file, with the
+    // world stopped. Block IDs and offsets are saved rather than addresses, and regions are left out.
+    bool SaveSnapshot(const std::string& path);
+    // Replaces the heap's contents with a snapshot, mapping its segments copy-on-write so pages are read
+    // as they are touched; verifyData checks each segment's checksum, which reads them all. Block IDs are
+    // those saved; earlier Block IDs, addresses and roots are void, and no Region may be active. A damaged
+    // or foreign file is reported and leaves the heap as it was.
+    bool LoadSnapshot(const std::string& path, bool verifyData = false);
+    // A root for a typed object that was rooted when its snapshot was saved, taking over one of the root
+    // handles restored for it; empty once they are all taken or if the object is not a T
+    template <typename T>
+    Root<T> AdoptRestoredRoot(int blockId);
+};
+
+template <>
+void* Heap::Allocate<BuddySystem>(size_t size, int* blockId);
+template <>
+size_t Heap::AllocateBatch<BuddySystem>(const size_t* sizes, size_t count, void** memory, int* blockIds);
+
+// Keeps a typed object alive while it exists; copies add further roots. A root must not
+// outlive its heap.
+template <typename T>
+class Root {
+public:
+    Root() : heap(nullptr) {}
+    Root(Heap& heap, Ref<T> object) : heap(&heap), object(object) {
+        if (!object.IsNull()) heap.addRoot(object.BlockId());
+    }
+    Root(const Root& other) : heap(other.heap), object(other.object) {
+        if (heap && !object.IsNull()) heap->addRoot(object.BlockId());
+    }
+    Root(Root&& other) : heap(other.heap), object(other.object) {
+        other.object = Ref<T>();
+    }
+    Root& operator=(Root other) {
+        std::swap(heap, other.heap);
+        std::swap(object, other.object);
+        return *this;
+    }
+    ~Root() {
+        if (heap && !object.IsNull()) heap->removeRoot(object.BlockId());
+    }
+
+    Ref<T> Get() const { return object; }
+    operator Ref<T>() const { return object; }
+    bool IsNull() const { return object.IsNull(); }
+    // Member access, with the object pinned until the end of the full expression
+    Pinned<T> operator->() const { return heap->Get(object); }
+
+private:
+    struct Adopt {};
+    // Takes over the root the allocation already counted
+    Root(Heap& heap, Ref<T> object, Adopt) : heap(&heap), object(object) {}
+    friend class Heap;
+
+    Heap* heap;
+    Ref<T> object;
 };
 
+// Address of a typed object from Heap::Get. The object stays where it is and stays alive while
+// the Pinned exists; moving one hands the pin over. A Pinned must not outlive its heap.
+template <typename T>
+class Pinned {
+public:
+    Pinned() : heap(nullptr), blockId(-1), object(nullptr) {}
+    Pinned(Pinned&& other) : heap(other.heap), blockId(other.blockId), object(other.object) {
+        other.object = nullptr;
+    }
+    Pinned& operator=(Pinned other) {
+        std::swap(heap, other.heap);
+        std::swap(blockId, other.blockId);
+        std::swap(object, other.object);
+        return *this;
+    }
+    Pinned(const Pinned&) = delete;
+    ~Pinned() {
+        if (object) heap->unpinObject(blockId);
+    }
+
+    T* Get() const { return object; }
+    T* operator->() const { return object; }
+    T& operator*() const { return *object; }
+    bool IsNull() const { return object == nullptr; }
+
+private:
+    Pinned(Heap& heap, int blockId, T* object) : heap(&heap), blockId(blockId), object(object) {}
+    friend class Heap;
+
+    Heap* heap;
+    int blockId;
+    T* object;
+};
+
+template <typename T, typename... Args>
+Root<T> Heap::New(Args&&... args) {
+    static_assert(std::is_trivially_copyable<T>::value, "Heap objects are copied into the heap and moved by memcpy");
+    static_assert(alignof(T) <= blockAlignment, "Heap objects are aligned to blockAlignment");
+    T object(std::forward<Args>(args)...);
+    int blockId = -1;
+    if (!allocateObject(TypeLayout<T>::Info(), &object, &blockId)) {
+        return Root<T>();
+    }
+    return Root<T>(*this, Ref<T>(blockId), typename Root<T>::Adopt());
+}
+
+template <typename T>
+Root<T> Heap::AdoptRestoredRoot(int blockId) {
+    if (!adoptRestoredRoot(blockId, TypeLayout<T>::Info())) {
+        return Root<T>();
+    }
+    return Root<T>(*this, Ref<T>(blockId), typename Root<T>::Adopt());
+}
+
+template <typename T>
+Pinned<T> Heap::Get(Ref<T> object) {
+    T* address = static_cast<T*>(pinObject(object.BlockId(), TypeLayout<T>::Info()));
+    return Pinned<T>(*this, object.BlockId(), address);
+}
+
+template <typename T, typename U>
+bool Heap::Store(Ref<T> object, Ref<U> T::* field, Ref<U> value) {
+    // The field's offset, taken from storage that never holds a T
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    const T* probe = reinterpret_cast<const T*>(&storage);
+    size_t offset = static_cast<size_t>(reinterpret_cast<const char*>(&(probe->*field)) - reinterpret_cast<const char*>(probe));
+    return storeReference(object.BlockId(), TypeLayout<T>::Info(), offset, value.BlockId());
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+
+
+// Typed objects for Heap::New. A type's references to other heap objects are Ref<T> fields
+// listed once with HEAP_TYPE, which records their offsets at compile time. The collector
+// reads exactly those fields of an object's payload and nothing else.
+//
+//     struct Node {
+//         Ref<Node> next;
+//         Ref<Node> child;
+//         int value;
+//     };
+//     HEAP_TYPE(Node, HEAP_REFERENCE(Node, next), HEAP_REFERENCE(Node, child));
+//
+// HEAP_TYPE goes at global scope. Objects are copied into the heap and freed without running
+// a destructor, so the type must be standard-layout and trivially copyable.
+
+class Heap;
+
+// A reference field: the Block ID of the referenced object, or -1. Block IDs follow an object
+// when compaction or the nursery moves it, so fields never need rewriting. Writes go through
+// Heap::Store, which runs the collector's barriers. A Ref alone does not keep its object
+// alive, a Root<T> does.
+template <typename T>
+class Ref {
+public:
+    Ref() : blockId(-1) {}
+
+    int BlockId() const { return blockId; }
+    bool IsNull() const { return blockId < 0; }
+    bool operator==(const Ref& other) const { return blockId == other.blockId; }
+    bool operator!=(const Ref& other) const { return blockId != other.blockId; }
+
+private:
+    explicit Ref(int blockId) : blockId(blockId) {}
+    friend class Heap;
+
+    int blockId;
+};
+
+// Pointer map of a type: where its Ref fields sit in the payload
+struct TypeInfo {
+    const char* name;
+    size_t size;
+    const size_t* referenceOffsets;
+    size_t referenceCount;
+};
+
+// Specialized by HEAP_TYPE and HEAP_LEAF_TYPE; New<T> does not compile for other types
+template <typename T>
+struct TypeLayout;
+
+template <typename Field>
+struct IsRef : std::false_type {};
+
+template <typename T>
+struct IsRef<Ref<T>> : std::true_type {};
+
+template <typename Type, typename Field>
+constexpr size_t referenceOffset(size_t offset) {
+    static_assert(std::is_standard_layout<Type>::value, "Heap object types must be standard-layout");
+    static_assert(IsRef<Field>::value, "HEAP_REFERENCE only lists Ref<T> fields");
+    return offset;
+}
+
+#define HEAP_REFERENCE(Type, field) referenceOffset<Type, decltype(Type::field)>(offsetof(Type, field))
+
+#define HEAP_TYPE(Type, ...) \
+    template <> \
+    struct TypeLayout<Type> { \
+        static const TypeInfo& Info() { \
+            static const size_t offsets[] = { __VA_ARGS__ }; \
+            static const TypeInfo info = { #Type, sizeof(Type), offsets, sizeof(offsets) / sizeof(offsets[0]) }; \
+            return info; \
+        } \
+    }
+
+// A type without references, which the marker does not scan
+#define HEAP_LEAF_TYPE(Type) \
+    template <> \
+    struct TypeLayout<Type> { \
+        static const TypeInfo& Info() { \
+            static const TypeInfo info = { #Type, sizeof(Type), nullptr, 0 }; \
+            return info; \
+        } \
+    }
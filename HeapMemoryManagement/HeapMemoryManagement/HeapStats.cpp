@@ -0,0 +1,366 @@
+#include "HeapStats.h"
+#include "BitOps.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+
+namespace {
+
+    thread_local const AllocationSite* currentSite = nullptr;
+    // Bytes the calling thread still requests before its next sample, shared by all heaps
+    thread_local size_t bytesUntilSample = 0;
+
+    const char* const pauseKindNames[] = { "full", "generational", "concurrentSlice", "incrementalSlice" };
+
+    void writeString(std::ostringstream& out, const std::string& text) {
+        out << '"';
+        for (char c : text) {
+            switch (c) {
+            case '"': out << "\\\""; break;
+            case '\\': out << "\\\\"; break;
+            case '\n': out << "\\n"; break;
+            case '\t': out << "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+                    out << escaped;
+                }
+                else {
+                    out << c;
+                }
+            }
+        }
+        out << '"';
+    }
+
+    void writeArray(std::ostringstream& out, const uint64_t* values, size_t count) {
+        out << '[';
+        for (size_t i = 0; i < count; ++i) {
+            out << (i > 0 ? "," : "") << values[i];
+        }
+        out << ']';
+    }
+
+    void raiseMaximum(std::atomic<uint64_t>& maximum, uint64_t value) {
+        uint64_t current = maximum.load(std::memory_order_relaxed);
+        while (current < value && !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+        }
+    }
+
+}
+
+AllocationSiteScope::AllocationSiteScope(const AllocationSite& site) : previous(currentSite) {
+    currentSite = &site;
+}
+
+AllocationSiteScope::~AllocationSiteScope() {
+    currentSite = previous;
+}
+
+const AllocationSite* AllocationSiteScope::Current() {
+    return currentSite;
+}
+
+const size_t HeapStats::sizeClassCount;
+const size_t HeapStats::pauseBucketCount;
+
+size_t HeapStats::SizeClassOf(size_t size) {
+    if (size <= 16) return 0;
+    size_t sizeClass = highestSetBit(static_cast<uint64_t>(size - 1)) - 3;
+    return std::min(sizeClass, sizeClassCount - 1);
+}
+
+size_t HeapStats::SizeClassLimit(size_t sizeClass) {
+    return sizeClass + 1 < sizeClassCount ? size_t(16) << sizeClass : SIZE_MAX;
+}
+
+size_t HeapStats::PauseBucketOf(uint64_t microseconds) {
+    if (microseconds == 0) return 0;
+    size_t bucket = highestSetBit(microseconds) + 1;
+    return std::min(bucket, pauseBucketCount - 1);
+}
+
+HeapStats::Shard::Shard() {
+    for (size_t i = 0; i < sizeClassCount; ++i) {
+        allocations[i] = 0;
+        frees[i] = 0;
+    }
+}
+
+HeapStats::HeapStats(size_t arenaCount, size_t nodeCount, size_t blockHeaderBytes)
+    : shardCount(arenaCount + 1), shards(new Shard[arenaCount + 1]), shardNodes(arenaCount, 0),
+    nodeCount(std::max<size_t>(nodeCount, 1)), nodes(new NodeCounters[std::max<size_t>(nodeCount, 1)]), blockHeaderBytes(blockHeaderBytes) {
+    RecordFragmentation(-1.0);
+    for (size_t kind = 0; kind < static_cast<size_t>(PauseKind::Count); ++kind) {
+        for (size_t bucket = 0; bucket < pauseBucketCount; ++bucket) {
+            pauses[kind][bucket] = 0;
+        }
+        pauseMicroseconds[kind] = 0;
+        maxPauseMicroseconds[kind] = 0;
+    }
+}
+
+void HeapStats::SetShardNode(size_t shard, size_t node) {
+    if (shard < shardNodes.size()) {
+        shardNodes[shard] = node < nodeCount ? node : 0;
+    }
+}
+
+void HeapStats::RecordAllocation(size_t shard, size_t size, size_t blockSize) {
+    Shard& counters = shardAt(shard);
+    counters.allocations[SizeClassOf(blockSize)].fetch_add(1, std::memory_order_relaxed);
+    counters.requestedBytes.fetch_add(size, std::memory_order_relaxed);
+    counters.allocatedBytes.fetch_add(blockSize, std::memory_order_relaxed);
+    if (samplingPeriod.load(std::memory_order_relaxed) != 0) {
+        sample(size);
+    }
+}
+
+void HeapStats::RecordFree(size_t shard, size_t blockSize) {
+    Shard& counters = shardAt(shard);
+    counters.frees[SizeClassOf(blockSize)].fetch_add(1, std::memory_order_relaxed);
+    counters.freedBytes.fetch_add(blockSize, std::memory_order_relaxed);
+}
+
+void HeapStats::RecordCollected(size_t blocks, size_t bytes) {
+    collectedBlocks.fetch_add(blocks, std::memory_order_relaxed);
+    collectedBytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void HeapStats::RecordFitSearch(size_t shard, size_t size, size_t selectedSize) {
+    Shard& counters = shardAt(shard);
+    counters.fitSearches.fetch_add(1, std::memory_order_relaxed);
+    counters.fitSlackBytes.fetch_add(selectedSize - size, std::memory_order_relaxed);
+}
+
+void HeapStats::RecordFitMiss(size_t shard) {
+    Shard& counters = shardAt(shard);
+    counters.fitSearches.fetch_add(1, std::memory_order_relaxed);
+    counters.fitMisses.fetch_add(1, std::memory_order_relaxed);
+}
+
+void HeapStats::RecordSegmentReserved(size_t node, size_t capacity, size_t bitmapBytes, size_t blockIndexBytes) {
+    reservedBytes.fetch_add(capacity, std::memory_order_relaxed);
+    reservedSegments.fetch_add(1, std::memory_order_relaxed);
+    nodeAt(node).reservedBytes.fetch_add(capacity, std::memory_order_relaxed);
+    nodeAt(node).reservedSegments.fetch_add(1, std::memory_order_relaxed);
+    this->bitmapBytes.fetch_add(bitmapBytes, std::memory_order_relaxed);
+    this->blockIndexBytes.fetch_add(blockIndexBytes, std::memory_order_relaxed);
+}
+
+void HeapStats::RecordSegmentReleased(size_t node, size_t capacity, size_t bitmapBytes, size_t blockIndexBytes) {
+    reservedBytes.fetch_sub(capacity, std::memory_order_relaxed);
+    reservedSegments.fetch_sub(1, std::memory_order_relaxed);
+    nodeAt(node).reservedBytes.fetch_sub(capacity, std::memory_order_relaxed);
+    nodeAt(node).reservedSegments.fetch_sub(1, std::memory_order_relaxed);
+    this->bitmapBytes.fetch_sub(bitmapBytes, std::memory_order_relaxed);
+    this->blockIndexBytes.fetch_sub(blockIndexBytes, std::memory_order_relaxed);
+}
+
+void HeapStats::RecordBlockCreated() {
+    blocks.fetch_add(1, std::memory_order_relaxed);
+}
+
+void HeapStats::RecordBlockRetired() {
+    blocks.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void HeapStats::RecordPause(PauseKind kind, uint64_t microseconds) {
+    size_t index = static_cast<size_t>(kind);
+    pauses[index][PauseBucketOf(microseconds)].fetch_add(1, std::memory_order_relaxed);
+    pauseMicroseconds[index].fetch_add(microseconds, std::memory_order_relaxed);
+    raiseMaximum(maxPauseMicroseconds[index], microseconds);
+}
+
+void HeapStats::RecordFragmentation(double fragmentation) {
+    uint64_t bits;
+    std::memcpy(&bits, &fragmentation, sizeof(bits));
+    fragmentationBits.store(bits, std::memory_order_relaxed);
+}
+
+void HeapStats::RecordMinorCollection() {
+    minorCollections.fetch_add(1, std::memory_order_relaxed);
+}
+
+void HeapStats::RecordIncrementalCycle() {
+    incrementalCycles.fetch_add(1, std::memory_order_relaxed);
+}
+
+void HeapStats::RecordPromotions(size_t blocks) {
+    promotions.fetch_add(blocks, std::memory_order_relaxed);
+}
+
+void HeapStats::SetSamplingPeriod(size_t bytes) {
+    samplingPeriod.store(bytes, std::memory_order_relaxed);
+}
+
+void HeapStats::sample(size_t size) {
+    // Each sample stands for the period's worth of bytes, or for itself if it is larger
+    size_t period = samplingPeriod.load(std::memory_order_relaxed);
+    if (bytesUntilSample > size) {
+        bytesUntilSample -= size;
+        return;
+    }
+    bytesUntilSample = period;
+
+    std::lock_guard<std::mutex> lock(profileMutex);
+    SiteCounters& counters = sites[AllocationSiteScope::Current()];
+    ++counters.samples;
+    counters.sampledBytes += size;
+    counters.estimatedBytes += std::max(size, period);
+}
+
+HeapStats::Snapshot HeapStats::Take() const {
+    Snapshot snapshot = {};
+    snapshot.nodes.assign(nodeCount, NodeStats());
+    for (size_t i = 0; i < shardCount; ++i) {
+        const Shard& counters = shards[i];
+        uint64_t allocations = 0;
+        uint64_t frees = 0;
+        for (size_t sizeClass = 0; sizeClass < sizeClassCount; ++sizeClass) {
+            uint64_t classAllocations = counters.allocations[sizeClass].load(std::memory_order_relaxed);
+            uint64_t classFrees = counters.frees[sizeClass].load(std::memory_order_relaxed);
+            snapshot.allocations[sizeClass] += classAllocations;
+            snapshot.frees[sizeClass] += classFrees;
+            allocations += classAllocations;
+            frees += classFrees;
+        }
+        uint64_t allocatedBytes = counters.allocatedBytes.load(std::memory_order_relaxed);
+        uint64_t freedBytes = counters.freedBytes.load(std::memory_order_relaxed);
+        snapshot.requestedBytes += counters.requestedBytes.load(std::memory_order_relaxed);
+        snapshot.allocatedBytes += allocatedBytes;
+        snapshot.freedBytes += freedBytes;
+        if (i < shardNodes.size()) {
+            NodeStats& node = snapshot.nodes[shardNodes[i]];
+            node.allocations += allocations;
+            node.frees += frees;
+            node.allocatedBytes += allocatedBytes;
+            node.freedBytes += freedBytes;
+        }
+        snapshot.fitSearches += counters.fitSearches.load(std::memory_order_relaxed);
+        snapshot.fitMisses += counters.fitMisses.load(std::memory_order_relaxed);
+        snapshot.fitSlackBytes += counters.fitSlackBytes.load(std::memory_order_relaxed);
+    }
+    for (size_t sizeClass = 0; sizeClass < sizeClassCount; ++sizeClass) {
+        snapshot.totalAllocations += snapshot.allocations[sizeClass];
+        snapshot.totalFrees += snapshot.frees[sizeClass];
+    }
+
+    snapshot.collectedBlocks = collectedBlocks.load(std::memory_order_relaxed);
+    snapshot.collectedBytes = collectedBytes.load(std::memory_order_relaxed);
+    // Shards are read one after another, so a free may be seen without its allocation
+    uint64_t released = snapshot.freedBytes + snapshot.collectedBytes;
+    snapshot.liveBytes = snapshot.allocatedBytes > released ? snapshot.allocatedBytes - released : 0;
+    snapshot.reservedBytes = reservedBytes.load(std::memory_order_relaxed);
+    snapshot.reservedSegments = reservedSegments.load(std::memory_order_relaxed);
+    for (size_t node = 0; node < nodeCount; ++node) {
+        snapshot.nodes[node].reservedBytes = nodes[node].reservedBytes.load(std::memory_order_relaxed);
+        snapshot.nodes[node].reservedSegments = nodes[node].reservedSegments.load(std::memory_order_relaxed);
+    }
+    snapshot.blocks = blocks.load(std::memory_order_relaxed);
+    snapshot.blockHeaderBytes = blockHeaderBytes;
+    snapshot.blockIndexBytes = blockIndexBytes.load(std::memory_order_relaxed);
+    snapshot.bitmapBytes = bitmapBytes.load(std::memory_order_relaxed);
+    snapshot.handleTableBytes = 0;
+    snapshot.metadataBytes = snapshot.blocks * snapshot.blockHeaderBytes + snapshot.blockIndexBytes + snapshot.bitmapBytes;
+    uint64_t bits = fragmentationBits.load(std::memory_order_relaxed);
+    std::memcpy(&snapshot.fragmentation, &bits, sizeof(bits));
+
+    for (size_t kind = 0; kind < static_cast<size_t>(PauseKind::Count); ++kind) {
+        for (size_t bucket = 0; bucket < pauseBucketCount; ++bucket) {
+            snapshot.pauses[kind][bucket] = pauses[kind][bucket].load(std::memory_order_relaxed);
+            snapshot.pauseCount[kind] += snapshot.pauses[kind][bucket];
+        }
+        snapshot.pauseMicroseconds[kind] = pauseMicroseconds[kind].load(std::memory_order_relaxed);
+        snapshot.maxPauseMicroseconds[kind] = maxPauseMicroseconds[kind].load(std::memory_order_relaxed);
+    }
+    snapshot.minorCollections = minorCollections.load(std::memory_order_relaxed);
+    snapshot.incrementalCycles = incrementalCycles.load(std::memory_order_relaxed);
+    snapshot.promotions = promotions.load(std::memory_order_relaxed);
+    snapshot.samplingPeriod = samplingPeriod.load(std::memory_order_relaxed);
+
+    {
+        std::lock_guard<std::mutex> lock(profileMutex);
+        for (const auto& entry : sites) {
+            SiteStats site = {};
+            site.file = entry.first ? entry.first->file : "unknown";
+            site.line = entry.first ? entry.first->line : 0;
+            site.function = entry.first ? entry.first->function : "unknown";
+            site.samples = entry.second.samples;
+            site.sampledBytes = entry.second.sampledBytes;
+            site.estimatedBytes = entry.second.estimatedBytes;
+            snapshot.sites.push_back(site);
+        }
+    }
+    std::sort(snapshot.sites.begin(), snapshot.sites.end(), [](const SiteStats& a, const SiteStats& b) {
+        return a.estimatedBytes > b.estimatedBytes;
+        });
+    return snapshot;
+}
+
+std::string HeapStats::Snapshot::ToJson() const {
+    std::ostringstream out;
+    out << "{\"allocations\":{\"total\":" << totalAllocations << ",\"bySizeClass\":";
+    writeArray(out, allocations, sizeClassCount);
+    out << "},\"frees\":{\"total\":" << totalFrees << ",\"bySizeClass\":";
+    writeArray(out, frees, sizeClassCount);
+    out << "},\"sizeClassLimits\":[";
+    for (size_t sizeClass = 0; sizeClass + 1 < sizeClassCount; ++sizeClass) {
+        out << (sizeClass > 0 ? "," : "") << SizeClassLimit(sizeClass);
+    }
+    out << ",null]";
+
+    out << ",\"bytes\":{\"requested\":" << requestedBytes << ",\"allocated\":" << allocatedBytes << ",\"freed\":" << freedBytes
+        << ",\"collected\":" << collectedBytes << ",\"live\":" << liveBytes
+        << ",\"reserved\":" << reservedBytes << "},\"segments\":" << reservedSegments
+        << ",\"collectedBlocks\":" << collectedBlocks << ",\"fragmentation\":";
+    if (fragmentation < 0) out << "null";
+    else out << fragmentation;
+
+    out << ",\"metadata\":{\"blocks\":" << blocks << ",\"blockHeaderBytes\":" << blockHeaderBytes
+        << ",\"blockIndexBytes\":" << blockIndexBytes << ",\"bitmapBytes\":" << bitmapBytes
+        << ",\"handleTableBytes\":" << handleTableBytes << ",\"totalBytes\":" << metadataBytes << "}";
+
+    out << ",\"fit\":{\"searches\":" << fitSearches << ",\"misses\":" << fitMisses
+        << ",\"slackBytes\":" << fitSlackBytes << "}";
+
+    out << ",\"pauses\":{\"bucketLimitsMicroseconds\":[";
+    for (size_t bucket = 0; bucket + 1 < pauseBucketCount; ++bucket) {
+        out << (bucket > 0 ? "," : "") << (uint64_t(1) << bucket);
+    }
+    out << ",null]";
+    for (size_t kind = 0; kind < static_cast<size_t>(PauseKind::Count); ++kind) {
+        out << ",\"" << pauseKindNames[kind] << "\":{\"count\":" << pauseCount[kind]
+            << ",\"totalMicroseconds\":" << pauseMicroseconds[kind]
+            << ",\"maxMicroseconds\":" << maxPauseMicroseconds[kind] << ",\"histogram\":";
+        writeArray(out, pauses[kind], pauseBucketCount);
+        out << "}";
+    }
+    out << "},\"minorCollections\":" << minorCollections << ",\"promotions\":" << promotions
+        << ",\"incrementalCycles\":" << incrementalCycles;
+
+    out << ",\"nodes\":[";
+    for (size_t node = 0; node < nodes.size(); ++node) {
+        const NodeStats& counters = nodes[node];
+        out << (node > 0 ? "," : "") << "{\"allocations\":" << counters.allocations << ",\"frees\":" << counters.frees
+            << ",\"allocatedBytes\":" << counters.allocatedBytes << ",\"freedBytes\":" << counters.freedBytes
+            << ",\"reservedBytes\":" << counters.reservedBytes << ",\"segments\":" << counters.reservedSegments << "}";
+    }
+    out << "]";
+
+    out << ",\"profile\":{\"samplingPeriod\":" << samplingPeriod << ",\"sites\":[";
+    for (size_t i = 0; i < sites.size(); ++i) {
+        const SiteStats& site = sites[i];
+        out << (i > 0 ? "," : "") << "{\"file\":";
+        writeString(out, site.file);
+        out << ",\"line\":" << site.line << ",\"function\":";
+        writeString(out, site.function);
+        out << ",\"samples\":" << site.samples << ",\"sampledBytes\":" << site.sampledBytes
+            << ",\"estimatedBytes\":" << site.estimatedBytes << "}";
+    }
+    out << "]}}";
+    return out.str();
+}
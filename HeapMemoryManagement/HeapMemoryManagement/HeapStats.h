@@ -0,0 +1,213 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+// Where an allocation was made, for sampled allocation-site profiling. HEAP_ALLOCATION_SITE()
+// declares one for the enclosing scope; allocations outside any scope count as an unknown site.
+struct AllocationSite {
+    const char* file;
+    int line;
+    const char* function;
+};
+
+// Makes `site` the calling thread's current allocation site until the scope ends
+class AllocationSiteScope {
+public:
+    explicit AllocationSiteScope(const AllocationSite& site);
+    ~AllocationSiteScope();
+    AllocationSiteScope(const AllocationSiteScope&) = delete;
+    AllocationSiteScope& operator=(const AllocationSiteScope&) = delete;
+
+    // The innermost site of the calling thread, or nullptr
+    static const AllocationSite* Current();
+
+private:
+    const AllocationSite* previous;
+};
+
+#define HEAP_ALLOCATION_SITE() \
+    static const AllocationSite heapAllocationSite = { __FILE__, __LINE__, __func__ }; \
+    AllocationSiteScope heapAllocationSiteScope(heapAllocationSite)
+
+enum class PauseKind {
+    Full,               // CollectGarbage
+    Generational,       // RunGenerationalGC and minor collections started by a full nursery
+    ConcurrentSlice,    // one slice of the concurrent collector
+    IncrementalSlice,   // one slice of an incremental collection, run by Allocate
+    Count
+};
+
+// Always-on heap counters. They are relaxed atomics split into one shard per arena (plus one
+// for the nursery and buddy paths), so threads of different arenas write different cache lines.
+// A snapshot sums the shards without taking any heap lock: mutators keep running, and the
+// totals may trail operations that are in flight while it is taken.
+class HeapStats {
+public:
+    // Size class c counts blocks of up to 16 << c bytes, the last class everything larger
+    static const size_t sizeClassCount = 24;
+    // Pause bucket b counts pauses under 1 << b microseconds, the last bucket everything longer
+    static const size_t pauseBucketCount = 24;
+
+    static size_t SizeClassOf(size_t size);
+    static size_t SizeClassLimit(size_t sizeClass);
+    static size_t PauseBucketOf(uint64_t microseconds);
+
+    struct SiteStats {
+        std::string file;
+        int line;
+        std::string function;
+        uint64_t samples;
+        uint64_t sampledBytes;
+        // Bytes the site allocated while sampling was on, extrapolated from its samples
+        uint64_t estimatedBytes;
+    };
+
+    // Arena shards of one NUMA node, and the segments placed on it
+    struct NodeStats {
+        uint64_t allocations;
+        uint64_t frees;
+        uint64_t allocatedBytes;
+        uint64_t freedBytes;
+        uint64_t reservedBytes;
+        uint64_t reservedSegments;
+    };
+
+    struct Snapshot {
+        uint64_t allocations[sizeClassCount];
+        uint64_t frees[sizeClassCount];
+        uint64_t totalAllocations;
+        uint64_t totalFrees;
+        // Bytes requested from Allocate and New; block sizes round them up to the alignment
+        uint64_t requestedBytes;
+        // Block bytes handed out, returned by Deallocate, and reclaimed by the collector
+        uint64_t allocatedBytes;
+        uint64_t freedBytes;
+        uint64_t collectedBlocks;
+        uint64_t collectedBytes;
+        uint64_t liveBytes;
+        uint64_t reservedBytes;
+        uint64_t reservedSegments;
+        // Heap metadata: one header per block, free or allocated, the segments' block directories
+        // and bitmaps, and the handle table's slots
+        uint64_t blocks;
+        uint64_t blockHeaderBytes;
+        uint64_t blockIndexBytes;
+        uint64_t bitmapBytes;
+        uint64_t handleTableBytes;
+        uint64_t metadataBytes;
+        // As of the last stop-the-world collection that swept, -1 before the first one
+        double fragmentation;
+        // Free index lookups and the ones that found nothing. Slack is what the selected blocks exceeded
+        // the requests by before splitting, the quantity Best-Fit keeps small.
+        uint64_t fitSearches;
+        uint64_t fitMisses;
+        uint64_t fitSlackBytes;
+        uint64_t pauses[static_cast<size_t>(PauseKind::Count)][pauseBucketCount];
+        uint64_t pauseCount[static_cast<size_t>(PauseKind::Count)];
+        uint64_t pauseMicroseconds[static_cast<size_t>(PauseKind::Count)];
+        uint64_t maxPauseMicroseconds[static_cast<size_t>(PauseKind::Count)];
+        uint64_t minorCollections;
+        uint64_t incrementalCycles;
+        uint64_t promotions;
+        // Bytes between samples, 0 when allocation-site sampling is off
+        uint64_t samplingPeriod;
+        // Most allocated first
+        std::vector<SiteStats> sites;
+        // By node; the shared shard's allocations and frees belong to no node
+        std::vector<NodeStats> nodes;
+
+        std::string ToJson() const;
+    };
+
+    // Shard indexes past the last arena, such as Heap::noArena, use the shared shard.
+    // Arena shards start on node 0 until SetShardNode places them.
+    // Take leaves handleTableBytes at 0 for the heap to fill in, as the table reserves its slots
+    // in chunks rather than per block.
+    HeapStats(size_t arenaCount, size_t nodeCount, size_t blockHeaderBytes);
+
+    void SetShardNode(size_t shard, size_t node);
+
+    void RecordAllocation(size_t shard, size_t size, size_t blockSize);
+    void RecordFree(size_t shard, size_t blockSize);
+    void RecordCollected(size_t blocks, size_t bytes);
+    void RecordFitSearch(size_t shard, size_t size, size_t selectedSize);
+    void RecordFitMiss(size_t shard);
+    void RecordSegmentReserved(size_t node, size_t capacity, size_t bitmapBytes, size_t blockIndexBytes);
+    void RecordSegmentReleased(size_t node, size_t capacity, size_t bitmapBytes, size_t blockIndexBytes);
+    void RecordBlockCreated();
+    void RecordBlockRetired();
+    void RecordPause(PauseKind kind, uint64_t microseconds);
+    void RecordFragmentation(double fragmentation);
+    void RecordMinorCollection();
+    void RecordIncrementalCycle();
+    void RecordPromotions(size_t blocks);
+
+    // Samples about one allocation per `bytes` bytes requested by each thread; 0 turns sampling off
+    void SetSamplingPeriod(size_t bytes);
+    Snapshot Take() const;
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> allocations[sizeClassCount];
+        std::atomic<uint64_t> frees[sizeClassCount];
+        std::atomic<uint64_t> requestedBytes{ 0 };
+        std::atomic<uint64_t> allocatedBytes{ 0 };
+        std::atomic<uint64_t> freedBytes{ 0 };
+        std::atomic<uint64_t> fitSearches{ 0 };
+        std::atomic<uint64_t> fitMisses{ 0 };
+        std::atomic<uint64_t> fitSlackBytes{ 0 };
+        Shard();
+    };
+
+    size_t shardCount;
+    std::unique_ptr<Shard[]> shards;
+    Shard& shardAt(size_t shard) { return shards[shard < shardCount ? shard : shardCount - 1]; }
+    // Node of each arena shard, set while the heap is constructed
+    std::vector<size_t> shardNodes;
+
+    struct alignas(64) NodeCounters {
+        std::atomic<uint64_t> reservedBytes{ 0 };
+        std::atomic<uint64_t> reservedSegments{ 0 };
+    };
+    size_t nodeCount;
+    std::unique_ptr<NodeCounters[]> nodes;
+    NodeCounters& nodeAt(size_t node) { return nodes[node < nodeCount ? node : 0]; }
+
+    std::atomic<uint64_t> collectedBlocks{ 0 };
+    std::atomic<uint64_t> collectedBytes{ 0 };
+    std::atomic<uint64_t> reservedBytes{ 0 };
+    std::atomic<uint64_t> reservedSegments{ 0 };
+    // Blocks are created and retired under the heap's block table lock, so one counter suffices
+    std::atomic<uint64_t> blocks{ 0 };
+    size_t blockHeaderBytes;
+    std::atomic<uint64_t> blockIndexBytes{ 0 };
+    std::atomic<uint64_t> bitmapBytes{ 0 };
+    // Stored as the bit pattern of a double
+    std::atomic<uint64_t> fragmentationBits;
+
+    std::atomic<uint64_t> pauses[static_cast<size_t>(PauseKind::Count)][pauseBucketCount];
+    std::atomic<uint64_t> pauseMicroseconds[static_cast<size_t>(PauseKind::Count)];
+    std::atomic<uint64_t> maxPauseMicroseconds[static_cast<size_t>(PauseKind::Count)];
+    std::atomic<uint64_t> minorCollections{ 0 };
+    std::atomic<uint64_t> incrementalCycles{ 0 };
+    std::atomic<uint64_t> promotions{ 0 };
+
+    // Sampling only takes profileMutex when an allocation is picked, which is rare
+    std::atomic<size_t> samplingPeriod{ 0 };
+    struct SiteCounters {
+        uint64_t samples = 0;
+        uint64_t sampledBytes = 0;
+        uint64_t estimatedBytes = 0;
+    };
+    mutable std::mutex profileMutex;
+    std::unordered_map<const AllocationSite*, SiteCounters> sites;
+    void sample(size_t size);
+};
@@ -0,0 +1,149 @@
+#include "NumaTopology.h"
+#include <atomic>
+#include <string>
+#include <thread>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fstream>
+#include <sched.h>
+#endif
+
+
+namespace {
+
+    std::atomic<size_t> simulatedNodes{ 0 };
+    std::atomic<size_t> nextSimulatedThread{ 0 };
+
+#if !defined(_WIN32)
+    // Parses a sysfs CPU list such as "0-3,8-11"
+    std::vector<size_t> parseCpuList(const std::string& list) {
+        std::vector<size_t> cpus;
+        size_t position = 0;
+        while (position < list.size()) {
+            size_t end = list.find(',', position);
+            if (end == std::string::npos) end = list.size();
+            std::string range = list.substr(position, end - position);
+            size_t dash = range.find('-');
+            if (!range.empty() && range[0] >= '0' && range[0] <= '9') {
+                size_t first = std::stoul(range);
+                size_t last = dash == std::string::npos ? first : std::stoul(range.substr(dash + 1));
+                for (size_t cpu = first; cpu <= last; ++cpu) {
+                    cpus.push_back(cpu);
+                }
+            }
+            position = end + 1;
+        }
+        return cpus;
+    }
+#endif
+
+    NumaTopology detectTopology() {
+        NumaTopology topology;
+#if defined(_WIN32)
+        ULONG highestNode = 0;
+        if (GetNumaHighestNodeNumber(&highestNode)) {
+            topology.nodeCount = highestNode + 1;
+        }
+        for (size_t node = 0; node < topology.nodeCount; ++node) {
+            topology.osNodes.push_back(node);
+        }
+        // Processor numbers past 63 belong to further processor groups, which GetNumaProcessorNode cannot name
+        size_t cpuCount = std::thread::hardware_concurrency();
+        for (size_t cpu = 0; cpu < cpuCount && cpu < 64; ++cpu) {
+            UCHAR node = 0;
+            topology.cpuNodes.push_back(GetNumaProcessorNode(static_cast<UCHAR>(cpu), &node) && node < topology.nodeCount ? node : 0);
+        }
+#else
+        // Node directories may be numbered with gaps, so the nodes are numbered here in the order found
+        std::ifstream online("/sys/devices/system/node/online");
+        std::string list;
+        if (!std::getline(online, list)) {
+            return topology;
+        }
+        std::vector<size_t> nodeIds = parseCpuList(list);
+        if (nodeIds.empty()) {
+            return topology;
+        }
+        topology.nodeCount = nodeIds.size();
+        topology.osNodes = nodeIds;
+        for (size_t node = 0; node < nodeIds.size(); ++node) {
+            std::ifstream cpuList("/sys/devices/system/node/node" + std::to_string(nodeIds[node]) + "/cpulist");
+            std::string cpus;
+            std::getline(cpuList, cpus);
+            for (size_t cpu : parseCpuList(cpus)) {
+                if (cpu >= topology.cpuNodes.size()) {
+                    topology.cpuNodes.resize(cpu + 1, 0);
+                }
+                topology.cpuNodes[cpu] = node;
+            }
+        }
+#endif
+        return topology;
+    }
+
+}
+
+size_t NumaTopology::NodeOfCpu(size_t cpu) const {
+    return cpu < cpuNodes.size() ? cpuNodes[cpu] : 0;
+}
+
+size_t NumaTopology::CurrentNode() const {
+    if (simulated) {
+        static thread_local size_t threadOrdinal = nextSimulatedThread++;
+        return threadOrdinal % nodeCount;
+    }
+    return NodeOfCpu(CurrentCpu());
+}
+
+NumaTopology CurrentNumaTopology() {
+    size_t nodes = simulatedNodes.load();
+    if (nodes > 0) {
+        NumaTopology topology;
+        topology.nodeCount = nodes;
+        topology.simulated = true;
+        return topology;
+    }
+    static const NumaTopology machine = detectTopology();
+    return machine;
+}
+
+void SimulateNumaTopology(size_t nodes) {
+    simulatedNodes.store(nodes);
+}
+
+size_t CurrentCpu() {
+#if defined(_WIN32)
+    return GetCurrentProcessorNumber();
+#else
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : static_cast<size_t>(cpu);
+#endif
+}
+
+void RunOnNode(const NumaTopology& topology, size_t node) {
+    if (topology.simulated || topology.nodeCount < 2) return;
+#if defined(_WIN32)
+    DWORD_PTR mask = 0;
+    for (size_t cpu = 0; cpu < topology.cpuNodes.size(); ++cpu) {
+        if (topology.cpuNodes[cpu] == node) mask |= DWORD_PTR(1) << cpu;
+    }
+    if (mask != 0) {
+        SetThreadAffinityMask(GetCurrentThread(), mask);
+    }
+#else
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    bool any = false;
+    for (size_t cpu = 0; cpu < topology.cpuNodes.size() && cpu < CPU_SETSIZE; ++cpu) {
+        if (topology.cpuNodes[cpu] == node) {
+            CPU_SET(cpu, &cpus);
+            any = true;
+        }
+    }
+    if (any) {
+        sched_setaffinity(0, sizeof(cpus), &cpus);
+    }
+#endif
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+
+// NUMA layout a heap places its arenas and segments by. Where the OS reports no nodes, the
+// machine is one node. A simulated topology splits threads between nodes without binding any
+// memory or thread, so node-local placement can be exercised on a single-node box.
+struct NumaTopology {
+    size_t nodeCount = 1;
+    // Node of each CPU, by CPU number
+    std::vector<size_t> cpuNodes;
+    // The OS's number for each node, which memory is bound by
+    std::vector<size_t> osNodes;
+    bool simulated = false;
+
+    size_t NodeOfCpu(size_t cpu) const;
+    // Node of the calling thread: that of its CPU, or for a simulated topology one dealt out to
+    // threads in turn on their first call
+    size_t CurrentNode() const;
+};
+
+// The topology heaps created from now on use: the simulated one if set, otherwise the machine's
+NumaTopology CurrentNumaTopology();
+// Simulate `nodes` nodes for heaps created from now on; 0 goes back to the machine's topology
+void SimulateNumaTopology(size_t nodes);
+// CPU the calling thread runs on, 0 if the OS does not say
+size_t CurrentCpu();
+// Restricts the calling thread to the CPUs of a node. Does nothing for a simulated topology.
+void RunOnNode(const NumaTopology& topology, size_t node);
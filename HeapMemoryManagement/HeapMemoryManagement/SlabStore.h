@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+
+// Fixed-size chunks of T that never move, so pointers to live objects stay valid for the
+// store's lifetime. Released objects are chained through their own `nextFree` member and
+// handed out again before a new chunk is started, making Create and Release O(1).
+template <typename T, size_t chunkSize = 1024>
+class SlabStore {
+public:
+    SlabStore() = default;
+    SlabStore(const SlabStore&) = delete;
+    SlabStore& operator=(const SlabStore&) = delete;
+
+    // Returns a value-initialized object
+    T* Create() {
+        T* object = freeList;
+        if (object) {
+            freeList = object->nextFree;
+        }
+        else {
+            if (chunks.empty() || usedInLastChunk == chunkSize) {
+                chunks.emplace_back(new T[chunkSize]);
+                usedInLastChunk = 0;
+            }
+            object = &chunks.back()[usedInLastChunk++];
+        }
+
+        reset(object);
+        ++liveCount;
+        return object;
+    }
+
+    // The object's memory stays readable, but it belongs to the next Create
+    void Release(T* object) {
+        reset(object);
+        object->nextFree = freeList;
+        freeList = object;
+        --liveCount;
+    }
+
+    size_t LiveCount() const { return liveCount; }
+    size_t Capacity() const { return chunks.size() * chunkSize; }
+
+private:
+    // Reconstructs in place, so T need not be assignable
+    static void reset(T* object) {
+        object->~T();
+        new (object) T();
+    }
+
+    std::vector<std::unique_ptr<T[]>> chunks;
+    size_t usedInLastChunk = 0;
+    T* freeList = nullptr;
+    size_t liveCount = 0;
+};
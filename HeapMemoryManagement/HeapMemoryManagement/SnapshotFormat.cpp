@@ -0,0 +1,50 @@
+#include "SnapshotFormat.h"
+
+
+uint64_t SnapshotChecksum(const void* data, size_t bytes, uint64_t seed) {
+    const uint64_t prime = 0x100000001b3ull;
+    const char* current = static_cast<const char*>(data);
+    uint64_t hash = seed;
+    for (; bytes >= sizeof(uint64_t); bytes -= sizeof(uint64_t), current += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, current, sizeof(word));
+        hash = (hash ^ word) * prime;
+    }
+    for (; bytes > 0; --bytes, ++current) {
+        hash = (hash ^ static_cast<unsigned char>(*current)) * prime;
+    }
+    return hash;
+}
+
+void SnapshotWriter::PutString(const std::string& text) {
+    Put<uint64_t>(text.size());
+    bytes.append(text);
+}
+
+void SnapshotReader::GetBytes(void* destination, size_t count) {
+    if (failed || count > size - position) {
+        failed = true;
+        return;
+    }
+    std::memcpy(destination, data + position, count);
+    position += count;
+}
+
+std::string SnapshotReader::GetString() {
+    uint64_t length = GetCount(1);
+    std::string text(static_cast<size_t>(length), '\0');
+    if (length > 0) {
+        GetBytes(&text[0], static_cast<size_t>(length));
+    }
+    return text;
+}
+
+uint64_t SnapshotReader::GetCount(size_t elementSize) {
+    uint64_t count = Get<uint64_t>();
+    // A corrupt count must not size an allocation beyond what the buffer can hold
+    if (elementSize > 0 && count > (size - position) / elementSize) {
+        failed = true;
+        return 0;
+    }
+    return count;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+
+// File layout of a heap snapshot (Heap::SaveSnapshot). Nothing in it is an address: blocks
+// are located by segment and offset, and references are Block IDs.
+//
+//     header | segment payloads, each at a multiple of snapshotAlignment | metadata
+//
+// The payloads are mapped copy-on-write straight from the file when the snapshot is loaded,
+// so their offsets are multiples of the largest mapping granularity (64 KiB on Windows). The
+// metadata describes the segments, their blocks and the heap's lists. The checksum covers the
+// header and the metadata; each payload has a checksum of its own in the metadata, which is only
+// checked on request, since reading every payload page would defeat loading them lazily.
+// Fields are stored in the saving machine's byte order, which the magic number rejects if foreign.
+
+static const uint64_t snapshotMagic = 0x50414e5350414548ull;  // "HEAPSNAP" read little-endian
+static const uint32_t snapshotVersion = 1;
+static const size_t snapshotAlignment = 64 * 1024;
+
+struct SnapshotHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t headerBytes;
+    uint64_t metadataOffset;
+    uint64_t metadataBytes;
+    uint64_t fileBytes;
+    // Over the header with this field zero, then over the metadata
+    uint64_t checksum;
+};
+
+// One block of a segment, in address order
+struct SnapshotBlock {
+    uint32_t offset;
+    uint32_t size;
+    int32_t blockId;
+    uint32_t rootHandles;
+    // Index into the type table plus one, 0 for an untyped block
+    uint32_t typeIndex;
+    uint8_t generation;
+    uint8_t flags;
+    uint16_t reserved;
+
+    enum Flags : uint8_t {
+        Allocated = 1,
+        Old = 2,
+        Remembered = 4,
+        Nursery = 8,
+        Buddy = 16,
+        HasReferences = 32,
+    };
+};
+
+// FNV-1a over 64-bit words, then over the bytes of the tail. `seed` chains several ranges.
+uint64_t SnapshotChecksum(const void* data, size_t bytes, uint64_t seed = 0xcbf29ce484222325ull);
+
+// Appends trivially copyable values to a metadata buffer
+class SnapshotWriter {
+public:
+    template <typename T>
+    void Put(const T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "Snapshot fields are copied bytewise");
+        bytes.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+    void PutBytes(const void* data, size_t size) { bytes.append(static_cast<const char*>(data), size); }
+    void PutString(const std::string& text);
+
+    const std::string& Bytes() const { return bytes; }
+
+private:
+    std::string bytes;
+};
+
+// Reads a metadata buffer back. Reading past the end yields zeroes and marks the reader failed,
+// so a parser checks Failed() once instead of after every field.
+class SnapshotReader {
+public:
+    SnapshotReader(const char* data, size_t size) : data(data), size(size) {}
+
+    template <typename T>
+    T Get() {
+        static_assert(std::is_trivially_copyable<T>::value, "Snapshot fields are copied bytewise");
+        T value;
+        std::memset(&value, 0, sizeof(T));
+        GetBytes(&value, sizeof(T));
+        return value;
+    }
+    void GetBytes(void* destination, size_t count);
+    std::string GetString();
+    // A count of `elementSize`-byte elements that can still follow, or 0 after failing the reader
+    uint64_t GetCount(size_t elementSize);
+
+    bool Failed() const { return failed; }
+    bool AtEnd() const { return position == size; }
+
+private:
+    const char* data;
+    size_t size;
+    size_t position = 0;
+    bool failed = false;
+};
@@ -0,0 +1,126 @@
+#include "SystemMemory.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+
+void* ReserveSystemMemory(size_t bytes) {
+    if (bytes == 0) return nullptr;
+#if defined(_WIN32)
+    return VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return memory == MAP_FAILED ? nullptr : memory;
+#endif
+}
+
+void* ReserveSystemMemoryOnNode(size_t bytes, size_t node) {
+    if (bytes == 0) return nullptr;
+#if defined(_WIN32)
+    void* memory = VirtualAllocExNuma(GetCurrentProcess(), nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, static_cast<DWORD>(node));
+    return memory ? memory : ReserveSystemMemory(bytes);
+#else
+    void* memory = ReserveSystemMemory(bytes);
+#if defined(__linux__) && defined(SYS_mbind)
+    // mbind directly rather than through libnuma, which may not be installed. MPOL_PREFERRED (1)
+    // falls back to other nodes when this one is full; pages are placed as they are first touched.
+    const unsigned long preferred = 1;
+    if (memory && node < 64) {
+        unsigned long nodeMask = 1UL << node;
+        syscall(SYS_mbind, memory, bytes, preferred, &nodeMask, 64UL, 0U);
+    }
+#else
+    (void)node;
+#endif
+    return memory;
+#endif
+}
+
+void ReleaseSystemMemory(void* memory, size_t bytes) {
+    if (!memory) return;
+#if defined(_WIN32)
+    (void)bytes;
+    VirtualFree(memory, 0, MEM_RELEASE);
+#else
+    munmap(memory, bytes);
+#endif
+}
+
+void DecommitSystemMemory(void* memory, size_t bytes) {
+    if (!memory) return;
+#if defined(_WIN32)
+    VirtualFree(memory, bytes, MEM_DECOMMIT);
+#else
+    madvise(memory, bytes, MADV_DONTNEED);
+#endif
+}
+
+bool CommitSystemMemory(void* memory, size_t bytes) {
+#if defined(_WIN32)
+    return VirtualAlloc(memory, bytes, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+    // Pages given up with MADV_DONTNEED come back zeroed on first touch
+    (void)memory;
+    (void)bytes;
+    return true;
+#endif
+}
+
+void AdviseHugePages(void* memory, size_t bytes) {
+#if defined(MADV_HUGEPAGE)
+    madvise(memory, bytes, MADV_HUGEPAGE);
+#else
+    (void)memory;
+    (void)bytes;
+#endif
+}
+
+MappableFile OpenMappableFile(const char* path) {
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return noMappableFile;
+    // The mapping keeps the file open once its own handle is closed
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    CloseHandle(file);
+    return mapping ? reinterpret_cast<MappableFile>(mapping) : noMappableFile;
+#else
+    int descriptor = open(path, O_RDONLY);
+    return descriptor < 0 ? noMappableFile : static_cast<MappableFile>(descriptor);
+#endif
+}
+
+void CloseMappableFile(MappableFile file) {
+    if (file == noMappableFile) return;
+#if defined(_WIN32)
+    CloseHandle(reinterpret_cast<HANDLE>(file));
+#else
+    close(static_cast<int>(file));
+#endif
+}
+
+void* MapFileCopyOnWrite(MappableFile file, uint64_t offset, size_t bytes) {
+    if (file == noMappableFile || bytes == 0) return nullptr;
+#if defined(_WIN32)
+    return MapViewOfFile(reinterpret_cast<HANDLE>(file), FILE_MAP_COPY, static_cast<DWORD>(offset >> 32),
+        static_cast<DWORD>(offset & 0xFFFFFFFFu), bytes);
+#else
+    void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, static_cast<int>(file), static_cast<off_t>(offset));
+    return memory == MAP_FAILED ? nullptr : memory;
+#endif
+}
+
+void UnmapFileMemory(void* memory, size_t bytes) {
+    if (!memory) return;
+#if defined(_WIN32)
+    (void)bytes;
+    UnmapViewOfFile(memory);
+#else
+    munmap(memory, bytes);
+#endif
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Page-granular memory straight from the OS (mmap or VirtualAlloc), used as segment backing.
+// Returns zeroed, page-aligned memory, or nullptr if the OS refuses the request.
+void* ReserveSystemMemory(size_t bytes);
+// The same, with the pages preferably placed on one NUMA node (the OS's node number). Where the
+// OS cannot bind memory, or refuses, the region is placed as ReserveSystemMemory would.
+void* ReserveSystemMemoryOnNode(size_t bytes, size_t node);
+// Returns a region obtained from ReserveSystemMemory to the OS
+void ReleaseSystemMemory(void* memory, size_t bytes);
+// Hands the pages of a region back to the OS but keeps its addresses reserved
+void DecommitSystemMemory(void* memory, size_t bytes);
+// Makes a decommitted region usable again; its pages read as zero. False if the OS refuses.
+bool CommitSystemMemory(void* memory, size_t bytes);
+// Asks for transparent huge pages behind a region, where the OS has them
+void AdviseHugePages(void* memory, size_t bytes);
+
+// A file opened for mapping: a descriptor, or a file mapping handle on Windows
+typedef intptr_t MappableFile;
+static const MappableFile noMappableFile = -1;
+// Opens a file read-only for MapFileCopyOnWrite, noMappableFile if it cannot be opened or mapped
+MappableFile OpenMappableFile(const char* path);
+// Views stay valid after the file is closed
+void CloseMappableFile(MappableFile file);
+// A private, writable view of `bytes` bytes from `offset`, which must be a multiple of 64 KiB.
+// Pages are read from the file as they are first touched, and writes never reach the file.
+// nullptr if the OS refuses.
+void* MapFileCopyOnWrite(MappableFile file, uint64_t offset, size_t bytes);
+// Returns a view obtained from MapFileCopyOnWrite
+void UnmapFileMemory(void* memory, size_t bytes);
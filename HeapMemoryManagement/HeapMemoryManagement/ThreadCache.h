@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "FreeBlockIndex.h"
+
+
+// Per-thread cache of free blocks, one bin per size class.
+// Bins are filled from and drained to the free index of the cache's arena in batches, so
+// most allocate/free pairs only take the cache's own (uncontended) lock.
+//
+// Size class c serves requests of up to (c + 1) * sizeClassGranularity bytes, and a
+// free block is cached in the highest class it can fully serve. Blocks beyond the largest
+// class go back to the arena's free index, where they can be split and merged.
+class ThreadCache {
+public:
+    static const size_t sizeClassGranularity = 16;
+    static const size_t sizeClassCount = 16;
+
+    // Size class for a request, or sizeClassCount if the request bypasses the cache
+    static size_t SizeClassOf(size_t size) {
+        if (size == 0 || size > sizeClassGranularity * sizeClassCount) return sizeClassCount;
+        return (size - 1) / sizeClassGranularity;
+    }
+
+    // Size class a free block of `blockSize` bytes is cached in, or sizeClassCount if none.
+    // A class hands out its blocks whole, so a larger block would be wasted on a small request.
+    static size_t BinForBlock(size_t blockSize) {
+        if (blockSize < sizeClassGranularity || blockSize > sizeClassGranularity * sizeClassCount) return sizeClassCount;
+        return blockSize / sizeClassGranularity - 1;
+    }
+
+    // Largest request served by a size class
+    static size_t ClassLimit(size_t sizeClass) {
+        return (sizeClass + 1) * sizeClassGranularity;
+    }
+
+    ThreadCache(std::thread::id owner, size_t arena) : owner(owner), arena(arena) {}
+
+    std::mutex lock;
+    std::thread::id owner;
+    // Arena the owning thread allocates from; the bins only hold blocks of its segments
+    const size_t arena;
+    // Set when the owning thread exits, so the heap can hand the cache to a new thread
+    std::atomic<bool> orphaned{ false };
+
+    std::vector<FreeBlockIndex::Position> bins[sizeClassCount];
+    // Blocks allocated or freed through the cache whose root set entry is not updated yet
+    std::vector<FreeBlockIndex::Position> dirty;
+
+    size_t allocationHits = 0;
+    size_t allocationMisses = 0;
+    size_t freeHits = 0;
+    size_t freeMisses = 0;
+    // Blocks of other arenas handed to their remote-free lists
+    size_t remoteFrees = 0;
+    size_t refills = 0;
+    size_t drains = 0;
+    // Bytes the owning thread allocated that the incremental collector's pacer has not been told of
+    size_t unpacedBytes = 0;
+
+    size_t CachedBlocks() const {
+        size_t total = 0;
+        for (const std::vector<FreeBlockIndex::Position>& bin : bins) {
+            total += bin.size();
+        }
+        return total;
+    }
+};
@@ -0,0 +1,227 @@
+#include "Trace.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace {
+
+    // Single producer (the owning thread), single consumer (the flush thread)
+    struct TraceRing {
+        static const size_t capacity = 4096;
+        TraceRecord records[capacity];
+        std::atomic<uint64_t> head{ 0 };
+        std::atomic<uint64_t> tail{ 0 };
+        std::atomic<uint64_t> dropped{ 0 };
+        uint32_t thread = 0;
+        // Set when the owning thread exits, the ring is dropped once drained
+        std::atomic<bool> orphaned{ false };
+    };
+    const size_t TraceRing::capacity;
+
+    struct TraceState {
+        std::mutex lifecycleMutex;
+        std::atomic<bool> running{ false };
+        std::chrono::steady_clock::time_point startTime;
+        std::FILE* file = nullptr;
+        std::thread flusher;
+        std::mutex wakeMutex;
+        std::condition_variable wake;
+        bool stopRequested = false;
+
+        // Rings register once per thread, so this lock stays off the recording path
+        std::mutex ringsMutex;
+        std::vector<std::shared_ptr<TraceRing>> rings;
+        uint32_t nextThread = 0;
+    };
+
+    TraceState& state() {
+        static TraceState traceState;
+        return traceState;
+    }
+
+    struct LocalTraceRing {
+        std::shared_ptr<TraceRing> ring;
+
+        ~LocalTraceRing() {
+            if (ring) {
+                ring->orphaned = true;
+            }
+        }
+    };
+
+    TraceRing& localRing() {
+        static thread_local LocalTraceRing local;
+        if (!local.ring) {
+            TraceState& trace = state();
+            local.ring = std::make_shared<TraceRing>();
+            std::lock_guard<std::mutex> lock(trace.ringsMutex);
+            local.ring->thread = trace.nextThread++;
+            trace.rings.push_back(local.ring);
+        }
+        return *local.ring;
+    }
+
+    void drainRing(TraceState& trace, TraceRing& ring) {
+        uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+        uint64_t head = ring.head.load(std::memory_order_acquire);
+        while (tail < head) {
+            // Up to the end of the buffer in one write, the wrapped part in the next
+            size_t first = static_cast<size_t>(tail % TraceRing::capacity);
+            size_t count = static_cast<size_t>(std::min<uint64_t>(head - tail, TraceRing::capacity - first));
+            std::fwrite(&ring.records[first], sizeof(TraceRecord), count, trace.file);
+            tail += count;
+        }
+        ring.tail.store(tail, std::memory_order_release);
+
+        uint64_t dropped = ring.dropped.exchange(0);
+        if (dropped > 0) {
+            TraceRecord record = {};
+            record.timestamp = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - trace.startTime).count());
+            record.thread = ring.thread;
+            record.event = static_cast<uint16_t>(TraceEvent::Dropped);
+            record.arguments[0] = dropped;
+            std::fwrite(&record, sizeof(record), 1, trace.file);
+        }
+    }
+
+    void drainAll(TraceState& trace) {
+        std::lock_guard<std::mutex> lock(trace.ringsMutex);
+        for (size_t i = 0; i < trace.rings.size();) {
+            TraceRing& ring = *trace.rings[i];
+            // Checked first, so nothing the exiting thread wrote is missed
+            bool orphaned = ring.orphaned;
+            drainRing(trace, ring);
+            if (orphaned) {
+                trace.rings[i] = trace.rings.back();
+                trace.rings.pop_back();
+            }
+            else {
+                ++i;
+            }
+        }
+    }
+
+    void flushLoop() {
+        TraceState& trace = state();
+        std::unique_lock<std::mutex> lock(trace.wakeMutex);
+        while (!trace.stopRequested) {
+            trace.wake.wait_for(lock, std::chrono::milliseconds(10));
+            lock.unlock();
+            drainAll(trace);
+            lock.lock();
+        }
+    }
+
+}
+
+const char* TraceEventName(TraceEvent event) {
+    static const char* const names[] = {
+        "Allocate", "Deallocate", "SegmentCreated", "SegmentReleased", "FitSelected", "FitMiss",
+        "ThreadCacheRefill", "MarkDone", "SweepDone", "MinorCollection", "Compaction",
+        "ConcurrentPause", "Dropped", "RemoteFreesDrained", "IncrementalSlice",
+        "RegionReleased"
+    };
+    size_t index = static_cast<size_t>(event);
+    return index < static_cast<size_t>(TraceEvent::Count) ? names[index] : "Unknown";
+}
+
+void TraceArgumentNames(TraceEvent event, const char*& first, const char*& second) {
+    static const char* const names[][2] = {
+        { "size", "blockId" }, { "blockId", "size" }, { "segment", "capacity" }, { "segment", "capacity" },
+        { "requested", "selected" }, { "requested", "-" }, { "sizeClass", "blocks" }, { "marked", "us" },
+        { "freed", "us" }, { "young", "freed" }, { "moved", "releasedBytes" }, { "slice", "us" },
+        { "events", "-" }, { "arena", "blocks" }, { "work", "us" },
+        { "segments", "bytes" }
+    };
+    size_t index = static_cast<size_t>(event);
+    first = index < static_cast<size_t>(TraceEvent::Count) ? names[index][0] : "a";
+    second = index < static_cast<size_t>(TraceEvent::Count) ? names[index][1] : "b";
+}
+
+bool StartTrace(const std::string& path) {
+    TraceState& trace = state();
+    std::lock_guard<std::mutex> lifecycleLock(trace.lifecycleMutex);
+    if (trace.running) {
+        return false;
+    }
+
+    trace.file = std::fopen(path.c_str(), "wb");
+    if (!trace.file) {
+        return false;
+    }
+    TraceFileHeader header = {};
+    std::copy(traceMagic, traceMagic + 4, header.magic);
+    header.version = traceVersion;
+    header.recordSize = sizeof(TraceRecord);
+    std::fwrite(&header, sizeof(header), 1, trace.file);
+
+    // Records left over from an earlier trace belong to that trace's timeline
+    {
+        std::lock_guard<std::mutex> lock(trace.ringsMutex);
+        for (auto& ring : trace.rings) {
+            ring->tail.store(ring->head.load());
+            ring->dropped = 0;
+        }
+    }
+    trace.startTime = std::chrono::steady_clock::now();
+    trace.stopRequested = false;
+    trace.flusher = std::thread(flushLoop);
+    trace.running = true;
+    return true;
+}
+
+void StopTrace() {
+    TraceState& trace = state();
+    std::lock_guard<std::mutex> lifecycleLock(trace.lifecycleMutex);
+    if (!trace.running) {
+        return;
+    }
+
+    trace.running = false;
+    {
+        std::lock_guard<std::mutex> lock(trace.wakeMutex);
+        trace.stopRequested = true;
+    }
+    trace.wake.notify_one();
+    trace.flusher.join();
+    drainAll(trace);
+    std::fclose(trace.file);
+    trace.file = nullptr;
+}
+
+bool TraceRunning() {
+    return state().running.load(std::memory_order_relaxed);
+}
+
+void RecordTraceEvent(TraceEvent event, uint64_t first, uint64_t second) {
+    TraceState& trace = state();
+    // Acquire pairs with StartTrace, so startTime is set before the first record uses it
+    if (!trace.running.load(std::memory_order_acquire)) {
+        return;
+    }
+
+    TraceRing& ring = localRing();
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    if (head - ring.tail.load(std::memory_order_acquire) >= TraceRing::capacity) {
+        ring.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    TraceRecord& record = ring.records[head % TraceRing::capacity];
+    record.timestamp = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - trace.startTime).count());
+    record.thread = ring.thread;
+    record.event = static_cast<uint16_t>(event);
+    record.reserved = 0;
+    record.arguments[0] = first;
+    record.arguments[1] = second;
+    ring.head.store(head + 1, std::memory_order_release);
+}
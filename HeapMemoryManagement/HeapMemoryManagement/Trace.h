@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+// Leveled event tracing. HEAP_TRACE_LEVEL selects what is compiled in:
+//   0  nothing (default), every TRACE_* macro expands to nothing
+//   1  collections: mark, sweep, minor collections, compaction, concurrent pauses
+//   2  plus allocation, deallocation and segment events
+//   3  plus fit searches and thread cache refills
+// Define it for the whole build, e.g. HEAP_TRACE_LEVEL=2 in the project's preprocessor definitions.
+//
+// Recording never takes a lock: each thread appends to its own ring buffer and a background
+// thread drains the rings into a binary file between StartTrace and StopTrace. Events that
+// find their ring full are counted and reported as a Dropped record instead of blocking.
+#ifndef HEAP_TRACE_LEVEL
+#define HEAP_TRACE_LEVEL 0
+#endif
+
+enum class TraceEvent : uint16_t {
+    Allocate,           // size, Block ID
+    Deallocate,         // Block ID, size
+    SegmentCreated,     // segment, capacity
+    SegmentReleased,    // segment, capacity
+    FitSelected,        // requested size, selected block size
+    FitMiss,            // requested size, -
+    ThreadCacheRefill,  // size class, blocks added
+    MarkDone,           // blocks marked, microseconds
+    SweepDone,          // blocks freed, microseconds
+    MinorCollection,    // young blocks, blocks freed
+    Compaction,         // blocks moved, bytes released
+    ConcurrentPause,    // slice number, microseconds
+    Dropped,            // events lost to a full ring, -
+    RemoteFreesDrained, // arena, blocks released
+    IncrementalSlice,   // work units done, microseconds
+    RegionReleased,     // segments given back, bytes used
+    Count
+};
+
+// One fixed-size record per event, written to the file as is
+struct TraceRecord {
+    // Nanoseconds since StartTrace
+    uint64_t timestamp;
+    // Small per-thread number, in order of each thread's first event
+    uint32_t thread;
+    uint16_t event;
+    uint16_t reserved;
+    uint64_t arguments[2];
+};
+
+struct TraceFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t reserved;
+};
+
+static const char traceMagic[4] = { 'H', 'T', 'R', 'C' };
+static const uint32_t traceVersion = 1;
+
+// Name of an event and of its two arguments, for decoders
+const char* TraceEventName(TraceEvent event);
+void TraceArgumentNames(TraceEvent event, const char*& first, const char*& second);
+
+// Starts the flush thread writing to `path`; false if the file cannot be opened or a trace is running
+bool StartTrace(const std::string& path);
+// Drains every ring, writes the remaining records and closes the file
+void StopTrace();
+bool TraceRunning();
+void RecordTraceEvent(TraceEvent event, uint64_t first, uint64_t second);
+
+#if HEAP_TRACE_LEVEL >= 1
+#define TRACE_GC(event, first, second) RecordTraceEvent(TraceEvent::event, static_cast<uint64_t>(first), static_cast<uint64_t>(second))
+#else
+#define TRACE_GC(event, first, second) ((void)0)
+#endif
+
+#if HEAP_TRACE_LEVEL >= 2
+#define TRACE_ALLOC(event, first, second) RecordTraceEvent(TraceEvent::event, static_cast<uint64_t>(first), static_cast<uint64_t>(second))
+#else
+#define TRACE_ALLOC(event, first, second) ((void)0)
+#endif
+
+#if HEAP_TRACE_LEVEL >= 3
+#define TRACE_FIT(event, first, second) RecordTraceEvent(TraceEvent::event, static_cast<uint64_t>(first), static_cast<uint64_t>(second))
+#else
+#define TRACE_FIT(event, first, second) ((void)0)
+#endif
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+
+// Chase-Lev work-stealing deque. The owning thread pushes and pops at the bottom (LIFO),
+// other threads steal from the top (FIFO) without taking a lock.
+// Items must be trivially copyable; the mark phase stores Block pointers.
+// Outgrown buffers stay alive until the deque is destroyed, since a thief may still read them.
+template <typename T>
+class WorkStealingDeque {
+public:
+    explicit WorkStealingDeque(size_t initialCapacity = 1024) {
+        size_t capacity = 1;
+        while (capacity < initialCapacity) capacity <<= 1;
+        buffers.emplace_back(new Buffer(capacity));
+        buffer.store(buffers.back().get());
+    }
+
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+    // Owner only
+    void Push(T item) {
+        int64_t b = bottom.load();
+        int64_t t = top.load();
+        Buffer* current = buffer.load();
+        if (b - t >= static_cast<int64_t>(current->capacity)) {
+            current = grow(current, t, b);
+        }
+        current->Put(b, item);
+        bottom.store(b + 1);
+    }
+
+    // Owner only
+    bool Pop(T& item) {
+        int64_t b = bottom.load() - 1;
+        Buffer* current = buffer.load();
+        bottom.store(b);
+        int64_t t = top.load();
+
+        if (t > b) {
+            bottom.store(b + 1);
+            return false;
+        }
+
+        item = current->Get(b);
+        if (t == b) {
+            // Last item: race the thieves for it
+            bool won = top.compare_exchange_strong(t, t + 1);
+            bottom.store(b + 1);
+            return won;
+        }
+        return true;
+    }
+
+    // Any thread
+    bool Steal(T& item) {
+        int64_t t = top.load();
+        int64_t b = bottom.load();
+        if (t >= b) {
+            return false;
+        }
+
+        item = buffer.load()->Get(t);
+        return top.compare_exchange_strong(t, t + 1);
+    }
+
+    bool Empty() const {
+        return top.load() >= bottom.load();
+    }
+
+private:
+    struct Buffer {
+        explicit Buffer(size_t capacity) : capacity(capacity), items(new std::atomic<T>[capacity]) {}
+
+        T Get(int64_t index) const {
+            return items[static_cast<size_t>(index) & (capacity - 1)].load(std::memory_order_relaxed);
+        }
+        void Put(int64_t index, T item) {
+            items[static_cast<size_t>(index) & (capacity - 1)].store(item, std::memory_order_relaxed);
+        }
+
+        size_t capacity;
+        std::unique_ptr<std::atomic<T>[]> items;
+    };
+
+    Buffer* grow(Buffer* current, int64_t t, int64_t b) {
+        buffers.emplace_back(new Buffer(current->capacity * 2));
+        Buffer* grown = buffers.back().get();
+        for (int64_t i = t; i < b; ++i) {
+            grown->Put(i, current->Get(i));
+        }
+        buffer.store(grown);
+        return grown;
+    }
+
+    std::atomic<int64_t> top{ 0 };
+    std::atomic<int64_t> bottom{ 0 };
+    std::atomic<Buffer*> buffer{ nullptr };
+    // Every buffer ever used, owned by the owner thread
+    std::vector<std::unique_ptr<Buffer>> buffers;
+};
@@ -1,21 +1,47 @@
 #include "Heap.h"
+#include "Trace.h"
+#include "HeapStats.h"
 #include <iostream>
 
+// A typed object: the collector follows its next field
+struct ListNode {
+    Ref<ListNode> next;
+    int value;
+};
+HEAP_TYPE(ListNode, HEAP_REFERENCE(ListNode, next));
+
 int main() {
     // Create a heap with an initial size of 1000 bytes, 5 threads, 3 segments, and 10 blocks per segment
     Heap myHeap(1000, 5, 3, 10);
+    bool lazySweep = false;
+    bool incrementalGC = false;
+    // Head of the typed list; replacing it leaves the old list to the collector
+    Root<ListNode> typedList;
 
     while (true) {
         std::cout << "1. Allocate memory\n";
         std::cout << "2. Deallocate memory\n";
         std::cout << "3. Use GarbageCollector\n";
-        std::cout << "4. Measure allocation permeability\n";
-        std::cout << "5. Measure deallocation permeability\n";
-        std::cout << "6. Check memory\n";
-        std::cout << "7. Change allocation strategy\n";
-        std::cout << "8. Run Generational GC\n";
-        std::cout << "9. Run Concurrent Mark-and-Sweep GC\n";
-        std::cout << "10. Exit\n";
+        std::cout << "4. Check memory\n";
+        std::cout << "5. Change allocation strategy\n";
+        std::cout << "6. Run Generational GC\n";
+        std::cout << "7. Run Concurrent Mark-and-Sweep GC\n";
+        std::cout << "8. Show thread cache statistics\n";
+        std::cout << "9. Configure thread cache\n";
+        std::cout << "10. Toggle lazy sweeping\n";
+        std::cout << "11. Set promotion age\n";
+        std::cout << "12. Configure nursery\n";
+        std::cout << "13. Set compaction threshold\n";
+        std::cout << "14. Start/stop tracing\n";
+        std::cout << "15. Show heap statistics\n";
+        std::cout << "16. Configure allocation sampling\n";
+        std::cout << "17. Build a typed list\n";
+        std::cout << "18. Toggle incremental GC\n";
+        std::cout << "19. Configure large-object space\n";
+        std::cout << "20. Show NUMA placement\n";
+        std::cout << "21. Save heap snapshot\n";
+        std::cout << "22. Load heap snapshot\n";
+        std::cout << "23. Exit\n";
         std::cout << "Enter your choice: ";
 
         int choice;
@@ -23,14 +49,19 @@ int main() {
 
         switch (choice) {
         case 1: {
+            HEAP_ALLOCATION_SITE();
             std::cout << "Enter size to allocate: ";
             size_t size;
             std::cin >> size;
             std::string strategy;
-            std::cout << "Enter allocation strategy (First-Fit / Best-Fit / Worst-Fit): ";
+            std::cout << "Enter allocation strategy (First-Fit / Next-Fit / Best-Fit / Worst-Fit / Buddy): ";
             std::cin >> strategy;
-            void* allocatedMemory = myHeap.Allocate(size, strategy);
-            std::cout << "Allocated memory at address: " << allocatedMemory << std::endl;
+            int blockId;
+            void* allocatedMemory = myHeap.Allocate(size, strategy, &blockId);
+            if (allocatedMemory) {
+                std::cout << "Allocated memory at address: " << allocatedMemory
+                    << " (Block ID: " << blockId << ")" << std::endl;
+            }
             break;
         }
         case 2: {
@@ -38,7 +69,9 @@ int main() {
             int blockId;
             std::cin >> blockId;
 
-            myHeap.Deallocate(blockId);
+            if (myHeap.Deallocate(blockId)) {
+                std::cout << "Deallocated memory with Block ID: " << blockId << std::endl;
+            }
             break;
         }
         case 3:
@@ -46,44 +79,159 @@ int main() {
             myHeap.CollectGarbage();
             myHeap.CheckMemory();
             break;
-        case 4: {
-            size_t allocationThreads;
-            std::cout << "Enter number of threads to measure allocation permeability: ";
-            std::cin >> allocationThreads;
-            myHeap.MeasureAllocationPermeabilitySelective(allocationThreads);
-            break;
-        }
-        case 5: {
-            size_t deallocationThreads;
-            std::cout << "Enter number of threads to measure deallocation permeability: ";
-            std::cin >> deallocationThreads;
-            myHeap.MeasureDeallocationPermeabilitySelective(deallocationThreads);
-            break;
-        }
-        case 6:
+        case 4:
             std::cout << "Checking memory...\n";
             myHeap.CheckMemory();
             break;
-        case 7: {
-            std::cout << "Select allocation strategy (First-Fit / Best-Fit / Worst-Fit): ";
+        case 5: {
+            std::cout << "Select allocation strategy (First-Fit / Next-Fit / Best-Fit / Worst-Fit / Buddy): ";
             std::string allocationStrategy;
             std::cin >> allocationStrategy;
-            if (allocationStrategy != "First-Fit" && allocationStrategy != "Best-Fit" && allocationStrategy != "Worst-Fit") {
+            if (allocationStrategy != "First-Fit" && allocationStrategy != "Next-Fit" && allocationStrategy != "Best-Fit" && allocationStrategy != "Worst-Fit" && allocationStrategy != "Buddy") {
                 std::cout << "Invalid strategy! Using First-Fit by default.\n";
                 allocationStrategy = "First-Fit";
             }
             std::cout << "Allocation strategy set to: " << allocationStrategy << std::endl;
             break;
         }
-        case 8:
+        case 6:
             std::cout << "Running Generational GC...\n";
             myHeap.RunGenerationalGC();
             break;
-        case 9:
+        case 7:
             std::cout << "Running Concurrent Mark-and-Sweep GC...\n";
             myHeap.RunConcurrentMarkAndSweep();
             break;
+        case 8:
+            myHeap.PrintThreadCacheStats();
+            break;
+        case 9: {
+            size_t depth, batchSize;
+            std::cout << "Enter blocks per size class (0 disables thread caches): ";
+            std::cin >> depth;
+            std::cout << "Enter refill batch size: ";
+            std::cin >> batchSize;
+            myHeap.SetThreadCacheLimits(depth, batchSize);
+            break;
+        }
         case 10:
+            lazySweep = !lazySweep;
+            myHeap.SetLazySweep(lazySweep);
+            break;
+        case 11: {
+            int age;
+            std::cout << "Enter minor collections survived before promotion: ";
+            std::cin >> age;
+            myHeap.SetPromotionAge(age);
+            break;
+        }
+        case 12: {
+            size_t capacity;
+            std::cout << "Enter nursery size in bytes (0 disables the nursery): ";
+            std::cin >> capacity;
+            myHeap.SetNursery(capacity);
+            break;
+        }
+        case 13: {
+            double threshold;
+            std::cout << "Enter fragmentation at which to compact (0-1, above 1 disables): ";
+            std::cin >> threshold;
+            myHeap.SetCompactionThreshold(threshold);
+            break;
+        }
+        case 14: {
+            if (TraceRunning()) {
+                StopTrace();
+                std::cout << "Tracing stopped.\n";
+                break;
+            }
+            std::cout << "Enter trace file path: ";
+            std::string path;
+            std::cin >> path;
+            if (StartTrace(path)) {
+                std::cout << "Tracing to " << path << " (level " << HEAP_TRACE_LEVEL << ").\n";
+            }
+            break;
+        }
+        case 15:
+            std::cout << myHeap.GetStats().ToJson() << std::endl;
+            break;
+        case 16: {
+            size_t bytesPerSample;
+            std::cout << "Enter bytes between sampled allocations (0 disables sampling): ";
+            std::cin >> bytesPerSample;
+            myHeap.SetAllocationSampling(bytesPerSample);
+            break;
+        }
+        case 17: {
+            int length;
+            std::cout << "Enter list length: ";
+            std::cin >> length;
+            // Built back to front, so each node is stored before the root holding it goes away
+            Root<ListNode> head;
+            for (int i = length - 1; i >= 0; --i) {
+                head = myHeap.New<ListNode>(ListNode{ head, i });
+                if (head.IsNull()) break;
+            }
+            typedList = head;
+            if (!typedList.IsNull()) {
+                std::cout << "Typed list of " << length << " nodes, head Block ID " << typedList.Get().BlockId() << "\n";
+            }
+            break;
+        }
+        case 18: {
+            incrementalGC = !incrementalGC;
+            if (incrementalGC) {
+                uint64_t microseconds;
+                size_t workUnits;
+                std::cout << "Enter time budget per slice in microseconds (0 for no limit): ";
+                std::cin >> microseconds;
+                std::cout << "Enter work units per slice (0 for no limit): ";
+                std::cin >> workUnits;
+                myHeap.SetIncrementalBudget(microseconds, workUnits);
+            }
+            myHeap.SetIncrementalGC(incrementalGC);
+            break;
+        }
+        case 19: {
+            size_t threshold;
+            std::cout << "Enter the smallest size for a large object in bytes (0 to disable): ";
+            std::cin >> threshold;
+            char hugePages = 'n';
+            if (threshold > 0) {
+                std::cout << "Use transparent huge pages for objects of several MiB (y/n): ";
+                std::cin >> hugePages;
+            }
+            myHeap.SetLargeObjectSpace(threshold, hugePages == 'y');
+            break;
+        }
+        case 20:
+            myHeap.PrintNumaStats();
+            break;
+        case 21: {
+            std::cout << "Enter snapshot file path: ";
+            std::string path;
+            std::cin >> path;
+            myHeap.SaveSnapshot(path);
+            break;
+        }
+        case 22: {
+            std::cout << "Enter snapshot file path: ";
+            std::string path;
+            std::cin >> path;
+            char verify;
+            std::cout << "Verify every segment's checksum (y/n): ";
+            std::cin >> verify;
+            // Block IDs of the current contents are void after a load, so the typed list lets go of its root first
+            Ref<ListNode> list = typedList.Get();
+            typedList = Root<ListNode>();
+            if (!myHeap.LoadSnapshot(path, verify == 'y')) {
+                typedList = Root<ListNode>(myHeap, list);
+            }
+            break;
+        }
+        case 23:
+            StopTrace();
             return 0;
         default:
             std::cout << "Invalid choice. Please try again.\n";
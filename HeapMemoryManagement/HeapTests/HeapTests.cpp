@@ -0,0 +1,114 @@
+#include "../HeapMemoryManagement/Heap.h"
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+
+// Multi-threaded checks of what the heap promises to code holding object addresses, which
+// single-threaded use cannot show. Each test prints its result; the exit code is the number
+// of failed tests.
+
+struct Counter {
+    Ref<Counter> next;
+    long value;
+};
+HEAP_TYPE(Counter, HEAP_REFERENCE(Counter, next));
+
+struct Filler {
+    char bytes[48];
+};
+HEAP_LEAF_TYPE(Filler);
+
+namespace {
+
+    // Threads write through pinned addresses while their own and the other threads' nursery
+    // allocations run minor collections. A collection that copied a pinned object out of the
+    // nursery would leave the second write in the copy it abandoned.
+    bool testNurseryPinning() {
+        const size_t threadCount = 4;
+        const int iterations = 300;
+        Heap heap(1 << 20, threadCount, 4, 0);
+        heap.SetNursery(64 * 1024);
+
+        std::atomic<size_t> lostWrites{ 0 };
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < threadCount; ++t) {
+            threads.emplace_back([&] {
+                Root<Counter> counter;
+                for (int i = 0; i < iterations; ++i) {
+                    // A fresh object now and then, since only the nursery's first collection moves one
+                    if (i % 10 == 0) counter = heap.New<Counter>();
+                    {
+                        Pinned<Counter> pinned = heap.Get(counter.Get());
+                        pinned->value = i;
+                        for (int j = 0; j < 100; ++j) {
+                            heap.New<Filler>();
+                        }
+                        pinned->value += 1;
+                    }
+                    if (counter->value != i + 1) ++lostWrites;
+                }
+                });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        std::cout << "Nursery pinning: " << lostWrites << " writes lost\n";
+        return lostWrites == 0;
+    }
+
+    // The same writes while another thread keeps compacting the old generation. Each round leaves
+    // the segments sparse with garbage, so the pinned counters sit in segments compaction would empty.
+    bool testCompactionPinning() {
+        const size_t threadCount = 4;
+        const int iterations = 1000;
+        Heap heap(1 << 20, threadCount + 1, 8, 0);
+        heap.SetCompactionThreshold(0.0);
+
+        // Collections report on cout; nothing else prints while the threads run
+        std::streambuf* output = std::cout.rdbuf(nullptr);
+        std::atomic<bool> done{ false };
+        std::thread collector([&] {
+            while (!done) {
+                heap.RunGenerationalGC();
+            }
+            });
+        std::atomic<size_t> lostWrites{ 0 };
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < threadCount; ++t) {
+            threads.emplace_back([&] {
+                Root<Counter> counter;
+                for (int i = 0; i < iterations; ++i) {
+                    if (i % 10 == 0) counter = heap.New<Counter>();
+                    {
+                        Pinned<Counter> pinned = heap.Get(counter.Get());
+                        pinned->value = i;
+                        for (int j = 0; j < 50; ++j) {
+                            heap.New<Counter>();
+                        }
+                        pinned->value += 1;
+                    }
+                    if (counter->value != i + 1) ++lostWrites;
+                }
+                });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        done = true;
+        collector.join();
+        std::cout.rdbuf(output);
+        std::cout << "Compaction pinning: " << lostWrites << " writes lost\n";
+        return lostWrites == 0;
+    }
+
+}
+
+int main() {
+    int failures = 0;
+    failures += testNurseryPinning() ? 0 : 1;
+    failures += testCompactionPinning() ? 0 : 1;
+    std::cout << (failures == 0 ? "All tests passed.\n" : "Some tests failed.\n");
+    return failures;
+}
@@ -0,0 +1,53 @@
+#include "../HeapMemoryManagement/Trace.h"
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+
+// Prints a trace written by StartTrace/StopTrace one event per line:
+//   time_us thread event first=... second=...
+// Records are written per thread, so lines are sorted by time only within a thread.
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        std::cerr << "Usage: TraceDecoder <trace file>\n";
+        return 1;
+    }
+
+    std::FILE* file = std::fopen(argv[1], "rb");
+    if (!file) {
+        std::cerr << "Cannot open " << argv[1] << ".\n";
+        return 1;
+    }
+
+    TraceFileHeader header;
+    if (std::fread(&header, sizeof(header), 1, file) != 1 || std::memcmp(header.magic, traceMagic, 4) != 0) {
+        std::cerr << argv[1] << " is not a heap trace.\n";
+        std::fclose(file);
+        return 1;
+    }
+    if (header.version != traceVersion || header.recordSize != sizeof(TraceRecord)) {
+        std::cerr << "Unsupported trace version " << header.version << " with " << header.recordSize << "-byte records.\n";
+        std::fclose(file);
+        return 1;
+    }
+
+    TraceRecord record;
+    size_t records = 0;
+    while (std::fread(&record, sizeof(record), 1, file) == 1) {
+        TraceEvent event = static_cast<TraceEvent>(record.event);
+        const char* first;
+        const char* second;
+        TraceArgumentNames(event, first, second);
+        std::printf("%12.3f %4u %-18s %s=%llu", record.timestamp / 1000.0, record.thread, TraceEventName(event),
+            first, static_cast<unsigned long long>(record.arguments[0]));
+        if (std::strcmp(second, "-") != 0) {
+            std::printf(" %s=%llu", second, static_cast<unsigned long long>(record.arguments[1]));
+        }
+        std::printf("\n");
+        ++records;
+    }
+    std::fclose(file);
+
+    std::cerr << records << " records.\n";
+    return 0;
+}